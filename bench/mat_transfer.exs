@@ -0,0 +1,45 @@
+# Cost of turning a frame into a binary for another node and back, PNG
+# against Mat.serialize. Build with ERL_CV_LZ4=1 to include LZ4.
+#
+#     mix run bench/mat_transfer.exs
+
+defmodule MatTransferBench do
+  @source 'synthetic://1280x720@0?pattern=moving_gradient&noise=6&realtime=0'
+  @rounds 200
+
+  def run do
+    {:ok, conn} = OpenCv.new()
+    {:ok, cap} = OpenCv.VideoCapture.open(conn, @source)
+    {:ok, frame} = OpenCv.VideoCapture.read(conn, cap)
+
+    measure("png", fn ->
+      OpenCv.imencode(conn, frame, '.png', [16, 1])
+    end)
+
+    measure("serialize", fn ->
+      {:ok, bin} = OpenCv.Mat.serialize(conn, frame)
+      {:ok, _} = OpenCv.Mat.deserialize(conn, bin)
+      bin
+    end)
+
+    case OpenCv.Mat.serialize(conn, frame, compress: :lz4) do
+      {:ok, _} ->
+        measure("serialize lz4", fn ->
+          {:ok, bin} = OpenCv.Mat.serialize(conn, frame, compress: :lz4)
+          {:ok, _} = OpenCv.Mat.deserialize(conn, bin)
+          bin
+        end)
+
+      {:error, :lz4_unavailable} ->
+        IO.puts("serialize lz4: not built in")
+    end
+  end
+
+  defp measure(name, fun) do
+    bin = fun.()
+    {usec, _} = :timer.tc(fn -> Enum.each(1..@rounds, fn _ -> fun.() end) end)
+    IO.puts("#{name}: #{Float.round(usec / @rounds / 1000, 2)} ms, #{byte_size(bin)} bytes")
+  end
+end
+
+MatTransferBench.run()
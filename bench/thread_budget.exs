@@ -0,0 +1,113 @@
+# Tail latency of OpenCV work while every scheduler is busy, under different
+# thread budgets. Frames come from the synthetic source, so no camera is
+# needed.
+#
+# OpenCV's thread pool is process wide, so run one configuration per VM.
+# :avoid_schedulers needs bound schedulers and CPUs left without one, so
+# give +S fewer schedulers than there are CPUs (here 8):
+#
+#     mix run bench/thread_budget.exs default
+#     mix run bench/thread_budget.exs single
+#     elixir --erl "+sbt db +S 6" -S mix run bench/thread_budget.exs avoid_schedulers
+
+defmodule ThreadBudgetBench do
+  @source 'synthetic://1280x720@0?pattern=moving_gradient&noise=6&realtime=0'
+  @workers 4
+  @duration 10_000
+
+  def configs do
+    %{
+      "default" => [],
+      "single" => [cv_threads: 1],
+      "avoid_schedulers" => [avoid_schedulers: true, cv_threads: free_cpus()]
+    }
+  end
+
+  defp free_cpus do
+    available =
+      case :erlang.system_info(:logical_processors_available) do
+        n when is_integer(n) -> n
+        _ -> :erlang.system_info(:logical_processors_online)
+      end
+
+    available - :erlang.system_info(:schedulers_online)
+  end
+
+  def run("avoid_schedulers" = name) do
+    if free_cpus() < 1 do
+      IO.puts("every CPU has a scheduler, start the VM with fewer, e.g. +sbt db +S 6")
+      System.halt(1)
+    end
+
+    run_config(name)
+  end
+
+  def run(name), do: run_config(name)
+
+  defp run_config(name) do
+    opts = Map.fetch!(configs(), name)
+    load = start_scheduler_load()
+
+    parent = self()
+    deadline = System.monotonic_time(:millisecond) + @duration
+
+    for _ <- 1..@workers do
+      spawn_link(fn -> send(parent, {:latencies, worker(opts, deadline, [])}) end)
+    end
+
+    latencies =
+      Enum.reduce(1..@workers, [], fn _, acc ->
+        receive do
+          {:latencies, l} -> l ++ acc
+        end
+      end)
+
+    Enum.each(load, &Process.exit(&1, :kill))
+    report(name, opts, latencies)
+  end
+
+  defp worker(opts, deadline, acc) do
+    {:ok, conn} = OpenCv.new(opts)
+    {:ok, cap} = OpenCv.VideoCapture.open(conn, @source)
+    loop(conn, cap, deadline, acc)
+  end
+
+  defp loop(conn, cap, deadline, acc) do
+    if System.monotonic_time(:millisecond) >= deadline do
+      acc
+    else
+      {usec, _} =
+        :timer.tc(fn ->
+          {:ok, frame} = OpenCv.VideoCapture.read(conn, cap)
+          {:ok, _} = OpenCv.Stats.compute(conn, frame, [:sharpness, :histogram])
+          _jpg = OpenCv.imencode(conn, frame, '.jpg', [1, 85])
+        end)
+
+      loop(conn, cap, deadline, [usec | acc])
+    end
+  end
+
+  # One busy process per scheduler keeps the BEAM's cores occupied
+  defp start_scheduler_load do
+    for _ <- 1..:erlang.system_info(:schedulers_online) do
+      spawn(fn -> spin(0) end)
+    end
+  end
+
+  defp spin(n), do: spin(rem(n * 31 + 7, 1_000_003))
+
+  defp report(name, opts, latencies) do
+    sorted = Enum.sort(latencies)
+    count = length(sorted)
+    pct = fn p -> Enum.at(sorted, min(count - 1, trunc(count * p))) / 1000 end
+
+    IO.puts("#{name} #{inspect(opts)}")
+    IO.puts("  frames/s: #{Float.round(count / (@duration / 1000), 1)}")
+    IO.puts("  latency ms: p50 #{pct.(0.5)}  p90 #{pct.(0.9)}  p99 #{pct.(0.99)}")
+  end
+end
+
+case System.argv() do
+  [name] -> ThreadBudgetBench.run(name)
+  _ -> IO.puts("usage: mix run bench/thread_budget.exs default|single|avoid_schedulers")
+end
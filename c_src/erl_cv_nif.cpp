@@ -17,33 +17,215 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
 
 #include "erl_nif.h"
 #include "erl_cv_util.hpp"
 #include "queue.hpp"
+#include "phash_index.hpp"
+#include "frame_ring.hpp"
+#include "erl_cv_trace.hpp"
+#include "synthetic_capture.hpp"
+#include "mat_format.hpp"
+#include "rate_encoder.hpp"
+#include "stream_encoder.hpp"
 
 #include "opencv2/opencv.hpp"
 
 #define MAX_PATHNAME 512
 
+/* Input bytes encoded per run of a streaming encode, at least 16 rows */
+#define ENCODE_STREAM_SLICE (1 << 20)
+#define ENCODE_STREAM_MIN_ROWS 16
+
+typedef struct {
+    uint64_t key;
+    uint64_t last_used;
+    ErlNifEnv *env;
+    ERL_NIF_TERM binary;
+} encode_cache_slot;
+
+/*
+ * Encoded outputs keyed on a hash of the Mat contents, extension and params.
+ * Only touched from the connection thread.
+ */
+typedef struct {
+    int noise_tolerant;
+    uint64_t tick;
+    uint64_t hits;
+    uint64_t misses;
+    std::vector<encode_cache_slot> slots;
+} encode_cache;
+
+typedef enum {
+    detector_cascade,
+    detector_hog_people,
+} detector_kind;
+
+static ErlNifResourceType *erl_cv_detector_type = NULL;
+typedef struct {
+    detector_kind kind;
+    cv::CascadeClassifier* cascade;
+    cv::HOGDescriptor* hog;
+    /* CascadeClassifier::detectMultiScale is not safe to call concurrently */
+    ErlNifMutex* lock;
+} erl_cv_detector;
+
+typedef struct command_pool_t command_pool;
+
+/*
+ * A network with its own batching thread. Inference requests from any
+ * number of processes queue up on the net and run as one forward pass.
+ */
+static ErlNifResourceType *erl_cv_net_type = NULL;
+typedef struct {
+    cv::dnn::Net* net;
+    ErlNifTid tid;
+    ErlNifThreadOpts* opts;
+    queue *requests;
+    command_pool *pool;
+    int max_batch;
+    int max_wait_us;
+    cv::Size size;
+    double scale;
+    cv::Scalar mean;
+    int swap_rb;
+} erl_cv_net;
+
+typedef struct {
+    erl_cv_net *enet;
+} erl_cv_net_handle;
+
+/*
+ * Connection state lives outside the resource, its threads may still be
+ * winding down on the reaper after the resource is gone.
+ */
 static ErlNifResourceType *erl_cv_type = NULL;
 typedef struct {
     ErlNifTid tid;
     ErlNifThreadOpts* opts;
     ErlNifPid notification_pid;
     queue *commands;
+    command_pool *pool;
+    encode_cache *cache;
+    std::map<std::string, erl_cv_detector*> *detectors;
+
+    /* Encode-and-write requests run on their own I/O thread */
+    ErlNifTid io_tid;
+    ErlNifThreadOpts* io_opts;
+    queue *writes;
+
+    /* Thread budget, applied by the connection's threads as they start */
+    int cv_threads;
+    int pinned;
+    cpu_set_t cpus;
+
+    /* Held by the resource and by the reaper while it joins the threads */
+    ErlNifMutex *lock;
+    int refs;
+    int closed;
 } erl_cv_connection;
 
+typedef struct {
+    erl_cv_connection *conn;
+} erl_cv_connection_handle;
+
 static ErlNifResourceType *erl_cv_mat_type = NULL;
 typedef struct {
     cv::Mat* mat;
 } erl_cv_mat;
 
+/*
+ * Stacks the frames a capture hands out, either as a running weighted
+ * average or as the median of the last `window` frames.
+ */
+#define MAX_MEDIAN_WINDOW 64
+
+typedef enum {
+    accumulate_average,
+    accumulate_median,
+} accumulate_kind;
+
+typedef struct {
+    accumulate_kind kind;
+    double alpha;
+    int window;
+    int depth;
+    cv::Mat *sum;                 /* running average, 32 bit float */
+    std::vector<cv::Mat> *frames; /* ring of the last `window` frames */
+    cv::Mat *scratch;             /* frame buffer reused by feed */
+    int next;
+    int count;
+} frame_accumulator;
+
 static ErlNifResourceType *erl_cv_video_capture_type = NULL;
 typedef struct {
     cv::VideoCapture* cap;
+    frame_ring *ring;
+    frame_accumulator *acc;
 } erl_cv_video_capture;
 
+static ErlNifResourceType *erl_cv_jpeg_encoder_type = NULL;
+typedef struct {
+    rate_encoder *encoder;
+    /* Every encode updates the rate model */
+    ErlNifMutex *lock;
+} erl_cv_jpeg_encoder;
+
+static ErlNifResourceType *erl_cv_decode_window_type = NULL;
+/*
+ * Frames of a parallel decode that may be in flight past the last one the
+ * caller consumed. Decoders wait here, the caller moves it forward.
+ */
+typedef struct {
+    ErlNifMutex *lock;
+    ErlNifCond *cond;
+    int size;
+    int released;                 /* frames before this have been consumed */
+    int cancelled;
+    ErlNifMonitor monitor;
+} erl_cv_decode_window;
+
+static ErlNifResourceType *erl_cv_encode_stream_type = NULL;
+typedef struct {
+    stream_encoder *encoder;
+    int slice_rows;
+    ErlNifPid pid;
+    ErlNifEnv *ref_env;           /* holds ref */
+    ERL_NIF_TERM ref;
+    ErlNifEnv *msg_env;           /* chunks are sent from here */
+    erl_cv_connection *conn;      /* only compared, acks name the connection */
+    ErlNifMutex *lock;            /* guards the fields below */
+    int window;                   /* unacked chunks before parking, 0 never parks */
+    int outstanding;
+    int parked;
+} erl_cv_encode_stream;
+
+static ErlNifResourceType *erl_cv_phash_index_type = NULL;
+typedef struct {
+    phash_index *index;
+} erl_cv_phash_index;
+
+static ErlNifResourceType *erl_cv_features_type = NULL;
+typedef struct {
+    std::vector<cv::KeyPoint>* keypoints;
+    cv::Mat* descriptors;
+} erl_cv_features;
+
+static ErlNifResourceType *erl_cv_matcher_type = NULL;
+typedef struct {
+    cv::DescriptorMatcher* matcher;
+} erl_cv_matcher;
+
 typedef enum {
     cmd_unknown,
     cmd_stop,
@@ -55,23 +237,178 @@ typedef enum {
     cmd_video_capture_read,
     cmd_video_capture_get,
     cmd_video_capture_set,
+    cmd_video_capture_ring,
+    cmd_video_capture_accumulate,
+    cmd_video_capture_feed,
+    cmd_video_capture_stacked,
+    cmd_video_capture_sample,
+    cmd_video_file_parallel_map,
     cmd_imencode,
+    cmd_imencode_stream,
+    cmd_imencode_stream_continue,
+    cmd_imwrite_async,
     cmd_new_mat,
+    cmd_encode_cache_config,
+    cmd_encode_cache_stats,
+    cmd_jpeg_encoder_new,
+    cmd_jpeg_encoder_encode,
+    cmd_jpeg_encoder_stats,
+    cmd_mat_roi,
+    cmd_mat_to_binary,
+    cmd_mat_serialize,
+    cmd_mat_deserialize,
+    cmd_stats,
+    cmd_detector_load,
+    cmd_detect,
+    cmd_dnn_read_net,
+    cmd_dnn_infer,
+    cmd_orb_extract,
+    cmd_features_descriptors,
+    cmd_matcher_new,
+    cmd_matcher_match,
+    cmd_phash,
+    cmd_phash_index_new,
+    cmd_phash_index_insert,
+    cmd_phash_index_query,
+    cmd_phash_index_save,
+    cmd_phash_index_load,
+    cmd_submit_batch,
 } command_type;
 
-typedef struct {
+typedef struct erl_cv_command_t {
     command_type type;
 
     ErlNifEnv *env;
     ERL_NIF_TERM ref;
     ErlNifPid pid;
     ERL_NIF_TERM arg;
+
+    command_pool *pool;
+    struct erl_cv_command_t *next;
+
+    /* Time of the push when tracing, 0 otherwise */
+    uint64_t queued_at;
 } erl_cv_command;
 
+/*
+ * Free list of commands owned by a connection. Released commands keep their
+ * environment, cleared, so the next command needs no allocation.
+ */
+#define MAX_POOLED_COMMANDS 64
+
+struct command_pool_t {
+    ErlNifMutex *lock;
+    erl_cv_command *free;
+    int count;
+};
+
+/*
+ * Span names for tracing
+ */
+static const char *
+command_name(command_type type)
+{
+    switch(type) {
+      case cmd_unknown: return "unknown";
+      case cmd_stop: return "stop";
+      case cmd_video_capture_open: return "video_capture_open";
+      case cmd_video_capture_close: return "video_capture_close";
+      case cmd_video_capture_is_opened: return "video_capture_is_opened";
+      case cmd_video_capture_grab: return "video_capture_grab";
+      case cmd_video_capture_retrieve: return "video_capture_retrieve";
+      case cmd_video_capture_read: return "video_capture_read";
+      case cmd_video_capture_get: return "video_capture_get";
+      case cmd_video_capture_set: return "video_capture_set";
+      case cmd_video_capture_ring: return "video_capture_ring";
+      case cmd_video_capture_accumulate: return "video_capture_accumulate";
+      case cmd_video_capture_feed: return "video_capture_feed";
+      case cmd_video_capture_stacked: return "video_capture_stacked";
+      case cmd_video_capture_sample: return "video_capture_sample";
+      case cmd_video_file_parallel_map: return "video_file_parallel_map";
+      case cmd_imencode: return "imencode";
+      case cmd_imencode_stream: return "imencode_stream";
+      case cmd_imencode_stream_continue: return "imencode_stream";
+      case cmd_imwrite_async: return "imwrite_async";
+      case cmd_new_mat: return "new_mat";
+      case cmd_encode_cache_config: return "encode_cache_config";
+      case cmd_encode_cache_stats: return "encode_cache_stats";
+      case cmd_jpeg_encoder_new: return "jpeg_encoder_new";
+      case cmd_jpeg_encoder_encode: return "jpeg_encoder_encode";
+      case cmd_jpeg_encoder_stats: return "jpeg_encoder_stats";
+      case cmd_mat_roi: return "mat_roi";
+      case cmd_mat_to_binary: return "mat_to_binary";
+      case cmd_mat_serialize: return "mat_serialize";
+      case cmd_mat_deserialize: return "mat_deserialize";
+      case cmd_stats: return "stats";
+      case cmd_detector_load: return "detector_load";
+      case cmd_detect: return "detect";
+      case cmd_dnn_read_net: return "dnn_read_net";
+      case cmd_dnn_infer: return "dnn_infer";
+      case cmd_orb_extract: return "orb_extract";
+      case cmd_features_descriptors: return "features_descriptors";
+      case cmd_matcher_new: return "matcher_new";
+      case cmd_matcher_match: return "matcher_match";
+      case cmd_phash: return "phash";
+      case cmd_phash_index_new: return "phash_index_new";
+      case cmd_phash_index_insert: return "phash_index_insert";
+      case cmd_phash_index_query: return "phash_index_query";
+      case cmd_phash_index_save: return "phash_index_save";
+      case cmd_phash_index_load: return "phash_index_load";
+      case cmd_submit_batch: return "submit_batch";
+    }
+    return "unknown";
+}
+
 static ERL_NIF_TERM atom_erl_cv;
+static ERL_NIF_TERM atom_frame;
+static ERL_NIF_TERM atom_ref;
+static ERL_NIF_TERM atom_chunk;
+/* Returned by commands that queued a continuation and answer later */
+static ERL_NIF_TERM atom_pending;
 
 static ERL_NIF_TERM push_command(ErlNifEnv *env, erl_cv_connection *conn, erl_cv_command *cmd);
 
+static int
+get_connection(ErlNifEnv *env, ERL_NIF_TERM term, erl_cv_connection **conn)
+{
+    erl_cv_connection_handle *handle;
+
+    if(!enif_get_resource(env, term, erl_cv_type, (void **) &handle))
+        return 0;
+    *conn = handle->conn;
+    return 1;
+}
+
+static ERL_NIF_TERM
+make_mat(ErlNifEnv *env, const cv::Mat &mat)
+{
+    erl_cv_mat *emat;
+    ERL_NIF_TERM ret;
+
+    emat = (erl_cv_mat*) enif_alloc_resource(erl_cv_mat_type, sizeof(erl_cv_mat));
+    if(!emat)
+        return make_error_tuple(env, "no_memory");
+    emat->mat = new cv::Mat(mat);
+
+    ret = enif_make_resource(env, emat);
+    enif_release_resource(emat);
+    return ret;
+}
+
+static int
+get_params(ErlNifEnv *env, ERL_NIF_TERM list, std::vector<int> &params)
+{
+    ERL_NIF_TERM head;
+    int val;
+
+    while(enif_get_list_cell(env, list, &head, &list)) {
+        if(!enif_get_int(env, head, &val))
+            return 0;
+        params.push_back(val);
+    }
+    return enif_is_empty_list(env, list);
+}
+
 static void
 command_destroy(void *obj)
 {
@@ -84,24 +421,228 @@ command_destroy(void *obj)
 }
 
 static erl_cv_command*
-command_create()
+command_create(command_pool *pool)
 {
-    erl_cv_command *cmd = (erl_cv_command *) enif_alloc(sizeof(erl_cv_command));
-    if(cmd == NULL)
-	   return NULL;
+    erl_cv_command *cmd = NULL;
 
-    cmd->env = enif_alloc_env();
-    if(cmd->env == NULL) {
-	    command_destroy(cmd);
-        return NULL;
+    if(pool) {
+        enif_mutex_lock(pool->lock);
+        cmd = pool->free;
+        if(cmd) {
+            pool->free = cmd->next;
+            pool->count--;
+        }
+        enif_mutex_unlock(pool->lock);
+    }
+
+    if(cmd == NULL) {
+        cmd = (erl_cv_command *) enif_alloc(sizeof(erl_cv_command));
+        if(cmd == NULL)
+            return NULL;
+
+        cmd->env = enif_alloc_env();
+        if(cmd->env == NULL) {
+            command_destroy(cmd);
+            return NULL;
+        }
     }
 
     cmd->type = cmd_unknown;
     cmd->ref = 0;
     cmd->arg = 0;
+    cmd->pool = pool;
+    cmd->next = NULL;
+    cmd->queued_at = trace_enabled() ? trace_now() : 0;
     return cmd;
 }
 
+/*
+ * Tells the thread popping a queue to finish. There is one for all queues,
+ * so stopping a thread never depends on an allocation succeeding.
+ */
+static erl_cv_command stop_command = {cmd_stop, NULL, 0, ErlNifPid(), 0, NULL, NULL, 0};
+
+/*
+ * Hands a command back to the pool it came from, or frees it
+ */
+static void
+command_release(erl_cv_command *cmd)
+{
+    command_pool *pool = cmd->pool;
+
+    if(cmd == &stop_command)
+        return;
+
+    if(pool) {
+        enif_clear_env(cmd->env);
+
+        enif_mutex_lock(pool->lock);
+        if(pool->count < MAX_POOLED_COMMANDS) {
+            cmd->next = pool->free;
+            pool->free = cmd;
+            pool->count++;
+            cmd = NULL;
+        }
+        enif_mutex_unlock(pool->lock);
+    }
+
+    if(cmd)
+        command_destroy(cmd);
+}
+
+static command_pool *
+command_pool_create()
+{
+    command_pool *pool = (command_pool *) enif_alloc(sizeof(command_pool));
+    if(!pool)
+        return NULL;
+
+    pool->lock = enif_mutex_create((char*) "erl_cv_command_pool");
+    if(!pool->lock) {
+        enif_free(pool);
+        return NULL;
+    }
+    pool->free = NULL;
+    pool->count = 0;
+    return pool;
+}
+
+static void
+command_pool_destroy(command_pool *pool)
+{
+    while(pool->free) {
+        erl_cv_command *cmd = pool->free;
+        pool->free = cmd->next;
+        command_destroy(cmd);
+    }
+    enif_mutex_destroy(pool->lock);
+    enif_free(pool);
+}
+
+/*
+ * Asks the thread popping from q to finish once it reaches this command.
+ * Pushed on the queue's reserved entry, so it always gets through.
+ */
+static void
+push_stop(queue *q)
+{
+    queue_push_last(q, &stop_command);
+}
+
+static frame_accumulator *
+accumulator_create(accumulate_kind kind, double alpha, int window)
+{
+    frame_accumulator *acc = (frame_accumulator *) enif_alloc(sizeof(frame_accumulator));
+    if(!acc)
+        return NULL;
+
+    acc->kind = kind;
+    acc->alpha = alpha;
+    acc->window = window;
+    acc->depth = CV_8U;
+    acc->sum = new cv::Mat();
+    acc->frames = new std::vector<cv::Mat>(kind == accumulate_median ? window : 0);
+    acc->scratch = new cv::Mat();
+    acc->next = 0;
+    acc->count = 0;
+    return acc;
+}
+
+static void
+accumulator_destroy(frame_accumulator *acc)
+{
+    delete acc->sum;
+    delete acc->frames;
+    delete acc->scratch;
+    enif_free(acc);
+}
+
+/*
+ * Adds a frame in place. A frame of another size or type starts over.
+ */
+static void
+accumulator_add(frame_accumulator *acc, const cv::Mat &frame)
+{
+    if(acc->kind == accumulate_average) {
+        if(acc->count == 0 || acc->sum->size() != frame.size() ||
+           acc->sum->channels() != frame.channels() || acc->depth != frame.depth()) {
+            frame.convertTo(*acc->sum, CV_32F);
+            acc->depth = frame.depth();
+            acc->count = 1;
+        } else {
+            cv::accumulateWeighted(frame, *acc->sum, acc->alpha);
+            acc->count++;
+        }
+        return;
+    }
+
+    if(acc->count > 0) {
+        const cv::Mat &last = (*acc->frames)[(acc->next + acc->window - 1) % acc->window];
+        if(last.size() != frame.size() || last.type() != frame.type()) {
+            acc->count = 0;
+            acc->next = 0;
+        }
+    }
+
+    /* copyTo reuses the slot's buffer once the ring is full */
+    frame.copyTo((*acc->frames)[acc->next]);
+    acc->depth = frame.depth();
+    acc->next = (acc->next + 1) % acc->window;
+    acc->count = std::min(acc->count + 1, acc->window);
+}
+
+class median_body : public cv::ParallelLoopBody
+{
+public:
+    median_body(const std::vector<cv::Mat> &frames, int count, cv::Mat &out)
+        : frames(frames), count(count), out(out) {}
+
+    void operator()(const cv::Range &range) const
+    {
+        uchar values[MAX_MEDIAN_WINDOW];
+        const uchar *rows[MAX_MEDIAN_WINDOW];
+        int width = out.cols * out.channels();
+
+        for(int y = range.start; y < range.end; y++) {
+            uchar *dst = out.ptr(y);
+            for(int i = 0; i < count; i++)
+                rows[i] = frames[i].ptr(y);
+
+            for(int x = 0; x < width; x++) {
+                for(int i = 0; i < count; i++)
+                    values[i] = rows[i][x];
+                std::nth_element(values, values + count / 2, values + count);
+                dst[x] = values[count / 2];
+            }
+        }
+    }
+
+private:
+    const std::vector<cv::Mat> &frames;
+    int count;
+    cv::Mat &out;
+};
+
+static const char *
+accumulator_result(frame_accumulator *acc, cv::Mat &out)
+{
+    if(acc->count == 0)
+        return "empty";
+
+    if(acc->kind == accumulate_average) {
+        acc->sum->convertTo(out, acc->depth);
+        return NULL;
+    }
+
+    if(acc->depth != CV_8U)
+        return "unsupported_depth";
+
+    const cv::Mat &first = (*acc->frames)[0];
+    out.create(first.rows, first.cols, first.type());
+    cv::parallel_for_(cv::Range(0, out.rows), median_body(*acc->frames, acc->count, out));
+    return NULL;
+}
+
 static ERL_NIF_TERM
 do_vc_open(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
 {
@@ -117,13 +658,38 @@ do_vc_open(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
     ecap = (erl_cv_video_capture*) enif_alloc_resource(erl_cv_video_capture_type, sizeof(erl_cv_video_capture));
     if(!ecap)
         return make_error_tuple(env, "no_memory");
-    ecap->cap = new cv::VideoCapture(filename);
+    if(SyntheticCapture::is_synthetic(filename))
+        ecap->cap = new SyntheticCapture(filename);
+    else
+        ecap->cap = new cv::VideoCapture(filename);
+    ecap->ring = NULL;
+    ecap->acc = NULL;
 
     ret = enif_make_resource(env, ecap);
     enif_release_resource(ecap);
     return make_ok_tuple(env, ret);
 }
 
+/*
+ * Releases the device, ring and accumulator of a capture
+ */
+static void
+capture_release(erl_cv_video_capture *ecap)
+{
+    if(ecap->cap) {
+        delete ecap->cap;
+        ecap->cap = NULL;
+    }
+    if(ecap->ring) {
+        frame_ring_destroy(ecap->ring);
+        ecap->ring = NULL;
+    }
+    if(ecap->acc) {
+        accumulator_destroy(ecap->acc);
+        ecap->acc = NULL;
+    }
+}
+
 static ERL_NIF_TERM
 do_vc_close(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
 {
@@ -131,11 +697,8 @@ do_vc_close(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
     if(!enif_get_resource(env, arg, erl_cv_video_capture_type, (void **) &ecap))
         return enif_make_badarg(env);
 
-    if(ecap->cap) {
-        delete ecap->cap;
-    }
-
-    return make_atom(env, "ok");
+    capture_release(ecap);
+    return atom_ok;
 }
 
 static ERL_NIF_TERM
@@ -146,7 +709,7 @@ do_vc_is_opened(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
         return enif_make_badarg(env);
     if(ecap->cap == NULL)
         return make_error_tuple(env, "not_open");
-    return ecap->cap->isOpened() ? enif_make_atom(env, "true") : enif_make_atom(env, "false");
+    return ecap->cap->isOpened() ? atom_true : atom_false;
 }
 
 static ERL_NIF_TERM
@@ -162,7 +725,22 @@ do_vc_grab(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
     if(!ecap->cap->isOpened())
         return make_error_tuple(env, "not_open");
     
-    return ecap->cap->grab() ? make_atom(env, "true") : make_atom(env, "false");
+    trace_scope span("VideoCapture::grab");
+    return ecap->cap->grab() ? atom_true : atom_false;
+}
+
+/*
+ * Called with every frame a capture hands out
+ */
+static void
+capture_frame(erl_cv_video_capture *ecap, const cv::Mat &frame)
+{
+    if(frame.empty())
+        return;
+    if(ecap->ring)
+        frame_ring_publish(ecap->ring, frame);
+    if(ecap->acc)
+        accumulator_add(ecap->acc, frame);
 }
 
 static ERL_NIF_TERM
@@ -197,11 +775,13 @@ do_vc_retrieve(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
     if(!ecap->cap->isOpened())
         return make_error_tuple(env, "not_open");
 
+    trace_scope span("VideoCapture::retrieve");
     if (!ecap->cap->retrieve(*emat->mat, flag))
-        return make_atom(env, "false");
+        return atom_false;
+    capture_frame(ecap, *emat->mat);
 
     if(emat->mat->empty()) {
-        emat_term = make_atom(env, "nil");
+        emat_term = atom_nil;
     } else {
         emat_term = enif_make_resource(env, emat);
     }
@@ -230,11 +810,13 @@ do_vc_read(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
     if(!ecap->cap->isOpened())
         return make_error_tuple(env, "not_open");
 
+    trace_scope span("VideoCapture::read");
     if(!ecap->cap->read(*emat->mat))
-        return make_atom(env, "false");
+        return atom_false;
+    capture_frame(ecap, *emat->mat);
 
     if(emat->mat->empty()) {
-        ret = make_atom(env, "nil");
+        ret = atom_nil;
     } else {
         ret = enif_make_resource(env, emat);
     }
@@ -242,289 +824,4720 @@ do_vc_read(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
     return make_ok_tuple(env, ret);
 }
 
+/*
+ * Attaches a shared memory frame ring to a capture, {cap, name, slots, slot_size},
+ * or detaches it again, {cap, nil}.
+ */
 static ERL_NIF_TERM
-do_vc_get(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+do_vc_ring(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
 {
     erl_cv_video_capture *ecap;
-    int argc, propid;
-    double value;
+    char name[MAX_PATHNAME];
+    unsigned int slots;
+    ErlNifUInt64 slot_size;
+    int argc;
     const ERL_NIF_TERM *argv;
 
     if(!enif_get_tuple(env, arg, &argc, &argv))
         return enif_make_badarg(env);
-    
-    if(argc != 2)
+
+    if(argc < 2)
         return enif_make_badarg(env);
 
-    enif_fprintf(stderr, "%T ????\r\n", argv[0]);
     if(!enif_get_resource(env, argv[0], erl_cv_video_capture_type, (void **) &ecap))
         return enif_make_badarg(env);
 
-    if(ecap->cap == NULL)
-        return make_error_tuple(env, "not_open");
+    if(ecap->ring) {
+        frame_ring_destroy(ecap->ring);
+        ecap->ring = NULL;
+    }
 
-    if(!enif_get_int(env, argv[1], &propid))
-        return make_error_tuple(env, "invalid_propid");
+    if(argc == 2 && enif_is_identical(argv[1], atom_nil))
+        return atom_ok;
 
-    value = ecap->cap->get(propid);
-    return enif_make_double(env, value);
+    if(argc != 4)
+        return enif_make_badarg(env);
+
+    if(enif_get_string(env, argv[1], name, MAX_PATHNAME, ERL_NIF_LATIN1) <= 0 || name[0] != '/')
+        return make_error_tuple(env, "invalid_name");
+
+    if(!enif_get_uint(env, argv[2], &slots) || slots == 0 || slots > FRAME_RING_MAX_SLOTS)
+        return make_error_tuple(env, "invalid_slots");
+
+    if(!enif_get_uint64(env, argv[3], &slot_size) || slot_size == 0 || slot_size > FRAME_RING_MAX_SLOT_SIZE)
+        return make_error_tuple(env, "invalid_slot_size");
+
+    ecap->ring = frame_ring_create(name, slots, slot_size);
+    if(!ecap->ring)
+        return make_error_tuple(env, "ring_create_failed");
+
+    return atom_ok;
 }
 
+/*
+ * Starts stacking the frames of a capture, {cap, average, alpha} or
+ * {cap, median, window}, or stops it again, {cap, nil}.
+ */
 static ERL_NIF_TERM
-do_vc_set(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+do_vc_accumulate(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
 {
     erl_cv_video_capture *ecap;
-    int argc, propid;
-    double value;
-    const ERL_NIF_TERM* argv;
+    frame_accumulator *acc;
+    int argc, window = 0;
+    double alpha = 0;
+    const ERL_NIF_TERM *argv;
 
     if(!enif_get_tuple(env, arg, &argc, &argv))
         return enif_make_badarg(env);
-    
-    if(argc != 3)
+
+    if(argc < 2)
         return enif_make_badarg(env);
 
     if(!enif_get_resource(env, argv[0], erl_cv_video_capture_type, (void **) &ecap))
         return enif_make_badarg(env);
 
-    if(ecap->cap == NULL)
-        return make_error_tuple(env, "not_open");
-    
-    if(!enif_get_int(env, argv[1], &propid))
-        return make_error_tuple(env, "invalid_propid");
-    
-    if(!enif_get_double(env, argv[2], &value))
-        return make_error_tuple(env, "invalid_propvalue");
+    if(argc == 2 && enif_is_identical(argv[1], atom_nil)) {
+        if(ecap->acc) {
+            accumulator_destroy(ecap->acc);
+            ecap->acc = NULL;
+        }
+        return atom_ok;
+    }
+
+    if(argc != 3)
+        return enif_make_badarg(env);
+
+    if(enif_is_identical(argv[1], make_atom(env, "average"))) {
+        if(!enif_get_double(env, argv[2], &alpha) || alpha <= 0 || alpha > 1)
+            return make_error_tuple(env, "invalid_alpha");
+        acc = accumulator_create(accumulate_average, alpha, 0);
+    } else if(enif_is_identical(argv[1], make_atom(env, "median"))) {
+        if(!enif_get_int(env, argv[2], &window) || window < 1 || window > MAX_MEDIAN_WINDOW)
+            return make_error_tuple(env, "invalid_window");
+        acc = accumulator_create(accumulate_median, 0, window);
+    } else {
+        return make_error_tuple(env, "invalid_kind");
+    }
 
-    return ecap->cap->set(propid, value) ? enif_make_atom(env, "true") : enif_make_atom(env, "false");
+    if(!acc)
+        return make_error_tuple(env, "no_memory");
+
+    if(ecap->acc)
+        accumulator_destroy(ecap->acc);
+    ecap->acc = acc;
+    return atom_ok;
 }
 
+/*
+ * Reads up to N frames straight into the accumulator, {cap, n}. Nothing but
+ * the number of frames read is sent back.
+ */
 static ERL_NIF_TERM
-do_imencode(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+do_vc_feed(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
 {
-    erl_cv_mat *inemat;
-
-    int strSize;
-    unsigned int listLength;
-    int argc;
-    const ERL_NIF_TERM* argv;
+    erl_cv_video_capture *ecap;
+    int argc, count, read = 0;
+    const ERL_NIF_TERM *argv;
 
     if(!enif_get_tuple(env, arg, &argc, &argv))
         return enif_make_badarg(env);
 
-    if(argc != 3)
+    if(argc != 2)
         return enif_make_badarg(env);
 
-    // emat resource
-    if(!enif_get_resource(env, argv[0], erl_cv_mat_type, (void **) &inemat))
+    if(!enif_get_resource(env, argv[0], erl_cv_video_capture_type, (void **) &ecap))
         return enif_make_badarg(env);
 
-    // encoding extension
-    if(!enif_get_list_length(env, argv[1], &listLength))
-        return make_error_tuple(env, "invalid_string");
+    if(!enif_get_int(env, argv[1], &count) || count < 0)
+        return make_error_tuple(env, "invalid_count");
+
+    if(ecap->cap == NULL || !ecap->cap->isOpened())
+        return make_error_tuple(env, "not_open");
+
+    if(ecap->acc == NULL)
+        return make_error_tuple(env, "not_accumulating");
+
+    trace_scope span("VideoCapture::read");
+    while(read < count && ecap->cap->read(*ecap->acc->scratch)) {
+        capture_frame(ecap, *ecap->acc->scratch);
+        read++;
+    }
+
+    return make_ok_tuple(env, enif_make_int(env, read));
+}
+
+/*
+ * Returns the stacked frame as a new Mat
+ */
+static ERL_NIF_TERM
+do_vc_stacked(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_video_capture *ecap;
+    cv::Mat out;
+    const char *error;
+
+    if(!enif_get_resource(env, arg, erl_cv_video_capture_type, (void **) &ecap))
+        return enif_make_badarg(env);
+
+    if(ecap->acc == NULL)
+        return make_error_tuple(env, "not_accumulating");
+
+    error = accumulator_result(ecap->acc, out);
+    if(error)
+        return make_error_tuple(env, error);
+
+    return make_ok_tuple(env, make_mat(env, out));
+}
+
+/*
+ * Keeps one frame per interval and streams it to the caller as
+ * {frame, Index, Mat}. Skipped frames are only grabbed, so they are never
+ * converted or copied. With seek the capture jumps over them instead, the
+ * backend then decodes forward from the nearest keyframe. Sources without a
+ * frame count never end on their own, they need max, and a closed
+ * connection stops the run between frames either way.
+ */
+static ERL_NIF_TERM
+do_vc_sample(erl_cv_command *cmd, erl_cv_connection *conn)
+{
+    ErlNifEnv *env = cmd->env;
+    erl_cv_video_capture *ecap;
+    int argc, every, max, seek, start, index, target, sent;
+    double fps, interval, next;
+    const ERL_NIF_TERM *argv;
+    ErlNifEnv *msg_env;
+
+    if(!enif_get_tuple(env, cmd->arg, &argc, &argv) || argc != 5 ||
+       !enif_get_resource(env, argv[0], erl_cv_video_capture_type, (void **) &ecap))
+        return enif_make_badarg(env);
+
+    if(!enif_get_int(env, argv[1], &every) || every < 0 ||
+       !enif_get_double(env, argv[2], &fps) || fps < 0 || (every == 0) == (fps == 0))
+        return make_error_tuple(env, "invalid_rate");
+
+    if(!enif_get_int(env, argv[3], &max) || max < 0)
+        return make_error_tuple(env, "invalid_max");
+    seek = enif_is_identical(argv[4], atom_true);
+
+    if(ecap->cap == NULL || !ecap->cap->isOpened())
+        return make_error_tuple(env, "not_open");
+
+    if(max == 0 && ecap->cap->get(cv::CAP_PROP_FRAME_COUNT) <= 0)
+        return make_error_tuple(env, "max_required");
+
+    if(every) {
+        interval = every;
+    } else {
+        double source_fps = ecap->cap->get(cv::CAP_PROP_FPS);
+        if(source_fps <= 0)
+            return make_error_tuple(env, "unknown_fps");
+        interval = std::max(source_fps / fps, 1.0);
+    }
+
+    msg_env = enif_alloc_env();
+    if(!msg_env)
+        return make_error_tuple(env, "no_memory");
+
+    /* Live sources have no position, count from where the capture is */
+    start = std::max((int) ecap->cap->get(cv::CAP_PROP_POS_FRAMES), 0);
+    next = 0;
+    sent = 0;
+
+    for(index = 0; max == 0 || sent < max; index++) {
+        cv::Mat frame;
+
+        if(__atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE))
+            break;
+
+        {
+            trace_scope span("VideoCapture::grab");
+            if(!ecap->cap->grab())
+                break;
+        }
+        if(index < next)
+            continue;
+
+        {
+            trace_scope span("VideoCapture::retrieve");
+            if(!ecap->cap->retrieve(frame) || frame.empty())
+                break;
+        }
+        capture_frame(ecap, frame);
+
+        enif_send(NULL, &cmd->pid, msg_env,
+            enif_make_tuple3(msg_env, atom_erl_cv, enif_make_copy(msg_env, cmd->ref),
+                enif_make_tuple3(msg_env, atom_frame, enif_make_int(msg_env, start + index),
+                    make_mat(msg_env, frame))));
+        enif_clear_env(msg_env);
+        sent++;
+
+        /* Fractional intervals, e.g. 1 fps out of 29.97, don't drift */
+        while(next <= index)
+            next += interval;
+
+        target = (int) ceil(next);
+        if(seek && target - index > 1) {
+            trace_scope span("VideoCapture::seek");
+            if(!ecap->cap->set(cv::CAP_PROP_POS_FRAMES, start + target))
+                break;
+            index = target - 1;
+        }
+    }
+
+    enif_free_env(msg_env);
+    return make_ok_tuple(env, enif_make_int(env, sent));
+}
+
+static ERL_NIF_TERM
+do_vc_get(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_video_capture *ecap;
+    int argc, propid;
+    double value;
+    const ERL_NIF_TERM *argv;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+    
+    if(argc != 2)
+        return enif_make_badarg(env);
+
+    enif_fprintf(stderr, "%T ????\r\n", argv[0]);
+    if(!enif_get_resource(env, argv[0], erl_cv_video_capture_type, (void **) &ecap))
+        return enif_make_badarg(env);
+
+    if(ecap->cap == NULL)
+        return make_error_tuple(env, "not_open");
+
+    if(!enif_get_int(env, argv[1], &propid))
+        return make_error_tuple(env, "invalid_propid");
+
+    value = ecap->cap->get(propid);
+    return enif_make_double(env, value);
+}
+
+static ERL_NIF_TERM
+do_vc_set(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_video_capture *ecap;
+    int argc, propid;
+    double value;
+    const ERL_NIF_TERM* argv;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+    
+    if(argc != 3)
+        return enif_make_badarg(env);
+
+    if(!enif_get_resource(env, argv[0], erl_cv_video_capture_type, (void **) &ecap))
+        return enif_make_badarg(env);
+
+    if(ecap->cap == NULL)
+        return make_error_tuple(env, "not_open");
+    
+    if(!enif_get_int(env, argv[1], &propid))
+        return make_error_tuple(env, "invalid_propid");
+    
+    if(!enif_get_double(env, argv[2], &value))
+        return make_error_tuple(env, "invalid_propvalue");
+
+    return ecap->cap->set(propid, value) ? atom_true : atom_false;
+}
+
+static inline uint64_t
+hash_mix(uint64_t h, uint64_t v)
+{
+    h ^= v * 0x9E3779B97F4A7C15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xC2B2AE3D27D4EB4FULL;
+}
+
+static uint64_t
+hash_bytes(uint64_t h, const uchar *data, size_t size)
+{
+    uint64_t word;
+    size_t i;
+
+    for(i = 0; i + 8 <= size; i += 8) {
+        memcpy(&word, data + i, 8);
+        h = hash_mix(h, word);
+    }
+    for(word = 0; i < size; i++)
+        word = (word << 8) | data[i];
+    return hash_mix(h, word ^ size);
+}
+
+/*
+ * Scale and offset bringing a depth's usual range to 0-255. Floats are
+ * taken as 0-1 like imencode does, the type is part of the key anyway.
+ */
+static void
+thumb_scale(int depth, double *alpha, double *beta)
+{
+    *alpha = 1;
+    *beta = 0;
+    switch(depth) {
+      case CV_8S: *beta = 128; break;
+      case CV_16U: *alpha = 1.0 / 257; break;
+      case CV_16S: *alpha = 1.0 / 257; *beta = 128; break;
+      case CV_32S: *alpha = 1.0 / 16843009; *beta = 128; break;
+      case CV_32F:
+      case CV_64F: *alpha = 255; break;
+    }
+}
+
+/*
+ * Fast content hash of a Mat. The noise tolerant variant hashes a coarsely
+ * quantised 16x16 thumbnail so sensor noise does not defeat the cache.
+ */
+static uint64_t
+hash_mat(const cv::Mat &mat, int noise_tolerant)
+{
+    uint64_t h = hash_mix(hash_mix(mat.rows, mat.cols), mat.type());
+    cv::Mat src = mat;
+
+    if(noise_tolerant) {
+        cv::Mat thumb;
+        cv::resize(mat, thumb, cv::Size(16, 16), 0, 0, cv::INTER_AREA);
+        if(thumb.depth() != CV_8U) {
+            double alpha, beta;
+            thumb_scale(thumb.depth(), &alpha, &beta);
+            thumb.convertTo(thumb, CV_8U, alpha, beta);
+        }
+        for(uchar *p = thumb.data; p < thumb.data + thumb.total() * thumb.elemSize(); p++)
+            *p &= 0xF0;
+        src = thumb;
+    }
+
+    size_t row_size = src.cols * src.elemSize();
+    if(src.isContinuous())
+        return hash_bytes(h, src.data, row_size * src.rows);
+    for(int i = 0; i < src.rows; i++)
+        h = hash_bytes(h, src.ptr(i), row_size);
+    return h;
+}
+
+static void
+encode_cache_destroy(encode_cache *cache)
+{
+    for(size_t i = 0; i < cache->slots.size(); i++)
+        enif_free_env(cache->slots[i].env);
+    delete cache;
+}
+
+static encode_cache*
+encode_cache_create(int size, int noise_tolerant)
+{
+    encode_cache *cache = new encode_cache();
+
+    cache->noise_tolerant = noise_tolerant;
+    cache->tick = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->slots.resize(size);
+    for(int i = 0; i < size; i++) {
+        cache->slots[i].key = 0;
+        cache->slots[i].last_used = 0;
+        cache->slots[i].binary = 0;
+        cache->slots[i].env = enif_alloc_env();
+        if(!cache->slots[i].env) {
+            cache->slots.resize(i);
+            encode_cache_destroy(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+/*
+ * Hits hand out the stored binary itself, copying a refc binary between
+ * environments only bumps its reference count.
+ */
+static int
+encode_cache_lookup(encode_cache *cache, uint64_t key, ErlNifEnv *env, ERL_NIF_TERM *binary)
+{
+    cache->tick++;
+    for(size_t i = 0; i < cache->slots.size(); i++) {
+        encode_cache_slot &slot = cache->slots[i];
+        if(slot.last_used != 0 && slot.key == key) {
+            slot.last_used = cache->tick;
+            cache->hits++;
+            *binary = enif_make_copy(env, slot.binary);
+            return 1;
+        }
+    }
+    cache->misses++;
+    return 0;
+}
+
+static void
+encode_cache_store(encode_cache *cache, uint64_t key, ERL_NIF_TERM binary)
+{
+    size_t victim = 0;
+
+    for(size_t i = 1; i < cache->slots.size(); i++)
+        if(cache->slots[i].last_used < cache->slots[victim].last_used)
+            victim = i;
+
+    encode_cache_slot &slot = cache->slots[victim];
+    enif_clear_env(slot.env);
+    slot.key = key;
+    slot.last_used = cache->tick;
+    slot.binary = enif_make_copy(slot.env, binary);
+}
+
+static ERL_NIF_TERM
+do_imencode(ErlNifEnv *env, erl_cv_connection *conn, const ERL_NIF_TERM arg)
+{
+    erl_cv_mat *inemat;
+
+    int strSize;
+    unsigned int listLength;
+    int argc;
+    const ERL_NIF_TERM* argv;
+    uint64_t key = 0;
+    bool cached, encoded;
+    ERL_NIF_TERM ret;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 3)
+        return enif_make_badarg(env);
+
+    // emat resource
+    if(!enif_get_resource(env, argv[0], erl_cv_mat_type, (void **) &inemat))
+        return enif_make_badarg(env);
+
+    // encoding extension
+    if(!enif_get_list_length(env, argv[1], &listLength))
+        return make_error_tuple(env, "invalid_string");
     char ext[listLength+1];
     strSize = enif_get_string(env, argv[1], ext, listLength+1, ERL_NIF_LATIN1);
 
     // encoding params
-    if(!enif_get_list_length(env, argv[2], &listLength))
-        return make_error_tuple(env, "invalid_params");
     std::vector<int> params;
-    ERL_NIF_TERM head;
-    ERL_NIF_TERM tail;
-    for(unsigned int i = 0; i<listLength; i++) {
-        int val;
-        if(!enif_get_list_cell(env, argv[2], &head, &tail))
-            return make_error_tuple(env, "invalid_params");
-        if(!enif_get_int(env, head, &val))
-            return make_error_tuple(env, "invalid_param_value");
-        params.push_back(val);
-    }
+    if(!get_params(env, argv[2], params))
+        return make_error_tuple(env, "invalid_params");
 
     if(strSize <= 0)
         return make_error_tuple(env, "invalid_filename");
 
+    /* An empty Mat has nothing worth caching and can't be resized */
+    cached = conn->cache && !inemat->mat->empty();
+    if(cached) {
+        key = hash_mat(*inemat->mat, conn->cache->noise_tolerant);
+        key = hash_bytes(key, (const uchar *) ext, strlen(ext));
+        key = hash_bytes(key, (const uchar *) params.data(), params.size() * sizeof(int));
+        if(encode_cache_lookup(conn->cache, key, env, &ret))
+            return ret;
+    }
+
     //buffer for storing frame
     std::vector<uchar> buff;
-    cv::imencode(ext, *inemat->mat, buff, params);
-    return make_binary(env, buff.data(), buff.size());
+    {
+        trace_scope span("cv::imencode");
+        try {
+            encoded = cv::imencode(ext, *inemat->mat, buff, params);
+        } catch(const cv::Exception&) {
+            return make_error_tuple(env, "encode_failed");
+        }
+    }
+    ret = make_binary(env, buff.data(), buff.size());
+
+    if(cached && encoded && !buff.empty())
+        encode_cache_store(conn->cache, key, ret);
+    return ret;
+}
+
+static void
+send_stream_chunk(void *ctx, ErlNifBinary *chunk)
+{
+    erl_cv_encode_stream *stream = (erl_cv_encode_stream *) ctx;
+    ErlNifEnv *msg_env = stream->msg_env;
+
+    if(stream->window) {
+        enif_mutex_lock(stream->lock);
+        stream->outstanding++;
+        enif_mutex_unlock(stream->lock);
+    }
+
+    enif_send(NULL, &stream->pid, msg_env,
+        enif_make_tuple3(msg_env, atom_erl_cv, enif_make_copy(msg_env, stream->ref),
+            enif_make_tuple2(msg_env, atom_chunk, enif_make_binary(msg_env, chunk))));
+    enif_clear_env(msg_env);
 }
 
 static ERL_NIF_TERM
-do_new_mat(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+queue_stream_continue(ErlNifEnv *env, erl_cv_connection *conn, erl_cv_encode_stream *stream,
+                      ERL_NIF_TERM term)
 {
-    erl_cv_mat *inemat;
-    erl_cv_mat *outemat;
-    ERL_NIF_TERM ret;
+    erl_cv_command *next;
 
-    outemat = (erl_cv_mat*) enif_alloc_resource(erl_cv_mat_type, sizeof(erl_cv_mat));
-    if(!outemat)
-        return make_error_tuple(env, "no_memory");
+    next = command_create(conn->pool);
+    if(!next)
+        return make_error_tuple(env, "command_create_failed");
 
-    if(!enif_get_resource(env, arg, erl_cv_mat_type, (void **) &inemat)) {
-      cv::Mat inMat = *inemat->mat;
-      outemat->mat = new cv::Mat(inMat);
-    } else {
-      outemat->mat = new cv::Mat();
-    }
-    ret = enif_make_resource(env, outemat);
-    enif_release_resource(outemat);
-    return make_ok_tuple(env, ret);
+    next->type = cmd_imencode_stream_continue;
+    next->ref = enif_make_copy(next->env, stream->ref);
+    next->pid = stream->pid;
+    next->arg = enif_make_copy(next->env, term);
+    return push_command(env, conn, next);
 }
 
+/*
+ * Encodes one slice of rows. While rows remain, a continuation is queued
+ * behind the commands already waiting, so they run between slices. With a
+ * window the stream parks instead once the caller holds that many unacked
+ * chunks, and the ack that makes room queues the continuation.
+ */
 static ERL_NIF_TERM
-evaluate_command(erl_cv_command *cmd, erl_cv_connection *conn)
+encode_stream_step(erl_cv_command *cmd, erl_cv_connection *conn, erl_cv_encode_stream *stream,
+                   ERL_NIF_TERM term)
 {
-    switch(cmd->type) {
-    // Video Capture
-      case cmd_video_capture_open:
-        return do_vc_open(cmd->env, conn, cmd->arg);
-      case cmd_video_capture_close:
-        return do_vc_close(cmd->env, conn, cmd->arg);
-      case cmd_video_capture_is_opened:
-        return do_vc_is_opened(cmd->env, conn, cmd->arg);
-      case cmd_video_capture_grab:
-        return do_vc_grab(cmd->env, conn, cmd->arg);
-      case cmd_video_capture_retrieve:
-        return do_vc_retrieve(cmd->env, conn, cmd->arg);
-      case cmd_video_capture_read:
-        return do_vc_read(cmd->env, conn, cmd->arg);
-      case cmd_video_capture_get:
-        return do_vc_get(cmd->env, conn, cmd->arg);
-      case cmd_video_capture_set:
-        return do_vc_set(cmd->env, conn, cmd->arg);
+    ERL_NIF_TERM ret;
+    int more, parked = 0;
 
-    // Utility
-      case cmd_imencode:
-        return do_imencode(cmd->env, conn, cmd->arg);
-      case cmd_new_mat:
-        return do_new_mat(cmd->env, conn, cmd->arg);
-      default:
-        return make_error_tuple(cmd->env, "invalid_command");
+    {
+        trace_scope span("stream_encoder_step");
+        more = stream_encoder_step(stream->encoder, stream->slice_rows);
+    }
+
+    if(more <= 0) {
+        ret = more == 0 ?
+            make_ok_tuple(cmd->env, enif_make_uint64(cmd->env, stream_encoder_bytes(stream->encoder))) :
+            make_error_tuple(cmd->env, "encode_failed");
+
+        /* Done with the rows, don't wait for the GC to let go of them */
+        stream_encoder_destroy(stream->encoder);
+        stream->encoder = NULL;
+        return ret;
+    }
+
+    if(stream->window) {
+        enif_mutex_lock(stream->lock);
+        parked = stream->parked = stream->outstanding >= stream->window;
+        enif_mutex_unlock(stream->lock);
     }
+    if(parked)
+        return atom_pending;
+
+    ret = queue_stream_continue(cmd->env, conn, stream, term);
+    return enif_is_identical(ret, atom_ok) ? atom_pending : ret;
 }
 
 static ERL_NIF_TERM
-push_command(ErlNifEnv *env, erl_cv_connection *conn, erl_cv_command *cmd) {
-    if(!queue_push(conn->commands, cmd))
-        return make_error_tuple(env, "command_push_failed");
+do_imencode_stream(erl_cv_command *cmd, erl_cv_connection *conn)
+{
+    ErlNifEnv *env = cmd->env;
+    erl_cv_mat *emat;
+    erl_cv_encode_stream *stream;
+    int argc, window;
+    unsigned int listLength, chunk_size;
+    const ERL_NIF_TERM *argv;
+    const char *error = NULL;
+    size_t row_bytes;
+    ERL_NIF_TERM term;
+
+    if(!enif_get_tuple(env, cmd->arg, &argc, &argv) || argc != 5)
+        return enif_make_badarg(env);
+
+    if(!enif_get_resource(env, argv[0], erl_cv_mat_type, (void **) &emat))
+        return enif_make_badarg(env);
+
+    if(!enif_get_list_length(env, argv[1], &listLength))
+        return make_error_tuple(env, "invalid_string");
+    char ext[listLength+1];
+    if(enif_get_string(env, argv[1], ext, listLength+1, ERL_NIF_LATIN1) <= 0)
+        return make_error_tuple(env, "invalid_string");
+
+    std::vector<int> params;
+    if(!get_params(env, argv[2], params))
+        return make_error_tuple(env, "invalid_params");
+
+    if(!enif_get_uint(env, argv[3], &chunk_size) || chunk_size == 0)
+        return make_error_tuple(env, "invalid_chunk_size");
+
+    if(!enif_get_int(env, argv[4], &window) || window < 0)
+        return make_error_tuple(env, "invalid_window");
+
+    stream = (erl_cv_encode_stream*) enif_alloc_resource(erl_cv_encode_stream_type, sizeof(erl_cv_encode_stream));
+    if(!stream)
+        return make_error_tuple(env, "no_memory");
+    stream->encoder = NULL;
+    stream->pid = cmd->pid;
+    stream->conn = conn;
+    stream->window = window;
+    stream->outstanding = 0;
+    stream->parked = 0;
+    stream->ref_env = enif_alloc_env();
+    stream->msg_env = enif_alloc_env();
+    stream->lock = enif_mutex_create((char*) "erl_cv_encode_stream");
+    if(!stream->ref_env || !stream->msg_env || !stream->lock) {
+        enif_release_resource(stream);
+        return make_error_tuple(env, "no_memory");
+    }
+    stream->ref = enif_make_copy(stream->ref_env, cmd->ref);
+
+    stream->encoder = stream_encoder_create(ext, *emat->mat, params, chunk_size, send_stream_chunk, stream, &error);
+    if(!stream->encoder) {
+        enif_release_resource(stream);
+        return make_error_tuple(env, error);
+    }
+
+    row_bytes = emat->mat->cols * emat->mat->elemSize();
+    stream->slice_rows = (int) std::max(ENCODE_STREAM_SLICE / row_bytes, (size_t) ENCODE_STREAM_MIN_ROWS);
+
+    term = enif_make_resource(env, stream);
+    enif_release_resource(stream);
+
+    /* The caller acks chunks on the stream, {stream, S} comes before any */
+    if(window) {
+        enif_send(NULL, &cmd->pid, stream->msg_env,
+            enif_make_tuple3(stream->msg_env, atom_erl_cv, enif_make_copy(stream->msg_env, cmd->ref),
+                enif_make_tuple2(stream->msg_env, make_atom(stream->msg_env, "stream"),
+                    enif_make_copy(stream->msg_env, term))));
+        enif_clear_env(stream->msg_env);
+    }
+    return encode_stream_step(cmd, conn, stream, term);
+}
+
+static ERL_NIF_TERM
+do_imencode_stream_continue(erl_cv_command *cmd, erl_cv_connection *conn)
+{
+    erl_cv_encode_stream *stream;
+
+    if(!enif_get_resource(cmd->env, cmd->arg, erl_cv_encode_stream_type, (void **) &stream) || !stream->encoder)
+        return enif_make_badarg(cmd->env);
+
+    return encode_stream_step(cmd, conn, stream, cmd->arg);
+}
+
+/*
+ * Size 0 disables the cache.
+ */
+static ERL_NIF_TERM
+do_encode_cache_config(ErlNifEnv *env, erl_cv_connection *conn, const ERL_NIF_TERM arg)
+{
+    int argc, size, noise_tolerant;
+    const ERL_NIF_TERM *argv;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+
+    if(!enif_get_int(env, argv[0], &size) || size < 0)
+        return make_error_tuple(env, "invalid_size");
+
+    noise_tolerant = enif_is_identical(argv[1], atom_true);
+
+    if(conn->cache) {
+        encode_cache_destroy(conn->cache);
+        conn->cache = NULL;
+    }
+
+    if(size > 0) {
+        conn->cache = encode_cache_create(size, noise_tolerant);
+        if(!conn->cache)
+            return make_error_tuple(env, "no_memory");
+    }
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM
+do_encode_cache_stats(ErlNifEnv *env, erl_cv_connection *conn, const ERL_NIF_TERM)
+{
+    encode_cache *cache = conn->cache;
+
+    if(!cache)
+        return make_error_tuple(env, "disabled");
+
+    return make_ok_tuple(env, enif_make_list3(env,
+        enif_make_tuple2(env, make_atom(env, "hits"), enif_make_uint64(env, cache->hits)),
+        enif_make_tuple2(env, make_atom(env, "misses"), enif_make_uint64(env, cache->misses)),
+        enif_make_tuple2(env, make_atom(env, "size"), enif_make_int(env, (int) cache->slots.size()))));
+}
+
+static ERL_NIF_TERM
+do_jpeg_encoder_new(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_jpeg_encoder *eenc;
+    double target, fps, min_scale;
+    int argc, min_quality, max_quality;
+    const ERL_NIF_TERM *argv;
+    ERL_NIF_TERM ret;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv) || argc != 5)
+        return enif_make_badarg(env);
+
+    if(!enif_get_double(env, argv[0], &target) || !enif_get_double(env, argv[1], &fps) ||
+       !enif_get_int(env, argv[2], &min_quality) || !enif_get_int(env, argv[3], &max_quality) ||
+       !enif_get_double(env, argv[4], &min_scale))
+        return make_error_tuple(env, "invalid_options");
+
+    eenc = (erl_cv_jpeg_encoder*) enif_alloc_resource(erl_cv_jpeg_encoder_type, sizeof(erl_cv_jpeg_encoder));
+    if(!eenc)
+        return make_error_tuple(env, "no_memory");
+    eenc->lock = NULL;
+
+    eenc->encoder = rate_encoder_create(target, fps, min_quality, max_quality, min_scale);
+    if(!eenc->encoder) {
+        enif_release_resource(eenc);
+        return make_error_tuple(env, "invalid_options");
+    }
+    eenc->lock = enif_mutex_create((char*) "erl_cv_jpeg_encoder");
+    if(!eenc->lock) {
+        enif_release_resource(eenc);
+        return make_error_tuple(env, "no_memory");
+    }
+
+    ret = enif_make_resource(env, eenc);
+    enif_release_resource(eenc);
+    return make_ok_tuple(env, ret);
+}
+
+/*
+ * Encodes at the quality, and if need be the size, the rate model picks
+ * for this frame, then feeds the result back into the model.
+ */
+static ERL_NIF_TERM
+do_jpeg_encoder_encode(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_jpeg_encoder *eenc;
+    erl_cv_mat *emat;
+    int argc, encoded;
+    const ERL_NIF_TERM *argv;
+    std::vector<uchar> buff;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv) || argc != 2 ||
+       !enif_get_resource(env, argv[0], erl_cv_jpeg_encoder_type, (void **) &eenc) ||
+       !enif_get_resource(env, argv[1], erl_cv_mat_type, (void **) &emat))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(eenc->lock);
+    encoded = rate_encoder_encode(eenc->encoder, *emat->mat, buff);
+    enif_mutex_unlock(eenc->lock);
+
+    if(!encoded)
+        return make_error_tuple(env, "encode_failed");
+
+    return make_ok_tuple(env, make_binary(env, buff.data(), buff.size()));
+}
+
+static ERL_NIF_TERM
+do_jpeg_encoder_stats(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_jpeg_encoder *eenc;
+    rate_encoder_stats stats;
+    ERL_NIF_TERM bitrate;
+
+    if(!enif_get_resource(env, arg, erl_cv_jpeg_encoder_type, (void **) &eenc))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(eenc->lock);
+    rate_encoder_get_stats(eenc->encoder, &stats);
+    enif_mutex_unlock(eenc->lock);
+
+    /* Bits per second, only known when the frame rate was given */
+    bitrate = stats.fps > 0 ? enif_make_double(env, stats.avg_bytes * 8 * stats.fps) : atom_nil;
+
+    ERL_NIF_TERM items[] = {
+        enif_make_tuple2(env, make_atom(env, "frames"), enif_make_uint64(env, stats.frames)),
+        enif_make_tuple2(env, make_atom(env, "bytes"), enif_make_uint64(env, stats.bytes)),
+        enif_make_tuple2(env, make_atom(env, "last_bytes"), enif_make_uint64(env, stats.last_bytes)),
+        enif_make_tuple2(env, make_atom(env, "avg_bytes"), enif_make_double(env, stats.avg_bytes)),
+        enif_make_tuple2(env, make_atom(env, "target_bytes"), enif_make_double(env, stats.target)),
+        enif_make_tuple2(env, make_atom(env, "bitrate"), bitrate),
+        enif_make_tuple2(env, make_atom(env, "quality"), enif_make_int(env, stats.quality)),
+        enif_make_tuple2(env, make_atom(env, "scale"), enif_make_double(env, stats.scale)),
+        enif_make_tuple2(env, make_atom(env, "complexity"), enif_make_double(env, stats.complexity)),
+    };
+    return make_ok_tuple(env, enif_make_list_from_array(env, items, sizeof(items) / sizeof(items[0])));
+}
+
+static ERL_NIF_TERM
+do_new_mat(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_mat *inemat;
+    erl_cv_mat *outemat;
+    ERL_NIF_TERM ret;
+
+    outemat = (erl_cv_mat*) enif_alloc_resource(erl_cv_mat_type, sizeof(erl_cv_mat));
+    if(!outemat)
+        return make_error_tuple(env, "no_memory");
+
+    if(enif_get_resource(env, arg, erl_cv_mat_type, (void **) &inemat)) {
+      outemat->mat = new cv::Mat(*inemat->mat);
+    } else {
+      outemat->mat = new cv::Mat();
+    }
+    ret = enif_make_resource(env, outemat);
+    enif_release_resource(outemat);
+    return make_ok_tuple(env, ret);
+}
+
+/*
+ * A view shares the parent's refcounted pixel buffer, nothing is copied.
+ */
+static ERL_NIF_TERM
+do_mat_roi(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_mat *inemat;
+    int argc, x, y, w, h;
+    const ERL_NIF_TERM *argv;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 5)
+        return enif_make_badarg(env);
+
+    if(!enif_get_resource(env, argv[0], erl_cv_mat_type, (void **) &inemat))
+        return enif_make_badarg(env);
+
+    if(!enif_get_int(env, argv[1], &x) || !enif_get_int(env, argv[2], &y) ||
+       !enif_get_int(env, argv[3], &w) || !enif_get_int(env, argv[4], &h))
+        return make_error_tuple(env, "invalid_rect");
+
+    cv::Rect rect(x, y, w, h);
+    if(w <= 0 || h <= 0 || (rect & cv::Rect(0, 0, inemat->mat->cols, inemat->mat->rows)) != rect)
+        return make_error_tuple(env, "out_of_bounds");
+
+    return make_ok_tuple(env, make_mat(env, (*inemat->mat)(rect)));
+}
+
+static ERL_NIF_TERM
+do_mat_to_binary(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_mat *inemat;
+    ErlNifBinary blob;
+    size_t row_size;
+
+    if(!enif_get_resource(env, arg, erl_cv_mat_type, (void **) &inemat))
+        return enif_make_badarg(env);
+
+    cv::Mat &mat = *inemat->mat;
+    row_size = mat.cols * mat.elemSize();
+
+    /* Continuous pixels are exposed as a binary backed by the Mat itself */
+    if(mat.isContinuous())
+        return make_ok_tuple(env, enif_make_resource_binary(env, inemat, mat.data, row_size * mat.rows));
+
+    /* Views have a stride, pack their rows */
+    if(!enif_alloc_binary(row_size * mat.rows, &blob))
+        return make_error_tuple(env, "no_memory");
+
+    for(int i = 0; i < mat.rows; i++)
+        memcpy(blob.data + i * row_size, mat.ptr(i), row_size);
+
+    ERL_NIF_TERM ret = enif_make_binary(env, &blob);
+    enif_release_binary(&blob);
+    return make_ok_tuple(env, ret);
+}
+
+/*
+ * Packs a Mat in the format described in mat_format.hpp so it can be sent
+ * to another node. The binary is allocated once and filled in place.
+ */
+static ERL_NIF_TERM
+do_mat_serialize(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_mat *emat;
+    ErlNifBinary blob;
+    int argc;
+    const ERL_NIF_TERM *argv;
+    const char *error;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv) || argc != 2 ||
+       !enif_get_resource(env, argv[0], erl_cv_mat_type, (void **) &emat))
+        return enif_make_badarg(env);
+
+    error = mat_serialize(*emat->mat, enif_is_identical(argv[1], atom_true) ? MAT_FORMAT_LZ4 : 0, &blob);
+    if(error)
+        return make_error_tuple(env, error);
+
+    ERL_NIF_TERM ret = enif_make_binary(env, &blob);
+    enif_release_binary(&blob);
+    return make_ok_tuple(env, ret);
+}
+
+static ERL_NIF_TERM
+do_mat_deserialize(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    cv::Mat mat;
+    const char *error;
+
+    error = mat_deserialize(env, arg, mat);
+    if(error)
+        return make_error_tuple(env, error);
+
+    return make_ok_tuple(env, make_mat(env, mat));
+}
+
+/*
+ * Reductions requested from cmd_stats. They are computed for every Mat of a
+ * batch in parallel, and only turned into terms afterwards because an env
+ * must not be shared between threads.
+ */
+enum {
+    stat_mean_std_dev = 1,
+    stat_min_max_loc = 2,
+    stat_histogram = 4,
+    stat_sharpness = 8,
+};
+
+typedef struct {
+    double min, max;
+    cv::Point min_loc, max_loc;
+} channel_min_max;
+
+/* Histogram bounds, lower inclusive and upper exclusive */
+typedef struct {
+    int given;
+    float lower, upper;
+} hist_range;
+
+typedef struct {
+    int ok;
+    cv::Scalar mean, stddev;
+    std::vector<channel_min_max> min_max;
+    std::vector<cv::Mat> histograms;
+    double sharpness;
+} mat_stats;
+
+/*
+ * Without a range from the caller, 8 and 16 bit histograms cover every
+ * value of the depth and float ones the values present in the Mat.
+ */
+static void
+histogram_range(const cv::Mat &mat, const hist_range &given, float range[2])
+{
+    double lower, upper;
+
+    if(given.given) {
+        range[0] = given.lower;
+        range[1] = given.upper;
+        return;
+    }
+
+    switch(mat.depth()) {
+      case CV_8U:
+        range[0] = 0.0f;
+        range[1] = 256.0f;
+        return;
+      case CV_16U:
+        range[0] = 0.0f;
+        range[1] = 65536.0f;
+        return;
+    }
+
+    cv::minMaxLoc(mat.reshape(1), &lower, &upper);
+    range[0] = (float) lower;
+    range[1] = upper > lower ? nextafterf((float) upper, INFINITY) : (float) lower + 1.0f;
+}
+
+/*
+ * calcHist and the grey conversion for sharpness only take these depths
+ */
+static int
+stats_depth_ok(const cv::Mat &mat, int ops)
+{
+    int depth = mat.depth();
+
+    if(!(ops & (stat_histogram | stat_sharpness)))
+        return 1;
+    return depth == CV_8U || depth == CV_16U || depth == CV_32F;
+}
+
+static void
+compute_stats(const cv::Mat &mat, int ops, int bins, const hist_range &hrange, mat_stats &stats)
+{
+    int channels = mat.channels();
+    cv::Mat plane;
+
+    stats.ok = !mat.empty() && channels <= 4 && stats_depth_ok(mat, ops);
+    if(!stats.ok)
+        return;
+
+    if(ops & stat_mean_std_dev)
+        cv::meanStdDev(mat, stats.mean, stats.stddev);
+
+    if(ops & (stat_min_max_loc | stat_histogram)) {
+        float range[2];
+        const float *ranges[] = {range};
+
+        if(ops & stat_histogram)
+            histogram_range(mat, hrange, range);
+
+        for(int c = 0; c < channels; c++) {
+            const int channel[] = {c};
+
+            if(ops & stat_min_max_loc) {
+                channel_min_max mm;
+                if(channels == 1)
+                    plane = mat;
+                else
+                    cv::extractChannel(mat, plane, c);
+                cv::minMaxLoc(plane, &mm.min, &mm.max, &mm.min_loc, &mm.max_loc);
+                stats.min_max.push_back(mm);
+            }
+
+            if(ops & stat_histogram) {
+                cv::Mat hist;
+                cv::calcHist(&mat, 1, channel, cv::Mat(), hist, 1, &bins, ranges);
+                stats.histograms.push_back(hist);
+            }
+        }
+    }
+
+    if(ops & stat_sharpness) {
+        cv::Mat gray, laplacian;
+        cv::Scalar mean, stddev;
+
+        if(channels == 3)
+            cv::cvtColor(mat, gray, cv::COLOR_BGR2GRAY);
+        else if(channels == 4)
+            cv::cvtColor(mat, gray, cv::COLOR_BGRA2GRAY);
+        else
+            gray = mat;
+
+        /* Variance of the Laplacian, higher is sharper */
+        cv::Laplacian(gray, laplacian, CV_64F);
+        cv::meanStdDev(laplacian, mean, stddev);
+        stats.sharpness = stddev[0] * stddev[0];
+    }
+}
+
+class stats_body : public cv::ParallelLoopBody
+{
+public:
+    stats_body(const std::vector<cv::Mat*> &mats, int ops, int bins, const hist_range &hrange,
+               std::vector<mat_stats> &stats)
+        : mats(mats), ops(ops), bins(bins), hrange(hrange), stats(stats) {}
+
+    void operator()(const cv::Range &range) const
+    {
+        for(int i = range.start; i < range.end; i++) {
+            try {
+                compute_stats(*mats[i], ops, bins, hrange, stats[i]);
+            } catch(const cv::Exception&) {
+                stats[i].ok = 0;
+            }
+        }
+    }
+
+private:
+    const std::vector<cv::Mat*> &mats;
+    int ops;
+    int bins;
+    const hist_range &hrange;
+    std::vector<mat_stats> &stats;
+};
+
+static ERL_NIF_TERM
+make_double_list(ErlNifEnv *env, const cv::Scalar &values, int count)
+{
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for(int i = count - 1; i >= 0; i--)
+        list = enif_make_list_cell(env, enif_make_double(env, values[i]), list);
+    return list;
+}
+
+static ERL_NIF_TERM
+make_stats(ErlNifEnv *env, const mat_stats &stats, int ops, int channels)
+{
+    ERL_NIF_TERM ret = enif_make_list(env, 0);
+
+    if(ops & stat_sharpness)
+        ret = enif_make_list_cell(env,
+            enif_make_tuple2(env, make_atom(env, "sharpness"), enif_make_double(env, stats.sharpness)), ret);
+
+    if(ops & stat_histogram) {
+        ERL_NIF_TERM hists = enif_make_list(env, 0);
+        for(size_t c = stats.histograms.size(); c > 0; c--) {
+            const cv::Mat &hist = stats.histograms[c - 1];
+            ERL_NIF_TERM counts = enif_make_list(env, 0);
+            for(int b = hist.rows - 1; b >= 0; b--)
+                counts = enif_make_list_cell(env, enif_make_int(env, (int) hist.at<float>(b)), counts);
+            hists = enif_make_list_cell(env, counts, hists);
+        }
+        ret = enif_make_list_cell(env, enif_make_tuple2(env, make_atom(env, "histogram"), hists), ret);
+    }
+
+    if(ops & stat_min_max_loc) {
+        ERL_NIF_TERM mms = enif_make_list(env, 0);
+        for(size_t c = stats.min_max.size(); c > 0; c--) {
+            const channel_min_max &mm = stats.min_max[c - 1];
+            mms = enif_make_list_cell(env, enif_make_tuple4(env,
+                enif_make_double(env, mm.min),
+                enif_make_double(env, mm.max),
+                enif_make_tuple2(env, enif_make_int(env, mm.min_loc.x), enif_make_int(env, mm.min_loc.y)),
+                enif_make_tuple2(env, enif_make_int(env, mm.max_loc.x), enif_make_int(env, mm.max_loc.y))), mms);
+        }
+        ret = enif_make_list_cell(env, enif_make_tuple2(env, make_atom(env, "min_max_loc"), mms), ret);
+    }
+
+    if(ops & stat_mean_std_dev)
+        ret = enif_make_list_cell(env, enif_make_tuple2(env, make_atom(env, "mean_std_dev"),
+            enif_make_tuple2(env, make_double_list(env, stats.mean, channels), make_double_list(env, stats.stddev, channels))), ret);
+
+    return ret;
+}
+
+static ERL_NIF_TERM
+do_stats(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_mat *inemat;
+    int argc, arity, rarity, ops = 0, bins = 256, batch;
+    double lower, upper;
+    char name[16];
+    const ERL_NIF_TERM *argv;
+    const ERL_NIF_TERM *op;
+    const ERL_NIF_TERM *bounds;
+    ERL_NIF_TERM head, tail, ret;
+    std::vector<cv::Mat*> mats;
+    hist_range hrange = {0, 0.0f, 0.0f};
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+
+    tail = argv[1];
+    while(enif_get_list_cell(env, tail, &head, &tail)) {
+        if(enif_get_tuple(env, head, &arity, &op)) {
+            if((arity != 2 && arity != 3) || !enif_get_atom(env, op[0], name, sizeof(name), ERL_NIF_LATIN1) ||
+               strcmp(name, "histogram") != 0 || !enif_get_int(env, op[1], &bins) || bins <= 0)
+                return make_error_tuple(env, "invalid_op");
+            if(arity == 3) {
+                if(!enif_get_tuple(env, op[2], &rarity, &bounds) || rarity != 2 ||
+                   !enif_get_double(env, bounds[0], &lower) || !enif_get_double(env, bounds[1], &upper) ||
+                   upper <= lower)
+                    return make_error_tuple(env, "invalid_range");
+                hrange.given = 1;
+                hrange.lower = (float) lower;
+                hrange.upper = (float) upper;
+            }
+            ops |= stat_histogram;
+        } else if(enif_get_atom(env, head, name, sizeof(name), ERL_NIF_LATIN1)) {
+            if(strcmp(name, "mean_std_dev") == 0)
+                ops |= stat_mean_std_dev;
+            else if(strcmp(name, "min_max_loc") == 0)
+                ops |= stat_min_max_loc;
+            else if(strcmp(name, "histogram") == 0)
+                ops |= stat_histogram;
+            else if(strcmp(name, "sharpness") == 0)
+                ops |= stat_sharpness;
+            else
+                return make_error_tuple(env, "invalid_op");
+        } else {
+            return make_error_tuple(env, "invalid_op");
+        }
+    }
+
+    batch = !enif_get_resource(env, argv[0], erl_cv_mat_type, (void **) &inemat);
+    if(!batch) {
+        mats.push_back(inemat->mat);
+    } else {
+        tail = argv[0];
+        while(enif_get_list_cell(env, tail, &head, &tail)) {
+            if(!enif_get_resource(env, head, erl_cv_mat_type, (void **) &inemat))
+                return enif_make_badarg(env);
+            mats.push_back(inemat->mat);
+        }
+    }
+
+    std::vector<mat_stats> stats(mats.size());
+    cv::parallel_for_(cv::Range(0, (int) mats.size()), stats_body(mats, ops, bins, hrange, stats));
+
+    if(!batch) {
+        if(!stats[0].ok)
+            return make_error_tuple(env, "invalid_mat");
+        return make_ok_tuple(env, make_stats(env, stats[0], ops, mats[0]->channels()));
+    }
+
+    ret = enif_make_list(env, 0);
+    for(size_t i = mats.size(); i > 0; i--)
+        ret = enif_make_list_cell(env, stats[i - 1].ok ?
+                                  make_stats(env, stats[i - 1], ops, mats[i - 1]->channels()) :
+                                  make_error_tuple(env, "invalid_mat"), ret);
+    return make_ok_tuple(env, ret);
+}
+
+static ERL_NIF_TERM
+make_answer(erl_cv_command *cmd, ERL_NIF_TERM answer);
+
+static void
+reply_batch(std::vector<erl_cv_command*> &batch, const cv::Mat &out)
+{
+    for(size_t i = 0; i < batch.size(); i++) {
+        erl_cv_command *cmd = batch[i];
+        ERL_NIF_TERM answer;
+
+        if(out.empty()) {
+            answer = make_error_tuple(cmd->env, "forward_failed");
+        } else {
+            const float *row = out.ptr<float>((int) i);
+            ERL_NIF_TERM values = enif_make_list(cmd->env, 0);
+            for(int j = out.cols - 1; j >= 0; j--)
+                values = enif_make_list_cell(cmd->env, enif_make_double(cmd->env, row[j]), values);
+            answer = make_ok_tuple(cmd->env, values);
+        }
+
+        enif_send(NULL, &cmd->pid, cmd->env, make_answer(cmd, answer));
+        command_release(cmd);
+    }
+    batch.clear();
+}
+
+static void
+run_group(erl_cv_net *enet, std::vector<erl_cv_command*> &batch)
+{
+    std::vector<cv::Mat> images;
+    cv::Mat out;
+
+    if(batch.empty())
+        return;
+
+    for(size_t i = 0; i < batch.size(); i++) {
+        erl_cv_mat *emat;
+        enif_get_resource(batch[i]->env, batch[i]->arg, erl_cv_mat_type, (void **) &emat);
+        images.push_back(*emat->mat);
+    }
+
+    try {
+        trace_scope span("Net::forward");
+        cv::Mat blob = cv::dnn::blobFromImages(images, enet->scale, enet->size, enet->mean, enet->swap_rb, false);
+        enet->net->setInput(blob);
+        out = enet->net->forward();
+        /* One row of outputs per image */
+        out = out.reshape(1, (int) batch.size());
+    } catch(const cv::Exception&) {
+        out = cv::Mat();
+    }
+
+    reply_batch(batch, out);
+}
+
+/*
+ * blobFromImages takes grey or colour images, not both, so each kind gets
+ * a forward pass of its own. Requests are screened on the way in, nothing
+ * else in a batch can make it fail for every caller.
+ */
+static void
+run_batch(erl_cv_net *enet, std::vector<erl_cv_command*> &batch)
+{
+    std::vector<erl_cv_command*> grey, colour;
+
+    for(size_t i = 0; i < batch.size(); i++) {
+        erl_cv_mat *emat;
+        enif_get_resource(batch[i]->env, batch[i]->arg, erl_cv_mat_type, (void **) &emat);
+        (emat->mat->channels() == 1 ? grey : colour).push_back(batch[i]);
+    }
+    batch.clear();
+
+    run_group(enet, grey);
+    run_group(enet, colour);
+}
+
+/*
+ * What run_batch can turn into a blob: 8 bit or float, grey, BGR or BGRA
+ */
+static int
+dnn_input_ok(const cv::Mat &mat)
+{
+    int channels = mat.channels();
+
+    return !mat.empty() && mat.dims == 2 && (mat.depth() == CV_8U || mat.depth() == CV_32F) &&
+           (channels == 1 || channels == 3 || channels == 4);
+}
+
+/*
+ * Waits for a first request, then gathers more until the batch is full or
+ * max_wait_us has passed since the first one arrived.
+ */
+static void *
+erl_cv_net_run(void *arg)
+{
+    erl_cv_net *enet = (erl_cv_net *) arg;
+    std::vector<erl_cv_command*> batch;
+    int continue_running = 1;
+
+    trace_thread_name("erl_cv_net");
+
+    while(continue_running) {
+        erl_cv_command *cmd = (erl_cv_command*) queue_pop(enet->requests);
+        ErlNifTime deadline = enif_monotonic_time(ERL_NIF_USEC) + enet->max_wait_us;
+        ErlNifTime remaining;
+
+        while(cmd) {
+            if(cmd->type == cmd_stop) {
+                command_release(cmd);
+                continue_running = 0;
+                break;
+            }
+
+            if(cmd->queued_at)
+                trace_span("queue_wait", "queue", cmd->queued_at, trace_now());
+
+            batch.push_back(cmd);
+            if((int) batch.size() >= enet->max_batch)
+                break;
+
+            /* Sleeps on the queue, a request wakes it before the deadline */
+            remaining = deadline - enif_monotonic_time(ERL_NIF_USEC);
+            cmd = (erl_cv_command*) (remaining > 0 ?
+                queue_pop_timeout(enet->requests, (long) remaining) : queue_try_pop(enet->requests));
+        }
+
+        if(!batch.empty())
+            run_batch(enet, batch);
+    }
+
+    return NULL;
+}
+
+static void net_free(erl_cv_net *enet);
+
+static ERL_NIF_TERM
+do_dnn_read_net(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_net *enet;
+    erl_cv_net_handle *handle;
+    char model[MAX_PATHNAME];
+    char config[MAX_PATHNAME];
+    int argc, sargc, margc, width, height;
+    double mean[3] = {0, 0, 0};
+    const ERL_NIF_TERM *argv;
+    const ERL_NIF_TERM *size;
+    const ERL_NIF_TERM *means;
+    ERL_NIF_TERM ret;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 8)
+        return enif_make_badarg(env);
+
+    if(enif_get_string(env, argv[0], model, MAX_PATHNAME, ERL_NIF_LATIN1) <= 0)
+        return make_error_tuple(env, "invalid_filename");
+
+    if(enif_get_string(env, argv[1], config, MAX_PATHNAME, ERL_NIF_LATIN1) <= 0)
+        config[0] = '\0';
+
+    if(!enif_get_tuple(env, argv[2], &sargc, &size) || sargc != 2 ||
+       !enif_get_int(env, size[0], &width) || !enif_get_int(env, size[1], &height))
+        return make_error_tuple(env, "invalid_size");
+
+    if(!enif_get_tuple(env, argv[4], &margc, &means) || margc != 3)
+        return make_error_tuple(env, "invalid_mean");
+    for(int i = 0; i < 3; i++)
+        if(!enif_get_double(env, means[i], &mean[i]))
+            return make_error_tuple(env, "invalid_mean");
+
+    enet = (erl_cv_net*) enif_alloc(sizeof(erl_cv_net));
+    if(!enet)
+        return make_error_tuple(env, "no_memory");
+    enet->net = NULL;
+    enet->requests = NULL;
+    enet->pool = NULL;
+    enet->opts = NULL;
+
+    enet->size = cv::Size(width, height);
+    enet->mean = cv::Scalar(mean[0], mean[1], mean[2]);
+    enet->swap_rb = enif_is_identical(argv[5], atom_true);
+    if(!enif_get_double(env, argv[3], &enet->scale) ||
+       !enif_get_int(env, argv[6], &enet->max_batch) || enet->max_batch <= 0 ||
+       !enif_get_int(env, argv[7], &enet->max_wait_us) || enet->max_wait_us < 0) {
+        net_free(enet);
+        return make_error_tuple(env, "invalid_options");
+    }
+
+    try {
+        enet->net = new cv::dnn::Net(cv::dnn::readNet(model, config));
+    } catch(const cv::Exception&) {
+        net_free(enet);
+        return make_error_tuple(env, "load_failed");
+    }
+    if(enet->net->empty()) {
+        net_free(enet);
+        return make_error_tuple(env, "load_failed");
+    }
+    enet->net->setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+    enet->net->setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+
+    enet->requests = queue_create();
+    enet->pool = command_pool_create();
+    if(!enet->requests || !enet->pool) {
+        net_free(enet);
+        return make_error_tuple(env, "command_queue_create_failed");
+    }
+
+    enet->opts = enif_thread_opts_create((char*) "erl_cv_net_thread_opts");
+    if(enif_thread_create((char*) "erl_cv_net", &enet->tid, erl_cv_net_run, enet, enet->opts) != 0) {
+        enif_thread_opts_destroy(enet->opts);
+        enet->opts = NULL;
+        net_free(enet);
+        return make_error_tuple(env, "thread_create_failed");
+    }
+
+    handle = (erl_cv_net_handle*) enif_alloc_resource(erl_cv_net_type, sizeof(erl_cv_net_handle));
+    if(!handle) {
+        push_stop(enet->requests);
+        net_free(enet);
+        return make_error_tuple(env, "no_memory");
+    }
+    handle->enet = enet;
+
+    ret = enif_make_resource(env, handle);
+    enif_release_resource(handle);
+    return make_ok_tuple(env, ret);
+}
+
+/*
+ * Models are loaded once per connection and kept in its registry, loading
+ * the same model again hands out the same resource.
+ */
+static ERL_NIF_TERM
+do_detector_load(ErlNifEnv *env, erl_cv_connection *conn, const ERL_NIF_TERM arg)
+{
+    erl_cv_detector *edet;
+    char kind[16];
+    char filename[MAX_PATHNAME];
+    int argc;
+    const ERL_NIF_TERM *argv;
+    ERL_NIF_TERM ret;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+
+    if(!enif_get_atom(env, argv[0], kind, sizeof(kind), ERL_NIF_LATIN1))
+        return make_error_tuple(env, "invalid_kind");
+
+    if(strcmp(kind, "cascade") == 0) {
+        if(enif_get_string(env, argv[1], filename, MAX_PATHNAME, ERL_NIF_LATIN1) <= 0)
+            return make_error_tuple(env, "invalid_filename");
+    } else if(strcmp(kind, "hog_people") == 0) {
+        filename[0] = '\0';
+    } else {
+        return make_error_tuple(env, "invalid_kind");
+    }
+
+    std::string key = std::string(kind) + ":" + filename;
+    std::map<std::string, erl_cv_detector*>::iterator found = conn->detectors->find(key);
+    if(found != conn->detectors->end())
+        return make_ok_tuple(env, enif_make_resource(env, found->second));
+
+    edet = (erl_cv_detector*) enif_alloc_resource(erl_cv_detector_type, sizeof(erl_cv_detector));
+    if(!edet)
+        return make_error_tuple(env, "no_memory");
+    edet->cascade = NULL;
+    edet->hog = NULL;
+    edet->lock = enif_mutex_create((char*) "erl_cv_detector_lock");
+    if(!edet->lock) {
+        enif_release_resource(edet);
+        return make_error_tuple(env, "no_memory");
+    }
+
+    if(strcmp(kind, "cascade") == 0) {
+        int loaded;
+
+        edet->kind = detector_cascade;
+        edet->cascade = new cv::CascadeClassifier();
+        /* FileStorage throws on malformed XML or YAML instead of failing */
+        try {
+            loaded = edet->cascade->load(filename);
+        } catch(const cv::Exception&) {
+            loaded = 0;
+        }
+        if(!loaded) {
+            enif_release_resource(edet);
+            return make_error_tuple(env, "load_failed");
+        }
+    } else {
+        edet->kind = detector_hog_people;
+        edet->hog = new cv::HOGDescriptor();
+        edet->hog->setSVMDetector(cv::HOGDescriptor::getDefaultPeopleDetector());
+    }
+
+    /* The registry holds the initial reference until the connection dies */
+    (*conn->detectors)[key] = edet;
+    ret = enif_make_resource(env, edet);
+    return make_ok_tuple(env, ret);
+}
+
+/*
+ * Mats the detectors take. HOG wants 8 bit grey or BGR, a cascade converts
+ * BGRA to grey itself.
+ */
+static int
+detectable(erl_cv_detector *edet, const cv::Mat &mat)
+{
+    int channels = mat.channels();
+
+    if(mat.empty() || mat.depth() != CV_8U)
+        return 0;
+    if(edet->kind == detector_hog_people)
+        return channels == 1 || channels == 3;
+    return channels == 1 || channels == 3 || channels == 4;
+}
+
+static const char *
+detect_one(erl_cv_detector *edet, const cv::Mat &mat, const cv::Rect &roi, double scale, std::vector<cv::Rect> &found)
+{
+    cv::Mat region = roi.area() > 0 ? mat(roi) : mat;
+    cv::Mat input = region;
+
+    if(scale != 1.0) {
+        cv::Size size((int) lround(region.cols * scale), (int) lround(region.rows * scale));
+        if(size.width < 1 || size.height < 1)
+            return "invalid_scale";
+        try {
+            cv::resize(region, input, size, 0, 0, cv::INTER_AREA);
+        } catch(const cv::Exception&) {
+            return "detect_failed";
+        }
+    }
+
+    trace_scope span("detectMultiScale");
+    if(edet->kind == detector_cascade) {
+        const char *error = NULL;
+
+        enif_mutex_lock(edet->lock);
+        try {
+            edet->cascade->detectMultiScale(input, found);
+        } catch(const cv::Exception&) {
+            error = "detect_failed";
+        }
+        enif_mutex_unlock(edet->lock);
+        if(error)
+            return error;
+    } else {
+        try {
+            edet->hog->detectMultiScale(input, found);
+        } catch(const cv::Exception&) {
+            return "detect_failed";
+        }
+    }
+
+    /* Back to the coordinates of the full frame */
+    for(size_t i = 0; i < found.size(); i++) {
+        if(scale > 0 && scale != 1.0) {
+            found[i].x = (int) (found[i].x / scale);
+            found[i].y = (int) (found[i].y / scale);
+            found[i].width = (int) (found[i].width / scale);
+            found[i].height = (int) (found[i].height / scale);
+        }
+        found[i].x += roi.x;
+        found[i].y += roi.y;
+    }
+    return NULL;
+}
+
+class detect_body : public cv::ParallelLoopBody
+{
+public:
+    detect_body(erl_cv_detector *edet, const std::vector<cv::Mat*> &mats, const cv::Rect &roi, double scale,
+                std::vector<std::vector<cv::Rect> > &found, std::vector<const char *> &errors)
+        : edet(edet), mats(mats), roi(roi), scale(scale), found(found), errors(errors) {}
+
+    void operator()(const cv::Range &range) const
+    {
+        for(int i = range.start; i < range.end; i++)
+            errors[i] = detect_one(edet, *mats[i], roi, scale, found[i]);
+    }
+
+private:
+    erl_cv_detector *edet;
+    const std::vector<cv::Mat*> &mats;
+    cv::Rect roi;
+    double scale;
+    std::vector<std::vector<cv::Rect> > &found;
+    std::vector<const char *> &errors;
+};
+
+static ERL_NIF_TERM
+make_rects(ErlNifEnv *env, const std::vector<cv::Rect> &rects)
+{
+    ERL_NIF_TERM ret = enif_make_list(env, 0);
+
+    for(size_t i = rects.size(); i > 0; i--) {
+        const cv::Rect &r = rects[i - 1];
+        ret = enif_make_list_cell(env, enif_make_tuple4(env,
+            enif_make_int(env, r.x), enif_make_int(env, r.y),
+            enif_make_int(env, r.width), enif_make_int(env, r.height)), ret);
+    }
+    return ret;
+}
+
+/*
+ * Detection itself runs on OpenCV's parallel backend, both detectors split
+ * their scale pyramid across its threads. The Mats of a HOG batch are
+ * spread over the backend as well, a cascade runs one Mat at a time
+ * behind its lock anyway.
+ */
+static ERL_NIF_TERM
+do_detect(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_detector *edet;
+    erl_cv_mat *inemat;
+    int argc, rargc;
+    double scale;
+    const ERL_NIF_TERM *argv;
+    const ERL_NIF_TERM *rect;
+    ERL_NIF_TERM head, tail, ret;
+    cv::Rect roi(0, 0, 0, 0);
+    std::vector<cv::Rect> found;
+    std::vector<cv::Mat*> mats;
+    const char *error;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+
+    if(!enif_get_resource(env, argv[0], erl_cv_detector_type, (void **) &edet))
+        return enif_make_badarg(env);
+
+    if(enif_get_tuple(env, argv[2], &rargc, &rect)) {
+        if(rargc != 4 || !enif_get_int(env, rect[0], &roi.x) || !enif_get_int(env, rect[1], &roi.y) ||
+           !enif_get_int(env, rect[2], &roi.width) || !enif_get_int(env, rect[3], &roi.height))
+            return make_error_tuple(env, "invalid_roi");
+    }
+
+    if(!enif_get_double(env, argv[3], &scale) || scale <= 0)
+        return make_error_tuple(env, "invalid_scale");
+
+    if(enif_get_resource(env, argv[1], erl_cv_mat_type, (void **) &inemat)) {
+        if(!detectable(edet, *inemat->mat))
+            return make_error_tuple(env, "invalid_mat");
+        if(roi.area() > 0 && (roi & cv::Rect(0, 0, inemat->mat->cols, inemat->mat->rows)) != roi)
+            return make_error_tuple(env, "out_of_bounds");
+        if((error = detect_one(edet, *inemat->mat, roi, scale, found)) != NULL)
+            return make_error_tuple(env, error);
+        return make_ok_tuple(env, make_rects(env, found));
+    }
+
+    tail = argv[1];
+    while(enif_get_list_cell(env, tail, &head, &tail)) {
+        if(!enif_get_resource(env, head, erl_cv_mat_type, (void **) &inemat))
+            return enif_make_badarg(env);
+        if(!detectable(edet, *inemat->mat))
+            return make_error_tuple(env, "invalid_mat");
+        if(roi.area() > 0 && (roi & cv::Rect(0, 0, inemat->mat->cols, inemat->mat->rows)) != roi)
+            return make_error_tuple(env, "out_of_bounds");
+        mats.push_back(inemat->mat);
+    }
+
+    std::vector<std::vector<cv::Rect> > results(mats.size());
+    std::vector<const char *> errors(mats.size());
+    detect_body body(edet, mats, roi, scale, results, errors);
+    if(edet->kind == detector_hog_people)
+        cv::parallel_for_(cv::Range(0, (int) mats.size()), body);
+    else
+        body(cv::Range(0, (int) mats.size()));
+
+    for(size_t i = 0; i < mats.size(); i++)
+        if(errors[i])
+            return make_error_tuple(env, errors[i]);
+
+    ret = enif_make_list(env, 0);
+    for(size_t i = mats.size(); i > 0; i--)
+        ret = enif_make_list_cell(env, make_rects(env, results[i - 1]), ret);
+    return make_ok_tuple(env, ret);
+}
+
+class orb_body : public cv::ParallelLoopBody
+{
+public:
+    orb_body(const std::vector<cv::Mat*> &mats, int nfeatures,
+             std::vector<std::vector<cv::KeyPoint> > &keypoints, std::vector<cv::Mat> &descriptors,
+             std::vector<const char*> &errors)
+        : mats(mats), nfeatures(nfeatures), keypoints(keypoints), descriptors(descriptors),
+          errors(errors) {}
+
+    void operator()(const cv::Range &range) const
+    {
+        /* One detector per stripe, instances are not shared between threads */
+        cv::Ptr<cv::ORB> orb = cv::ORB::create(nfeatures);
+        for(int i = range.start; i < range.end; i++) {
+            if(errors[i])
+                continue;
+            try {
+                orb->detectAndCompute(*mats[i], cv::noArray(), keypoints[i], descriptors[i]);
+            } catch(const cv::Exception&) {
+                errors[i] = "extract_failed";
+            }
+        }
+    }
+
+private:
+    const std::vector<cv::Mat*> &mats;
+    int nfeatures;
+    std::vector<std::vector<cv::KeyPoint> > &keypoints;
+    std::vector<cv::Mat> &descriptors;
+    std::vector<const char*> &errors;
+};
+
+/*
+ * ORB works on 8 bit images, colour ones are converted to grey first
+ */
+static int
+orb_usable(const cv::Mat &mat)
+{
+    int channels = mat.channels();
+    return !mat.empty() && mat.depth() == CV_8U && (channels == 1 || channels == 3 || channels == 4);
+}
+
+static ERL_NIF_TERM
+make_features(ErlNifEnv *env, std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors)
+{
+    erl_cv_features *efeat;
+    ERL_NIF_TERM ret;
+
+    efeat = (erl_cv_features*) enif_alloc_resource(erl_cv_features_type, sizeof(erl_cv_features));
+    if(!efeat)
+        return make_error_tuple(env, "no_memory");
+    efeat->keypoints = new std::vector<cv::KeyPoint>();
+    efeat->keypoints->swap(keypoints);
+    efeat->descriptors = new cv::Mat(descriptors);
+
+    ret = enif_make_resource(env, efeat);
+    enif_release_resource(efeat);
+    return ret;
+}
+
+static ERL_NIF_TERM
+do_orb_extract(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_mat *inemat;
+    int argc, nfeatures, batch;
+    const ERL_NIF_TERM *argv;
+    ERL_NIF_TERM head, tail, ret;
+    std::vector<cv::Mat*> mats;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+
+    if(!enif_get_int(env, argv[1], &nfeatures) || nfeatures <= 0)
+        return make_error_tuple(env, "invalid_nfeatures");
+
+    batch = !enif_get_resource(env, argv[0], erl_cv_mat_type, (void **) &inemat);
+    if(!batch) {
+        mats.push_back(inemat->mat);
+    } else {
+        tail = argv[0];
+        while(enif_get_list_cell(env, tail, &head, &tail)) {
+            if(!enif_get_resource(env, head, erl_cv_mat_type, (void **) &inemat))
+                return enif_make_badarg(env);
+            mats.push_back(inemat->mat);
+        }
+    }
+
+    std::vector<std::vector<cv::KeyPoint> > keypoints(mats.size());
+    std::vector<cv::Mat> descriptors(mats.size());
+    std::vector<const char*> errors(mats.size(), (const char*) NULL);
+    for(size_t i = 0; i < mats.size(); i++)
+        if(!orb_usable(*mats[i]))
+            errors[i] = "invalid_mat";
+
+    cv::parallel_for_(cv::Range(0, (int) mats.size()),
+                      orb_body(mats, nfeatures, keypoints, descriptors, errors));
+
+    if(!batch) {
+        if(errors[0])
+            return make_error_tuple(env, errors[0]);
+        return make_ok_tuple(env, make_features(env, keypoints[0], descriptors[0]));
+    }
+
+    /* A bad Mat only fails its own entry */
+    ret = enif_make_list(env, 0);
+    for(size_t i = mats.size(); i > 0; i--)
+        ret = enif_make_list_cell(env, errors[i - 1] ? make_error_tuple(env, errors[i - 1]) :
+                                  make_features(env, keypoints[i - 1], descriptors[i - 1]), ret);
+    return make_ok_tuple(env, ret);
+}
+
+/*
+ * Returns {KeypointCount, Descriptors}, the descriptors binary is backed by
+ * the resource and holds 32 bytes per keypoint.
+ */
+static ERL_NIF_TERM
+do_features_descriptors(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_features *efeat;
+
+    if(!enif_get_resource(env, arg, erl_cv_features_type, (void **) &efeat))
+        return enif_make_badarg(env);
+
+    const cv::Mat &desc = *efeat->descriptors;
+    return make_ok_tuple(env, enif_make_tuple2(env,
+        enif_make_int(env, (int) efeat->keypoints->size()),
+        enif_make_resource_binary(env, efeat, desc.data, desc.total() * desc.elemSize())));
+}
+
+static ERL_NIF_TERM
+do_matcher_new(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_features *efeat;
+    erl_cv_matcher *ematcher;
+    char kind[8];
+    int argc;
+    const ERL_NIF_TERM *argv;
+    ERL_NIF_TERM head, tail, ret;
+    std::vector<cv::Mat> descriptors;
+    cv::DescriptorMatcher *matcher;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+
+    tail = argv[0];
+    while(enif_get_list_cell(env, tail, &head, &tail)) {
+        if(!enif_get_resource(env, head, erl_cv_features_type, (void **) &efeat))
+            return enif_make_badarg(env);
+        /* A covered or black frame has no keypoints, it can't be a reference */
+        if(efeat->descriptors->empty())
+            return make_error_tuple(env, "empty_reference");
+        descriptors.push_back(*efeat->descriptors);
+    }
+
+    if(descriptors.empty())
+        return make_error_tuple(env, "no_references");
+
+    if(!enif_get_atom(env, argv[1], kind, sizeof(kind), ERL_NIF_LATIN1))
+        return make_error_tuple(env, "invalid_kind");
+
+    if(strcmp(kind, "bf") == 0)
+        matcher = new cv::BFMatcher(cv::NORM_HAMMING);
+    else if(strcmp(kind, "lsh") == 0)
+        matcher = new cv::FlannBasedMatcher(cv::makePtr<cv::flann::LshIndexParams>(12, 20, 2));
+    else
+        return make_error_tuple(env, "invalid_kind");
+
+    /* The reference set is fixed from here on, queries only read it */
+    try {
+        matcher->add(descriptors);
+        matcher->train();
+    } catch(const cv::Exception&) {
+        delete matcher;
+        return make_error_tuple(env, "train_failed");
+    }
+
+    ematcher = (erl_cv_matcher*) enif_alloc_resource(erl_cv_matcher_type, sizeof(erl_cv_matcher));
+    if(!ematcher) {
+        delete matcher;
+        return make_error_tuple(env, "no_memory");
+    }
+    ematcher->matcher = matcher;
+
+    ret = enif_make_resource(env, ematcher);
+    enif_release_resource(ematcher);
+    return make_ok_tuple(env, ret);
+}
+
+class match_body : public cv::ParallelLoopBody
+{
+public:
+    match_body(cv::DescriptorMatcher *matcher, const std::vector<cv::Mat*> &queries, double ratio,
+               double max_distance, std::vector<std::vector<cv::DMatch> > &matches, std::vector<int> &failed)
+        : matcher(matcher), queries(queries), ratio(ratio), max_distance(max_distance), matches(matches),
+          failed(failed) {}
+
+    void operator()(const cv::Range &range) const
+    {
+        std::vector<std::vector<cv::DMatch> > knn;
+
+        for(int i = range.start; i < range.end; i++) {
+            if(queries[i]->empty())
+                continue;
+
+            knn.clear();
+            try {
+                matcher->knnMatch(*queries[i], knn, ratio > 0 ? 2 : 1);
+            } catch(const cv::Exception&) {
+                /* Descriptors of another type than the references */
+                failed[i] = 1;
+                continue;
+            }
+
+            for(size_t q = 0; q < knn.size(); q++) {
+                if(knn[q].empty() || knn[q][0].distance > max_distance)
+                    continue;
+                /* Lowe's ratio test against the second best candidate */
+                if(ratio > 0 && knn[q].size() > 1 && knn[q][0].distance >= ratio * knn[q][1].distance)
+                    continue;
+                matches[i].push_back(knn[q][0]);
+            }
+        }
+    }
+
+private:
+    cv::DescriptorMatcher *matcher;
+    const std::vector<cv::Mat*> &queries;
+    double ratio;
+    double max_distance;
+    std::vector<std::vector<cv::DMatch> > &matches;
+    std::vector<int> &failed;
+};
+
+static ERL_NIF_TERM
+make_matches(ErlNifEnv *env, const std::vector<cv::DMatch> &matches)
+{
+    ERL_NIF_TERM ret = enif_make_list(env, 0);
+
+    for(size_t i = matches.size(); i > 0; i--) {
+        const cv::DMatch &m = matches[i - 1];
+        ret = enif_make_list_cell(env, enif_make_tuple4(env,
+            enif_make_int(env, m.queryIdx),
+            enif_make_int(env, m.trainIdx),
+            enif_make_int(env, m.imgIdx),
+            enif_make_double(env, m.distance)), ret);
+    }
+    return ret;
+}
+
+static ERL_NIF_TERM
+do_matcher_match(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_matcher *ematcher;
+    erl_cv_features *efeat;
+    int argc, batch;
+    double ratio, max_distance;
+    const ERL_NIF_TERM *argv;
+    ERL_NIF_TERM head, tail, ret;
+    std::vector<cv::Mat*> queries;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+
+    if(!enif_get_resource(env, argv[0], erl_cv_matcher_type, (void **) &ematcher))
+        return enif_make_badarg(env);
+
+    if(!enif_get_double(env, argv[2], &ratio))
+        return make_error_tuple(env, "invalid_ratio");
+
+    if(!enif_get_double(env, argv[3], &max_distance))
+        return make_error_tuple(env, "invalid_max_distance");
+
+    batch = !enif_get_resource(env, argv[1], erl_cv_features_type, (void **) &efeat);
+    if(!batch) {
+        queries.push_back(efeat->descriptors);
+    } else {
+        tail = argv[1];
+        while(enif_get_list_cell(env, tail, &head, &tail)) {
+            if(!enif_get_resource(env, head, erl_cv_features_type, (void **) &efeat))
+                return enif_make_badarg(env);
+            queries.push_back(efeat->descriptors);
+        }
+    }
+
+    std::vector<std::vector<cv::DMatch> > matches(queries.size());
+    std::vector<int> failed(queries.size(), 0);
+    cv::parallel_for_(cv::Range(0, (int) queries.size()),
+        match_body(ematcher->matcher, queries, ratio, max_distance, matches, failed));
+
+    if(std::find(failed.begin(), failed.end(), 1) != failed.end())
+        return make_error_tuple(env, "match_failed");
+
+    if(!batch)
+        return make_ok_tuple(env, make_matches(env, matches[0]));
+
+    ret = enif_make_list(env, 0);
+    for(size_t i = queries.size(); i > 0; i--)
+        ret = enif_make_list_cell(env, make_matches(env, matches[i - 1]), ret);
+    return make_ok_tuple(env, ret);
+}
+
+/*
+ * 64 bit perceptual hashes, bit 0 is the top left sample.
+ */
+static int
+compute_phash(const cv::Mat &mat, const char *algorithm, uint64_t *hash)
+{
+    cv::Mat gray, small;
+    uint64_t bits = 0;
+
+    if(mat.empty())
+        return 0;
+
+    switch(mat.channels()) {
+      case 1:
+        gray = mat;
+        break;
+      case 3:
+        cv::cvtColor(mat, gray, cv::COLOR_BGR2GRAY);
+        break;
+      case 4:
+        cv::cvtColor(mat, gray, cv::COLOR_BGRA2GRAY);
+        break;
+      default:
+        return 0;
+    }
+
+    if(strcmp(algorithm, "ahash") == 0) {
+        cv::resize(gray, small, cv::Size(8, 8), 0, 0, cv::INTER_AREA);
+        small.convertTo(small, CV_32F);
+        float mean = (float) cv::mean(small)[0];
+        for(int i = 0; i < 64; i++)
+            if(small.at<float>(i / 8, i % 8) > mean)
+                bits |= (uint64_t) 1 << i;
+    } else if(strcmp(algorithm, "dhash") == 0) {
+        cv::resize(gray, small, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+        small.convertTo(small, CV_32F);
+        for(int i = 0; i < 64; i++)
+            if(small.at<float>(i / 8, i % 8 + 1) > small.at<float>(i / 8, i % 8))
+                bits |= (uint64_t) 1 << i;
+    } else if(strcmp(algorithm, "phash") == 0) {
+        cv::Mat coeffs;
+        float low[64], sorted[64];
+
+        cv::resize(gray, small, cv::Size(32, 32), 0, 0, cv::INTER_AREA);
+        small.convertTo(small, CV_32F);
+        cv::dct(small, coeffs);
+
+        /* Lowest 8x8 frequencies, compared against their median without DC */
+        for(int i = 0; i < 64; i++)
+            low[i] = coeffs.at<float>(i / 8, i % 8);
+        memcpy(sorted, low + 1, 63 * sizeof(float));
+        std::nth_element(sorted, sorted + 31, sorted + 63);
+        for(int i = 0; i < 64; i++)
+            if(low[i] > sorted[31])
+                bits |= (uint64_t) 1 << i;
+    } else {
+        return 0;
+    }
+
+    *hash = bits;
+    return 1;
+}
+
+static ERL_NIF_TERM
+do_phash(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_mat *inemat;
+    char algorithm[16];
+    uint64_t hash;
+    int argc;
+    const ERL_NIF_TERM *argv;
+    ERL_NIF_TERM head, tail, ret;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+
+    if(!enif_get_atom(env, argv[1], algorithm, sizeof(algorithm), ERL_NIF_LATIN1))
+        return make_error_tuple(env, "invalid_algorithm");
+
+    if(enif_get_resource(env, argv[0], erl_cv_mat_type, (void **) &inemat)) {
+        if(!compute_phash(*inemat->mat, algorithm, &hash))
+            return make_error_tuple(env, "invalid_mat");
+        return make_ok_tuple(env, enif_make_uint64(env, hash));
+    }
+
+    /* Batch of Mats, hashes come back in the same order */
+    if(!enif_is_list(env, argv[0]))
+        return enif_make_badarg(env);
+
+    ret = enif_make_list(env, 0);
+    tail = argv[0];
+    while(enif_get_list_cell(env, tail, &head, &tail)) {
+        if(!enif_get_resource(env, head, erl_cv_mat_type, (void **) &inemat))
+            return enif_make_badarg(env);
+        if(!compute_phash(*inemat->mat, algorithm, &hash))
+            return make_error_tuple(env, "invalid_mat");
+        ret = enif_make_list_cell(env, enif_make_uint64(env, hash), ret);
+    }
+
+    enif_make_reverse_list(env, ret, &ret);
+    return make_ok_tuple(env, ret);
+}
+
+static ERL_NIF_TERM
+make_phash_index(ErlNifEnv *env, phash_index *index)
+{
+    erl_cv_phash_index *eindex;
+    ERL_NIF_TERM ret;
+
+    eindex = (erl_cv_phash_index*) enif_alloc_resource(erl_cv_phash_index_type, sizeof(erl_cv_phash_index));
+    if(!eindex) {
+        phash_index_destroy(index);
+        return make_error_tuple(env, "no_memory");
+    }
+    eindex->index = index;
+
+    ret = enif_make_resource(env, eindex);
+    enif_release_resource(eindex);
+    return make_ok_tuple(env, ret);
+}
+
+static ERL_NIF_TERM
+do_phash_index_new(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM)
+{
+    phash_index *index = phash_index_create();
+    if(!index)
+        return make_error_tuple(env, "no_memory");
+
+    return make_phash_index(env, index);
+}
+
+static ERL_NIF_TERM
+do_phash_index_insert(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_phash_index *eindex;
+    unsigned int length;
+    int argc;
+    const ERL_NIF_TERM *argv;
+    const ERL_NIF_TERM *pair;
+    ERL_NIF_TERM head, tail;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+
+    if(!enif_get_resource(env, argv[0], erl_cv_phash_index_type, (void **) &eindex))
+        return enif_make_badarg(env);
+
+    if(!enif_get_list_length(env, argv[1], &length))
+        return make_error_tuple(env, "invalid_entries");
+
+    std::vector<uint64_t> hashes(length), ids(length);
+    tail = argv[1];
+    for(unsigned int i = 0; enif_get_list_cell(env, tail, &head, &tail); i++) {
+        ErlNifUInt64 hash, id;
+        if(!enif_get_tuple(env, head, &argc, &pair) || argc != 2 ||
+           !enif_get_uint64(env, pair[0], &hash) || !enif_get_uint64(env, pair[1], &id))
+            return make_error_tuple(env, "invalid_entry");
+        hashes[i] = hash;
+        ids[i] = id;
+    }
+
+    if(!phash_index_insert(eindex->index, hashes.data(), ids.data(), length))
+        return make_error_tuple(env, "index_full");
+
+    return make_ok_tuple(env, enif_make_uint64(env, phash_index_size(eindex->index)));
+}
+
+static ERL_NIF_TERM
+do_phash_index_query(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_phash_index *eindex;
+    int argc, radius;
+    const ERL_NIF_TERM *argv;
+    ERL_NIF_TERM head, tail, ret;
+    std::vector<phash_match> matches;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 3)
+        return enif_make_badarg(env);
+
+    if(!enif_get_resource(env, argv[0], erl_cv_phash_index_type, (void **) &eindex))
+        return enif_make_badarg(env);
+
+    if(!enif_get_int(env, argv[2], &radius) || radius < 0)
+        return make_error_tuple(env, "invalid_radius");
+
+    ret = enif_make_list(env, 0);
+    tail = argv[1];
+    while(enif_get_list_cell(env, tail, &head, &tail)) {
+        ErlNifUInt64 hash;
+        ERL_NIF_TERM found;
+
+        if(!enif_get_uint64(env, head, &hash))
+            return make_error_tuple(env, "invalid_hash");
+
+        matches.clear();
+        phash_index_query(eindex->index, hash, radius, matches);
+
+        found = enif_make_list(env, 0);
+        for(size_t i = matches.size(); i > 0; i--) {
+            found = enif_make_list_cell(env,
+                enif_make_tuple2(env, enif_make_uint64(env, matches[i - 1].id), enif_make_int(env, matches[i - 1].distance)),
+                found);
+        }
+        ret = enif_make_list_cell(env, found, ret);
+    }
+
+    enif_make_reverse_list(env, ret, &ret);
+    return make_ok_tuple(env, ret);
+}
+
+static ERL_NIF_TERM
+do_phash_index_save(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    erl_cv_phash_index *eindex;
+    char filename[MAX_PATHNAME];
+    int argc;
+    const ERL_NIF_TERM *argv;
+
+    if(!enif_get_tuple(env, arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+
+    if(!enif_get_resource(env, argv[0], erl_cv_phash_index_type, (void **) &eindex))
+        return enif_make_badarg(env);
+
+    if(enif_get_string(env, argv[1], filename, MAX_PATHNAME, ERL_NIF_LATIN1) <= 0)
+        return make_error_tuple(env, "invalid_filename");
+
+    if(!phash_index_save(eindex->index, filename))
+        return make_error_tuple(env, "write_failed");
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM
+do_phash_index_load(ErlNifEnv *env, erl_cv_connection*, const ERL_NIF_TERM arg)
+{
+    char filename[MAX_PATHNAME];
+    phash_index *index;
+    const char *error = NULL;
+
+    if(enif_get_string(env, arg, filename, MAX_PATHNAME, ERL_NIF_LATIN1) <= 0)
+        return make_error_tuple(env, "invalid_filename");
+
+    index = phash_index_load(filename, &error);
+    if(!index)
+        return make_error_tuple(env, error);
+
+    return make_phash_index(env, index);
+}
+
+/*
+ * Waits until frame index may be sent. Returns 0 once cancelled.
+ */
+static int
+window_wait(erl_cv_decode_window *window, int index)
+{
+    int ok;
+
+    enif_mutex_lock(window->lock);
+    while(!window->cancelled && index >= window->released + window->size)
+        enif_cond_wait(window->cond, window->lock);
+    ok = !window->cancelled;
+    enif_mutex_unlock(window->lock);
+    return ok;
+}
+
+static void
+window_cancel(erl_cv_decode_window *window)
+{
+    enif_mutex_lock(window->lock);
+    window->cancelled = 1;
+    enif_cond_broadcast(window->cond);
+    enif_mutex_unlock(window->lock);
+}
+
+/*
+ * Decodes one segment of a video file with its own decoder and streams every
+ * frame to the caller as {frame, Index, MatOrBinary}.
+ *
+ * With a window, segments are claimed in order whichever stripe runs them.
+ * The segment holding the oldest unconsumed frame has then always been
+ * claimed by a thread that is not waiting, however few threads the backend
+ * has, so waiting on the window cannot deadlock. A segment that fails
+ * cancels the window, the frames it did not send would otherwise hold the
+ * later segments up for good.
+ */
+#define SEGMENT_FAILED -1
+#define SEGMENT_CANCELLED -2
+#define SEGMENT_SHORT -3
+#define SEGMENT_SEEK_FAILED -4
+
+class parallel_decode_body : public cv::ParallelLoopBody
+{
+public:
+    parallel_decode_body(erl_cv_command *cmd, const char *filename, int frame_count, int segments,
+                         const char *ext, const std::vector<int> &params, erl_cv_decode_window *window,
+                         int *next_segment, int *counts, int *failed_at)
+        : cmd(cmd), filename(filename), frame_count(frame_count), segments(segments),
+          ext(ext), params(params), window(window), next_segment(next_segment), counts(counts),
+          failed_at(failed_at) {}
+
+    void operator()(const cv::Range &range) const
+    {
+        for(int i = range.start; i < range.end; i++) {
+            int segment = __atomic_fetch_add(next_segment, 1, __ATOMIC_ACQ_REL);
+            counts[segment] = decode_segment(segment, &failed_at[segment]);
+            if(counts[segment] < 0 && counts[segment] != SEGMENT_CANCELLED && window)
+                window_cancel(window);
+        }
+    }
+
+private:
+    /*
+     * Returns the number of frames sent, or one of the SEGMENT_ codes with
+     * the frame index it happened at in failed_at.
+     */
+    int decode_segment(int segment, int *failed_at) const
+    {
+        int start = (int) ((long long) frame_count * segment / segments);
+        int end = (int) ((long long) frame_count * (segment + 1) / segments);
+        int sent = 0;
+        ErlNifEnv *msg_env;
+        cv::Mat frame;
+        std::vector<uchar> buff;
+
+        *failed_at = start;
+        cv::VideoCapture cap(filename);
+        if(!cap.isOpened())
+            return SEGMENT_FAILED;
+
+        /* Whether a seek lands on the exact frame depends on the backend
+         * and container. Segments are only used when the position reads
+         * back as the one asked for, backends that report the target
+         * without decoding up to it can't be caught here.
+         */
+        if(start > 0 && (!cap.set(cv::CAP_PROP_POS_FRAMES, start) ||
+                         (int) cap.get(cv::CAP_PROP_POS_FRAMES) != start))
+            return SEGMENT_SEEK_FAILED;
+
+        msg_env = enif_alloc_env();
+        if(!msg_env)
+            return SEGMENT_FAILED;
+
+        for(int index = start; index < end; index++) {
+            ERL_NIF_TERM value;
+            bool encoded;
+
+            *failed_at = index;
+            if(window && !window_wait(window, index)) {
+                enif_free_env(msg_env);
+                return SEGMENT_CANCELLED;
+            }
+
+            /* Every Mat handed to erlang needs its own buffer */
+            frame = cv::Mat();
+            if(!cap.read(frame)) {
+                enif_free_env(msg_env);
+                return SEGMENT_SHORT;
+            }
+
+            if(ext) {
+                buff.clear();
+                try {
+                    encoded = cv::imencode(ext, frame, buff, params);
+                } catch(const cv::Exception&) {
+                    encoded = false;
+                }
+                if(!encoded) {
+                    enif_free_env(msg_env);
+                    return SEGMENT_FAILED;
+                }
+                value = make_binary(msg_env, buff.data(), buff.size());
+            } else {
+                value = make_mat(msg_env, frame);
+            }
+
+            enif_send(NULL, &cmd->pid, msg_env,
+                enif_make_tuple3(msg_env, atom_erl_cv, enif_make_copy(msg_env, cmd->ref),
+                    enif_make_tuple3(msg_env, atom_frame, enif_make_int(msg_env, index), value)));
+            enif_clear_env(msg_env);
+            sent++;
+        }
+
+        enif_free_env(msg_env);
+        return sent;
+    }
+
+    erl_cv_command *cmd;
+    const char *filename;
+    int frame_count;
+    int segments;
+    const char *ext;
+    const std::vector<int> &params;
+    erl_cv_decode_window *window;
+    int *next_segment;
+    int *counts;
+    int *failed_at;
+};
+
+/*
+ * Window of a parallel decode, monitoring the caller so decoders stop
+ * waiting if it dies.
+ */
+static erl_cv_decode_window *
+window_create(int size, ErlNifPid *pid)
+{
+    erl_cv_decode_window *window;
+
+    window = (erl_cv_decode_window*) enif_alloc_resource(erl_cv_decode_window_type, sizeof(erl_cv_decode_window));
+    if(!window)
+        return NULL;
+    window->size = size;
+    window->released = 0;
+    window->cancelled = 0;
+    window->lock = enif_mutex_create((char*) "erl_cv_decode_window");
+    window->cond = enif_cond_create((char*) "erl_cv_decode_window");
+    if(!window->lock || !window->cond || enif_monitor_process(NULL, window, pid, &window->monitor) != 0) {
+        enif_release_resource(window);
+        return NULL;
+    }
+    return window;
+}
+
+static ERL_NIF_TERM
+do_vf_parallel_map(erl_cv_command *cmd, erl_cv_connection*)
+{
+    ErlNifEnv *env = cmd->env;
+    char filename[MAX_PATHNAME];
+    char ext[16];
+    int segments, frame_count, argc, sent, window_size, next_segment = 0;
+    const ERL_NIF_TERM *argv;
+    const ERL_NIF_TERM *encode;
+    std::vector<int> params;
+    erl_cv_decode_window *window = NULL;
+
+    if(!enif_get_tuple(env, cmd->arg, &argc, &argv))
+        return enif_make_badarg(env);
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+
+    if(!enif_get_int(env, argv[3], &window_size) || window_size < 0)
+        return make_error_tuple(env, "invalid_window");
+
+    if(enif_get_string(env, argv[0], filename, MAX_PATHNAME, ERL_NIF_LATIN1) <= 0)
+        return make_error_tuple(env, "invalid_filename");
+
+    if(!enif_get_int(env, argv[1], &segments) || segments < 0)
+        return make_error_tuple(env, "invalid_segments");
+
+    /* Optional native pipeline: encode each frame before sending it */
+    if(enif_get_tuple(env, argv[2], &argc, &encode)) {
+        if(argc != 2)
+            return enif_make_badarg(env);
+        if(enif_get_string(env, encode[0], ext, sizeof(ext), ERL_NIF_LATIN1) <= 0)
+            return make_error_tuple(env, "invalid_string");
+        if(!get_params(env, encode[1], params))
+            return make_error_tuple(env, "invalid_params");
+    } else {
+        ext[0] = '\0';
+    }
+
+    {
+        cv::VideoCapture probe(filename);
+        if(!probe.isOpened())
+            return make_error_tuple(env, "not_open");
+        frame_count = (int) probe.get(cv::CAP_PROP_FRAME_COUNT);
+    }
+
+    if(frame_count <= 0)
+        return make_error_tuple(env, "unknown_frame_count");
+
+    if(segments == 0)
+        segments = cv::getNumberOfCPUs();
+    if(segments > frame_count)
+        segments = frame_count;
+
+    /* The caller releases frames as it consumes them, {window, W} comes
+     * before any frame.
+     */
+    if(window_size > 0) {
+        window = window_create(window_size, &cmd->pid);
+        if(!window)
+            return make_error_tuple(env, "no_memory");
+        ErlNifEnv *msg_env = enif_alloc_env();
+        if(!msg_env) {
+            enif_release_resource(window);
+            return make_error_tuple(env, "no_memory");
+        }
+        enif_send(NULL, &cmd->pid, msg_env,
+            enif_make_tuple3(msg_env, atom_erl_cv, enif_make_copy(msg_env, cmd->ref),
+                enif_make_tuple2(msg_env, make_atom(msg_env, "window"), enif_make_resource(msg_env, window))));
+        enif_free_env(msg_env);
+    }
+
+    std::vector<int> counts(segments, 0), failed_at(segments, 0);
+    parallel_decode_body body(cmd, filename, frame_count, segments, ext[0] ? ext : NULL, params, window,
+                              &next_segment, counts.data(), failed_at.data());
+    cv::parallel_for_(cv::Range(0, segments), body, segments);
+    if(window)
+        enif_release_resource(window);
+
+    /* A failed segment cancels the others, report what caused it */
+    sent = 0;
+    for(int i = 0; i < segments; i++) {
+        const char *reason = NULL;
+
+        switch(counts[i]) {
+          case SEGMENT_FAILED: reason = "segment_failed"; break;
+          case SEGMENT_SHORT: reason = "short_segment"; break;
+          case SEGMENT_SEEK_FAILED: reason = "seek_failed"; break;
+        }
+        if(reason)
+            return enif_make_tuple2(env, atom_error, enif_make_tuple2(env, make_atom(env, reason),
+                                                                     enif_make_int(env, failed_at[i])));
+        sent += counts[i] > 0 ? counts[i] : 0;
+    }
+    for(int i = 0; i < segments; i++)
+        if(counts[i] == SEGMENT_CANCELLED)
+            return make_error_tuple(env, "cancelled");
+
+    return make_ok_tuple(env, enif_make_int(env, sent));
+}
+
+/*
+ * Commands that can be part of a batch, by the name of their NIF. Commands
+ * that stream or run on another thread are left out.
+ */
+static struct {
+    const char *name;
+    command_type type;
+    ERL_NIF_TERM atom;
+} batch_commands[] = {
+    {"video_capture_open", cmd_video_capture_open, 0},
+    {"video_capture_close", cmd_video_capture_close, 0},
+    {"video_capture_is_opened", cmd_video_capture_is_opened, 0},
+    {"video_capture_grab", cmd_video_capture_grab, 0},
+    {"video_capture_retreive", cmd_video_capture_retrieve, 0},
+    {"video_capture_read", cmd_video_capture_read, 0},
+    {"video_capture_get", cmd_video_capture_get, 0},
+    {"video_capture_set", cmd_video_capture_set, 0},
+    {"video_capture_feed", cmd_video_capture_feed, 0},
+    {"video_capture_stacked", cmd_video_capture_stacked, 0},
+    {"imencode", cmd_imencode, 0},
+    {"jpeg_encoder_encode", cmd_jpeg_encoder_encode, 0},
+    {"new_mat", cmd_new_mat, 0},
+    {"mat_roi", cmd_mat_roi, 0},
+    {"mat_to_binary", cmd_mat_to_binary, 0},
+    {"mat_serialize", cmd_mat_serialize, 0},
+    {"mat_deserialize", cmd_mat_deserialize, 0},
+    {"stats", cmd_stats, 0},
+    {"detect", cmd_detect, 0},
+    {"orb_extract", cmd_orb_extract, 0},
+    {"features_descriptors", cmd_features_descriptors, 0},
+    {"matcher_match", cmd_matcher_match, 0},
+    {"phash", cmd_phash, 0},
+    {"phash_index_insert", cmd_phash_index_insert, 0},
+    {"phash_index_query", cmd_phash_index_query, 0},
+};
+
+static ERL_NIF_TERM evaluate_command(erl_cv_command *cmd, erl_cv_connection *conn);
+
+/*
+ * Replaces every {ref, N} in term with the result of step N. Only tuples
+ * and lists are searched, and they are rebuilt only when they contain a ref.
+ */
+static int
+resolve_refs(ErlNifEnv *env, ERL_NIF_TERM term, const std::vector<ERL_NIF_TERM> &results, ERL_NIF_TERM *out)
+{
+    int arity;
+    const ERL_NIF_TERM *elems;
+    unsigned int index;
+    ERL_NIF_TERM head, tail;
+    std::vector<ERL_NIF_TERM> items;
+    bool changed = false;
+
+    *out = term;
+
+    if(enif_get_tuple(env, term, &arity, &elems)) {
+        if(arity == 2 && enif_is_identical(elems[0], atom_ref) && enif_get_uint(env, elems[1], &index)) {
+            if(index >= results.size())
+                return 0;
+            *out = results[index];
+            return 1;
+        }
+
+        items.resize(arity);
+        for(int i = 0; i < arity; i++) {
+            if(!resolve_refs(env, elems[i], results, &items[i]))
+                return 0;
+            changed = changed || items[i] != elems[i];
+        }
+        if(changed)
+            *out = enif_make_tuple_from_array(env, items.data(), arity);
+        return 1;
+    }
+
+    if(enif_is_list(env, term)) {
+        tail = term;
+        while(enif_get_list_cell(env, tail, &head, &tail)) {
+            items.push_back(head);
+            if(!resolve_refs(env, head, results, &items.back()))
+                return 0;
+            changed = changed || items.back() != head;
+        }
+        if(changed)
+            *out = enif_make_list_from_array(env, items.data(), items.size());
+        return 1;
+    }
+
+    return 1;
+}
+
+/*
+ * Runs a list of {command, arg} steps back to back and answers once with
+ * the list of their results. An argument may contain {ref, N} to use the
+ * result of step N, unwrapped when it is {ok, Value}. The batch stops at
+ * the first step that fails.
+ */
+static ERL_NIF_TERM
+do_submit_batch(erl_cv_command *cmd, erl_cv_connection *conn)
+{
+    ErlNifEnv *env = cmd->env;
+    std::vector<ERL_NIF_TERM> values;
+    std::vector<ERL_NIF_TERM> answers;
+    ERL_NIF_TERM head, list = cmd->arg;
+    erl_cv_command step = *cmd;
+
+    while(enif_get_list_cell(env, list, &head, &list)) {
+        ERL_NIF_TERM index = enif_make_uint(env, answers.size());
+        ERL_NIF_TERM answer;
+        int arity;
+        const ERL_NIF_TERM *elems;
+        size_t i, count = sizeof(batch_commands) / sizeof(batch_commands[0]);
+
+        if(!enif_get_tuple(env, head, &arity, &elems) || arity != 2)
+            return enif_make_tuple2(env, atom_error, enif_make_tuple2(env, index, make_atom(env, "invalid_step")));
+
+        for(i = 0; i < count; i++)
+            if(enif_is_identical(elems[0], batch_commands[i].atom))
+                break;
+        if(i == count)
+            return enif_make_tuple2(env, atom_error, enif_make_tuple2(env, index, make_atom(env, "unknown_command")));
+
+        step.type = batch_commands[i].type;
+        if(!resolve_refs(env, elems[1], values, &step.arg))
+            return enif_make_tuple2(env, atom_error, enif_make_tuple2(env, index, make_atom(env, "invalid_ref")));
+
+        answer = evaluate_command(&step, conn);
+
+        if(enif_is_exception(env, answer))
+            return enif_make_tuple2(env, atom_error, enif_make_tuple2(env, index, make_atom(env, "badarg")));
+        if(enif_get_tuple(env, answer, &arity, &elems) && arity == 2 && enif_is_identical(elems[0], atom_error))
+            return enif_make_tuple2(env, atom_error, enif_make_tuple2(env, index, elems[1]));
+
+        answers.push_back(answer);
+        if(enif_get_tuple(env, answer, &arity, &elems) && arity == 2 && enif_is_identical(elems[0], atom_ok))
+            values.push_back(elems[1]);
+        else
+            values.push_back(answer);
+    }
+
+    if(!enif_is_empty_list(env, list))
+        return enif_make_badarg(env);
+
+    return make_ok_tuple(env, enif_make_list_from_array(env, answers.data(), answers.size()));
+}
+
+static ERL_NIF_TERM
+evaluate_command(erl_cv_command *cmd, erl_cv_connection *conn)
+{
+    switch(cmd->type) {
+    // Video Capture
+      case cmd_video_capture_open:
+        return do_vc_open(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_close:
+        return do_vc_close(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_is_opened:
+        return do_vc_is_opened(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_grab:
+        return do_vc_grab(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_retrieve:
+        return do_vc_retrieve(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_read:
+        return do_vc_read(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_get:
+        return do_vc_get(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_set:
+        return do_vc_set(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_ring:
+        return do_vc_ring(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_accumulate:
+        return do_vc_accumulate(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_feed:
+        return do_vc_feed(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_stacked:
+        return do_vc_stacked(cmd->env, conn, cmd->arg);
+      case cmd_video_capture_sample:
+        return do_vc_sample(cmd, conn);
+
+    // Video File
+      case cmd_video_file_parallel_map:
+        return do_vf_parallel_map(cmd, conn);
+
+    // Batches
+      case cmd_submit_batch:
+        return do_submit_batch(cmd, conn);
+
+    // Utility
+      case cmd_imencode:
+        return do_imencode(cmd->env, conn, cmd->arg);
+      case cmd_imencode_stream:
+        return do_imencode_stream(cmd, conn);
+      case cmd_imencode_stream_continue:
+        return do_imencode_stream_continue(cmd, conn);
+      case cmd_new_mat:
+        return do_new_mat(cmd->env, conn, cmd->arg);
+      case cmd_encode_cache_config:
+        return do_encode_cache_config(cmd->env, conn, cmd->arg);
+      case cmd_encode_cache_stats:
+        return do_encode_cache_stats(cmd->env, conn, cmd->arg);
+      case cmd_jpeg_encoder_new:
+        return do_jpeg_encoder_new(cmd->env, conn, cmd->arg);
+      case cmd_jpeg_encoder_encode:
+        return do_jpeg_encoder_encode(cmd->env, conn, cmd->arg);
+      case cmd_jpeg_encoder_stats:
+        return do_jpeg_encoder_stats(cmd->env, conn, cmd->arg);
+      case cmd_mat_roi:
+        return do_mat_roi(cmd->env, conn, cmd->arg);
+      case cmd_mat_to_binary:
+        return do_mat_to_binary(cmd->env, conn, cmd->arg);
+      case cmd_mat_serialize:
+        return do_mat_serialize(cmd->env, conn, cmd->arg);
+      case cmd_mat_deserialize:
+        return do_mat_deserialize(cmd->env, conn, cmd->arg);
+
+    // Statistics
+      case cmd_stats:
+        return do_stats(cmd->env, conn, cmd->arg);
+
+    // Object detection
+      case cmd_detector_load:
+        return do_detector_load(cmd->env, conn, cmd->arg);
+      case cmd_detect:
+        return do_detect(cmd->env, conn, cmd->arg);
+
+    // Deep learning
+      case cmd_dnn_read_net:
+        return do_dnn_read_net(cmd->env, conn, cmd->arg);
+
+    // Features
+      case cmd_orb_extract:
+        return do_orb_extract(cmd->env, conn, cmd->arg);
+      case cmd_features_descriptors:
+        return do_features_descriptors(cmd->env, conn, cmd->arg);
+      case cmd_matcher_new:
+        return do_matcher_new(cmd->env, conn, cmd->arg);
+      case cmd_matcher_match:
+        return do_matcher_match(cmd->env, conn, cmd->arg);
+
+    // Perceptual hashing
+      case cmd_phash:
+        return do_phash(cmd->env, conn, cmd->arg);
+      case cmd_phash_index_new:
+        return do_phash_index_new(cmd->env, conn, cmd->arg);
+      case cmd_phash_index_insert:
+        return do_phash_index_insert(cmd->env, conn, cmd->arg);
+      case cmd_phash_index_query:
+        return do_phash_index_query(cmd->env, conn, cmd->arg);
+      case cmd_phash_index_save:
+        return do_phash_index_save(cmd->env, conn, cmd->arg);
+      case cmd_phash_index_load:
+        return do_phash_index_load(cmd->env, conn, cmd->arg);
+      default:
+        return make_error_tuple(cmd->env, "invalid_command");
+    }
+}
+
+/*
+ * Queues a command unless the connection is closed. The check and the push
+ * happen under the connection lock, so nothing lands behind the stop command.
+ */
+static ERL_NIF_TERM
+queue_command(ErlNifEnv *env, erl_cv_connection *conn, queue *q, erl_cv_command *cmd)
+{
+    const char *error = NULL;
+
+    enif_mutex_lock(conn->lock);
+    if(conn->closed)
+        error = "closed";
+    else if(!queue_push(q, cmd))
+        error = "command_push_failed";
+    enif_mutex_unlock(conn->lock);
+
+    if(error) {
+        command_release(cmd);
+        return make_error_tuple(env, error);
+    }
+
+    return atom_ok;
+}
+
+static ERL_NIF_TERM
+push_command(ErlNifEnv *env, erl_cv_connection *conn, erl_cv_command *cmd) {
+    return queue_command(env, conn, conn->commands, cmd);
+}
+
+static ERL_NIF_TERM
+make_answer(erl_cv_command *cmd, ERL_NIF_TERM answer)
+{
+    return enif_make_tuple3(cmd->env, atom_erl_cv, cmd->ref, answer);
+}
+
+/*
+ * Pins the calling thread to the connection's CPUs. Threads started from
+ * it afterwards, such as net threads, inherit the mask. OpenCV's worker
+ * pool is created once per process, so it only inherits the mask of the
+ * first connection that runs parallel code, later connections share it
+ * whatever their CPUs.
+ */
+static void
+apply_affinity(erl_cv_connection *conn)
+{
+    if(conn->pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &conn->cpus);
+}
+
+/*
+ * Evaluates a command and sends the answer. Commands queued while tracing
+ * record their queue wait, execution and reply send as spans.
+ */
+static void
+run_command(erl_cv_command *cmd, erl_cv_connection *conn)
+{
+    uint64_t start, sent;
+    ERL_NIF_TERM answer;
+
+    if(!cmd->queued_at) {
+        answer = evaluate_command(cmd, conn);
+        if(!enif_is_identical(answer, atom_pending))
+            enif_send(NULL, &cmd->pid, cmd->env, make_answer(cmd, answer));
+        return;
+    }
+
+    start = trace_now();
+    trace_span("queue_wait", "queue", cmd->queued_at, start);
+    answer = evaluate_command(cmd, conn);
+    sent = trace_now();
+    trace_span(command_name(cmd->type), "command", start, sent);
+    if(enif_is_identical(answer, atom_pending))
+        return;
+    enif_send(NULL, &cmd->pid, cmd->env, make_answer(cmd, answer));
+    trace_span("enif_send", "reply", sent, trace_now());
+}
+
+static void *
+erl_cv_connection_run(void *arg)
+{
+    erl_cv_connection *conn = (erl_cv_connection *) arg;
+    erl_cv_command *cmd;
+    int continue_running = 1;
+
+    trace_thread_name("erl_cv_connection");
+
+    apply_affinity(conn);
+    /* Process wide for OpenCV's pthreads and TBB backends */
+    if(conn->cv_threads >= 0)
+        cv::setNumThreads(conn->cv_threads);
+
+    while(continue_running) {
+	    cmd = (erl_cv_command*)queue_pop(conn->commands);
+
+        if(cmd->type == cmd_stop) {
+	        continue_running = 0;
+        } else if(__atomic_load_n(&conn->closed, __ATOMIC_ACQUIRE)) {
+            /* Closed, don't run what is still queued */
+            enif_send(NULL, &cmd->pid, cmd->env, make_answer(cmd, make_error_tuple(cmd->env, "closed")));
+        } else {
+	        run_command(cmd, conn);
+        }
+
+	    command_release(cmd);
+    }
+
+    return NULL;
+}
+
+/*
+ * Requests drained from the write queue in one go. Files are all written
+ * before any of them is synced, so fdatasync calls of a batch are grouped.
+ */
+#define MAX_WRITE_BATCH 64
+
+typedef struct {
+    erl_cv_command *cmd;
+    int fd;
+    int sync;
+    size_t bytes;
+    const char *error;
+} write_job;
+
+static void
+write_one(write_job &job, std::vector<uchar> &buff)
+{
+    erl_cv_mat *emat;
+    char filename[MAX_PATHNAME];
+    const char *base, *ext;
+    int argc;
+    const ERL_NIF_TERM *argv;
+    std::vector<int> params;
+    bool encoded;
+    ErlNifEnv *env = job.cmd->env;
+
+    if(!enif_get_tuple(env, job.cmd->arg, &argc, &argv) || argc != 4 ||
+       !enif_get_resource(env, argv[0], erl_cv_mat_type, (void **) &emat)) {
+        job.error = "invalid_arg";
+        return;
+    }
+
+    if(emat->mat->empty()) {
+        job.error = "invalid_mat";
+        return;
+    }
+
+    if(enif_get_string(env, argv[1], filename, MAX_PATHNAME, ERL_NIF_LATIN1) <= 0) {
+        job.error = "invalid_filename";
+        return;
+    }
+
+    /* The extension of the file name, not of a directory on the path */
+    base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    if((ext = strrchr(base, '.')) == NULL) {
+        job.error = "invalid_filename";
+        return;
+    }
+
+    if(!get_params(env, argv[2], params)) {
+        job.error = "invalid_params";
+        return;
+    }
+
+    job.sync = enif_is_identical(argv[3], atom_true);
+
+    buff.clear();
+    try {
+        trace_scope span("cv::imencode");
+        encoded = cv::imencode(ext, *emat->mat, buff, params);
+    } catch(const cv::Exception&) {
+        /* Unknown extensions and unsupported Mats throw */
+        encoded = false;
+    }
+    if(!encoded) {
+        job.error = "encode_failed";
+        return;
+    }
+
+    trace_scope span("write", "io");
+
+    job.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(job.fd < 0) {
+        job.error = "open_failed";
+        return;
+    }
+
+    for(size_t off = 0; off < buff.size(); ) {
+        ssize_t n = write(job.fd, buff.data() + off, buff.size() - off);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            job.error = "write_failed";
+            return;
+        }
+        off += n;
+    }
+    job.bytes = buff.size();
+}
+
+static void *
+erl_cv_io_run(void *arg)
+{
+    erl_cv_connection *conn = (erl_cv_connection *) arg;
+    std::vector<write_job> jobs;
+    std::vector<uchar> buff;
+    int continue_running = 1;
+
+    trace_thread_name("erl_cv_io");
+    apply_affinity(conn);
+
+    while(continue_running) {
+        erl_cv_command *cmd = (erl_cv_command*) queue_pop(conn->writes);
+
+        jobs.clear();
+        while(cmd) {
+            if(cmd->type == cmd_stop) {
+                command_release(cmd);
+                continue_running = 0;
+                break;
+            }
+
+            if(cmd->queued_at)
+                trace_span("queue_wait", "queue", cmd->queued_at, trace_now());
+
+            write_job job = {cmd, -1, 0, 0, NULL};
+            jobs.push_back(job);
+            if(jobs.size() >= MAX_WRITE_BATCH)
+                break;
+            cmd = (erl_cv_command*) queue_try_pop(conn->writes);
+        }
+
+        for(size_t i = 0; i < jobs.size(); i++)
+            write_one(jobs[i], buff);
+
+        for(size_t i = 0; i < jobs.size(); i++) {
+            if(jobs[i].sync && !jobs[i].error) {
+                trace_scope span("fdatasync", "io");
+                if(fdatasync(jobs[i].fd) != 0)
+                    jobs[i].error = "sync_failed";
+            }
+        }
+
+        for(size_t i = 0; i < jobs.size(); i++) {
+            write_job &job = jobs[i];
+            ErlNifEnv *env = job.cmd->env;
+
+            if(job.fd >= 0 && close(job.fd) != 0 && !job.error)
+                job.error = "write_failed";
+
+            enif_send(NULL, &job.cmd->pid, env, make_answer(job.cmd, job.error ?
+                make_error_tuple(env, job.error) :
+                make_ok_tuple(env, enif_make_uint64(env, job.bytes))));
+            command_release(job.cmd);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Teardown that can block, joining threads or releasing a device, is done
+ * by the reaper thread so destructors never stall a scheduler. There is a
+ * single reaper and it works in order, so a device whose release() hangs
+ * holds up every teardown handed to it later.
+ *
+ * The reaper is process wide, an upgraded module instance shares it with
+ * the old one. It is counted per instance and stops with the last.
+ */
+typedef enum {
+    reap_stop,
+    reap_connection,
+    reap_net,
+    reap_capture,
+} reap_kind;
+
+typedef struct {
+    reap_kind kind;
+    void *obj;
+} reap_item;
+
+static ErlNifMutex *reaper_lock = NULL;
+static queue *reaper_queue = NULL;
+static ErlNifTid reaper_tid;
+static ErlNifThreadOpts *reaper_opts = NULL;
+static int reaper_running = 0;
+static int reaper_users = 0;
+static reap_item reaper_stop_item = {reap_stop, NULL};
+
+static void
+connection_free(erl_cv_connection *conn)
+{
+    if(conn->commands) {
+        while(queue_has_item(conn->commands))
+            command_release((erl_cv_command*) queue_pop(conn->commands));
+        queue_destroy(conn->commands);
+    }
+    if(conn->writes) {
+        while(queue_has_item(conn->writes))
+            command_release((erl_cv_command*) queue_pop(conn->writes));
+        queue_destroy(conn->writes);
+    }
+
+    if(conn->cache)
+        encode_cache_destroy(conn->cache);
+
+    for(std::map<std::string, erl_cv_detector*>::iterator it = conn->detectors->begin(); it != conn->detectors->end(); ++it)
+        enif_release_resource(it->second);
+    delete conn->detectors;
+
+    if(conn->pool)
+        command_pool_destroy(conn->pool);
+    if(conn->lock)
+        enif_mutex_destroy(conn->lock);
+    enif_free(conn);
+}
+
+static void
+connection_release(erl_cv_connection *conn)
+{
+    int refs;
+
+    enif_mutex_lock(conn->lock);
+    refs = --conn->refs;
+    enif_mutex_unlock(conn->lock);
+
+    if(refs == 0)
+        connection_free(conn);
+}
+
+/*
+ * Joins the connection's threads, then frees the state only they touched
+ */
+static void
+connection_reap(erl_cv_connection *conn)
+{
+    if(conn->opts) {
+        enif_thread_join(conn->tid, NULL);
+        enif_thread_opts_destroy(conn->opts);
+        conn->opts = NULL;
+    }
+    if(conn->io_opts) {
+        enif_thread_join(conn->io_tid, NULL);
+        enif_thread_opts_destroy(conn->io_opts);
+        conn->io_opts = NULL;
+    }
+
+    if(conn->cache) {
+        encode_cache_destroy(conn->cache);
+        conn->cache = NULL;
+    }
+    for(std::map<std::string, erl_cv_detector*>::iterator it = conn->detectors->begin(); it != conn->detectors->end(); ++it)
+        enif_release_resource(it->second);
+    conn->detectors->clear();
+
+    connection_release(conn);
+}
+
+static void
+net_free(erl_cv_net *enet)
+{
+    if(enet->opts) {
+        enif_thread_join(enet->tid, NULL);
+        enif_thread_opts_destroy(enet->opts);
+    }
+    if(enet->requests) {
+        queue_destroy(enet->requests);
+    }
+    if(enet->pool) {
+        command_pool_destroy(enet->pool);
+    }
+    if(enet->net) {
+        delete enet->net;
+    }
+    enif_free(enet);
+}
+
+static void *
+erl_cv_reaper_run(void *)
+{
+    trace_thread_name("erl_cv_reaper");
+
+    for(;;) {
+        reap_item *item = (reap_item *) queue_pop(reaper_queue);
+
+        if(item->kind == reap_stop)
+            break;
+
+        switch(item->kind) {
+          case reap_connection:
+            connection_reap((erl_cv_connection *) item->obj);
+            break;
+          case reap_net:
+            net_free((erl_cv_net *) item->obj);
+            break;
+          case reap_capture:
+            capture_release((erl_cv_video_capture *) item->obj);
+            enif_free(item->obj);
+            break;
+          default:
+            break;
+        }
+        enif_free(item);
+    }
+
+    return NULL;
+}
+
+/*
+ * Hands obj to the reaper. Returns 0 when it is not running, the caller
+ * then has to clean up itself.
+ */
+static int
+reaper_submit(reap_kind kind, void *obj)
+{
+    reap_item *item = (reap_item *) enif_alloc(sizeof(reap_item));
+    int queued = 0;
+
+    if(!item)
+        return 0;
+    item->kind = kind;
+    item->obj = obj;
+
+    enif_mutex_lock(reaper_lock);
+    if(reaper_running)
+        queued = queue_push(reaper_queue, item);
+    enif_mutex_unlock(reaper_lock);
+
+    if(!queued)
+        enif_free(item);
+    return queued;
+}
+
+/*
+ * Takes a reference on the reaper, starting it for the first
+ */
+static int
+reaper_start()
+{
+    /* Kept for good, destructors may still run after an unload */
+    if(!reaper_lock)
+        reaper_lock = enif_mutex_create((char*) "erl_cv_reaper");
+    if(!reaper_lock)
+        return 0;
+
+    enif_mutex_lock(reaper_lock);
+    if(reaper_users > 0) {
+        reaper_users++;
+        enif_mutex_unlock(reaper_lock);
+        return 1;
+    }
+
+    reaper_queue = queue_create();
+    if(!reaper_queue) {
+        enif_mutex_unlock(reaper_lock);
+        return 0;
+    }
+
+    reaper_opts = enif_thread_opts_create((char*) "erl_cv_reaper_thread_opts");
+    if(enif_thread_create((char*) "erl_cv_reaper", &reaper_tid, erl_cv_reaper_run, NULL, reaper_opts) != 0) {
+        enif_thread_opts_destroy(reaper_opts);
+        queue_destroy(reaper_queue);
+        enif_mutex_unlock(reaper_lock);
+        return 0;
+    }
+
+    reaper_running = 1;
+    reaper_users = 1;
+    enif_mutex_unlock(reaper_lock);
+    return 1;
+}
+
+/*
+ * Drops a reference on the reaper. The last one finishes what was handed
+ * to the reaper before it stops.
+ */
+static void
+reaper_stop()
+{
+    enif_mutex_lock(reaper_lock);
+    if(reaper_users == 0 || --reaper_users > 0) {
+        enif_mutex_unlock(reaper_lock);
+        return;
+    }
+    reaper_running = 0;
+    queue_push_last(reaper_queue, &reaper_stop_item);
+    enif_mutex_unlock(reaper_lock);
+
+    enif_thread_join(reaper_tid, NULL);
+    enif_thread_opts_destroy(reaper_opts);
+    queue_destroy(reaper_queue);
+}
+
+/*
+ * Stops a connection without waiting for it. Commands still queued are
+ * answered with {error, closed} and the reaper joins the threads.
+ */
+static void
+connection_close(erl_cv_connection *conn)
+{
+    enif_mutex_lock(conn->lock);
+    if(conn->closed) {
+        enif_mutex_unlock(conn->lock);
+        return;
+    }
+    __atomic_store_n(&conn->closed, 1, __ATOMIC_RELEASE);
+    if(conn->opts)
+        push_stop(conn->commands);
+    if(conn->io_opts)
+        push_stop(conn->writes);
+    conn->refs++;
+    enif_mutex_unlock(conn->lock);
+
+    if(!reaper_submit(reap_connection, conn))
+        connection_reap(conn);
+}
+
+/*
+ * Start the processing thread
+ */
+static ERL_NIF_TERM
+erl_cv_start(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_connection_handle *handle;
+    ERL_NIF_TERM conn_resource;
+    int cv_threads = -1;
+    int pinned = 0;
+    cpu_set_t cpus;
+
+    /* Options are {cv_threads, cpus}, -1 and [] keep the defaults. cpus
+     * is a list to pin to, or {exclude, List} to pin to the CPUs this
+     * process may run on except those. That is the mask of the main
+     * thread, the calling scheduler may itself be bound to a single CPU.
+     */
+    CPU_ZERO(&cpus);
+    if(argc == 1) {
+        int oargc, xargc, cpu, exclude = 0;
+        const ERL_NIF_TERM *oargv, *xargv;
+        ERL_NIF_TERM head, tail;
+
+        if(!enif_get_tuple(env, argv[0], &oargc, &oargv) || oargc != 2)
+            return enif_make_badarg(env);
+
+        if(!enif_get_int(env, oargv[0], &cv_threads))
+            return make_error_tuple(env, "invalid_cv_threads");
+
+        tail = oargv[1];
+        if(enif_get_tuple(env, tail, &xargc, &xargv)) {
+            if(xargc != 2 || !enif_is_identical(xargv[0], make_atom(env, "exclude")))
+                return make_error_tuple(env, "invalid_cpu");
+            if(sched_getaffinity(getpid(), sizeof(cpu_set_t), &cpus) != 0)
+                return make_error_tuple(env, "affinity_failed");
+            tail = xargv[1];
+            exclude = 1;
+        }
+
+        while(enif_get_list_cell(env, tail, &head, &tail)) {
+            if(!enif_get_int(env, head, &cpu) || cpu < 0 || cpu >= CPU_SETSIZE)
+                return make_error_tuple(env, "invalid_cpu");
+            if(exclude) {
+                CPU_CLR(cpu, &cpus);
+            } else {
+                CPU_SET(cpu, &cpus);
+                pinned = 1;
+            }
+        }
+
+        if(exclude) {
+            if(CPU_COUNT(&cpus) == 0)
+                return make_error_tuple(env, "no_free_cpus");
+            pinned = 1;
+        }
+    }
+
+    /* Initialize the connection, the resource only refers to it */
+    conn = (erl_cv_connection *) enif_alloc(sizeof(erl_cv_connection));
+    if(!conn)
+	    return make_error_tuple(env, "no_memory");
+
+    conn->cv_threads = cv_threads;
+    conn->pinned = pinned;
+    conn->cpus = cpus;
+
+    conn->opts = NULL;
+    conn->commands = NULL;
+    conn->cache = NULL;
+    conn->io_opts = NULL;
+    conn->writes = NULL;
+    conn->refs = 1;
+    conn->closed = 0;
+    conn->detectors = new std::map<std::string, erl_cv_detector*>();
+
+    /* Create command queues and the pool their commands come from */
+    conn->lock = enif_mutex_create((char*) "erl_cv_connection");
+    conn->pool = command_pool_create();
+    if(!conn->lock || !conn->pool) {
+	    connection_free(conn);
+	    return make_error_tuple(env, "no_memory");
+    }
+    conn->commands = queue_create();
+    conn->writes = queue_create();
+    if(!conn->commands || !conn->writes) {
+	    connection_free(conn);
+	    return make_error_tuple(env, "command_queue_create_failed");
+    }
+
+    /* Start command processing thread */
+    conn->opts = enif_thread_opts_create((char*) "erl_video_capture_thread_opts");
+    if(enif_thread_create((char*) "erl_cv_connection", &conn->tid, erl_cv_connection_run, conn, conn->opts) != 0) {
+	    enif_thread_opts_destroy(conn->opts);
+	    conn->opts = NULL;
+	    connection_free(conn);
+	    return make_error_tuple(env, (char*)"thread_create_failed");
+    }
+
+    /* Start the I/O thread for imwrite_async */
+    conn->io_opts = enif_thread_opts_create((char*) "erl_cv_io_thread_opts");
+    if(enif_thread_create((char*) "erl_cv_io", &conn->io_tid, erl_cv_io_run, conn, conn->io_opts) != 0) {
+	    enif_thread_opts_destroy(conn->io_opts);
+	    conn->io_opts = NULL;
+	    connection_close(conn);
+	    connection_release(conn);
+	    return make_error_tuple(env, (char*)"thread_create_failed");
+    }
+
+    handle = (erl_cv_connection_handle *) enif_alloc_resource(erl_cv_type, sizeof(erl_cv_connection_handle));
+    if(!handle) {
+	    connection_close(conn);
+	    connection_release(conn);
+	    return make_error_tuple(env, "no_memory");
+    }
+    handle->conn = conn;
+
+    conn_resource = enif_make_resource(env, handle);
+    enif_release_resource(handle);
+
+    return make_ok_tuple(env, conn_resource);
+}
+
+/**
+ * Closes a connection. Returns at once, queued commands are answered with
+ * {error, closed} and new ones are refused.
+*/
+static ERL_NIF_TERM
+erl_cv_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+
+    if(argc != 1)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+
+    connection_close(conn);
+    return atom_ok;
+}
+
+/**
+ * Lets the decoders of a windowed parallel decode send frames up to
+ * next + window size. Called by the caller as it consumes frames.
+*/
+static ERL_NIF_TERM
+erl_cv_video_file_release(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_decode_window *window;
+    int next;
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+    if(!enif_get_resource(env, argv[0], erl_cv_decode_window_type, (void **) &window))
+        return enif_make_badarg(env);
+    if(!enif_get_int(env, argv[1], &next))
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(window->lock);
+    if(next > window->released) {
+        window->released = next;
+        enif_cond_broadcast(window->cond);
+    }
+    enif_mutex_unlock(window->lock);
+    return atom_ok;
+}
+
+/**
+ * Acks one chunk of a windowed imencode_stream. If the stream parked
+ * waiting for it, the next slice is queued on the connection again.
+*/
+static ERL_NIF_TERM
+erl_cv_imencode_stream_ack(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_encode_stream *stream;
+    ERL_NIF_TERM ret;
+    int resume;
+
+    if(argc != 2)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+        return enif_make_badarg(env);
+    if(!enif_get_resource(env, argv[1], erl_cv_encode_stream_type, (void **) &stream) ||
+       stream->conn != conn || !stream->window)
+        return enif_make_badarg(env);
+
+    enif_mutex_lock(stream->lock);
+    if(stream->outstanding > 0)
+        stream->outstanding--;
+    resume = stream->parked && stream->outstanding < stream->window;
+    if(resume)
+        stream->parked = 0;
+    enif_mutex_unlock(stream->lock);
+
+    if(!resume)
+        return atom_ok;
+
+    /* Nothing else will answer the stream, tell the caller why it ended */
+    ret = queue_stream_continue(env, conn, stream, argv[1]);
+    if(!enif_is_identical(ret, atom_ok))
+        enif_send(env, &stream->pid, NULL,
+            enif_make_tuple3(env, atom_erl_cv, enif_make_copy(env, stream->ref), ret));
+    return ret;
+}
+
+/**
+ * Stops a windowed parallel decode, its decoders finish without sending
+ * the rest of their frames.
+*/
+static ERL_NIF_TERM
+erl_cv_video_file_cancel(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_decode_window *window;
+
+    if(argc != 1)
+        return enif_make_badarg(env);
+    if(!enif_get_resource(env, argv[0], erl_cv_decode_window_type, (void **) &window))
+        return enif_make_badarg(env);
+
+    window_cancel(window);
+    return atom_ok;
+}
+
+static ERL_NIF_TERM
+erl_video_capture_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+	    return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_list(env, argv[3]))
+	    return make_error_tuple(env, "invalid_arg");
+
+    /* Note, no check is made for the type of the argument */
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_open;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+    return push_command(env, conn, cmd);
+}
+
+static ERL_NIF_TERM
+erl_video_capture_close(ErlNifEnv *env, int, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_ref(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_close;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Returns true if video capturing has been initialized already.
+    If the previous call to VideoCapture constructor or VideoCapture::open() succeeded, the method returns true. 
+ * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#a9d2ca36789e7fcfe7a7be3b328038585
+*/
+static ERL_NIF_TERM
+erl_video_capture_is_opened(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_ref(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_is_opened;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Grabs the next frame from video file or capturing device. 
+ * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#ae38c2a053d39d6b20c9c649e08ff0146
+*/
+static ERL_NIF_TERM
+erl_video_capture_grab(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_ref(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_grab;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * grab and decode a frame
+ * https://docs.opencv.org/3.2.0/d8/dfe/classcv_1_1VideoCapture.html#a9ac7f4b1cdfe624663478568486e6712
+*/
+static ERL_NIF_TERM
+erl_video_capture_retrieve(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_retrieve;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Grabs, decodes and returns the next video frame. 
+ * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#a473055e77dd7faa4d26d686226b292c1
+*/
+static ERL_NIF_TERM
+erl_video_capture_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+   if(!enif_is_ref(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_read;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Streams every Nth frame of a capture, or a number of frames per second,
+ * as {frame, Index, Mat} messages, grabbing the frames in between without
+ * decoding them into Mats.
+*/
+static ERL_NIF_TERM
+erl_video_capture_sample(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_sample;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Returns the specified VideoCapture property. 
+ * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#aa6480e6972ef4c00d74814ec841a2939
+*/
+static ERL_NIF_TERM
+erl_video_capture_get(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_get;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Sets a property in the VideoCapture. 
+ * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#a8c6d8c2d37505b5ca61ffd4bb54e9a7c
+*/
+static ERL_NIF_TERM
+erl_video_capture_set(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_set;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Publishes every frame read from the VideoCapture into a POSIX shared memory ring
+ * that other processes can map. See erl_cv_ring.h for the layout.
+*/
+static ERL_NIF_TERM
+erl_video_capture_ring(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_ring;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Stacks the frames of the VideoCapture, as a running average or a sliding
+ * window median.
+*/
+static ERL_NIF_TERM
+erl_video_capture_accumulate(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_accumulate;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Reads frames into the accumulator of the VideoCapture without sending them.
+*/
+static ERL_NIF_TERM
+erl_video_capture_feed(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_feed;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Returns the stacked frame of the VideoCapture.
+*/
+static ERL_NIF_TERM
+erl_video_capture_stacked(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_capture_stacked;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Splits a video file into segments and decodes them in parallel, one decoder per segment.
+ * Frames are streamed back tagged with their frame index.
+*/
+static ERL_NIF_TERM
+erl_video_file_parallel_map(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_video_file_parallel_map;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Encode an image
+ * https://docs.opencv.org/3.4/d4/da8/group__imgcodecs.html#ga26a67788faa58ade337f8d28ba0eb19e
+*/
+static ERL_NIF_TERM
+erl_cv_imencode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_imencode;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Encodes a Mat as JPEG or PNG a slice of rows at a time. The output is sent
+ * as chunks of a fixed size while encoding goes on, other commands run between
+ * slices.
+*/
+static ERL_NIF_TERM
+erl_cv_imencode_stream(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_imencode_stream;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Encodes a Mat and writes it to a file on the connection's I/O thread.
+ * Only the outcome and the byte count are sent back.
+*/
+static ERL_NIF_TERM
+erl_cv_imwrite_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_imwrite_async;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+    return queue_command(env, conn, conn->writes, cmd);
+}
+
+/**
+ * Constructs a new Mat
+ * https://docs.opencv.org/3.4.5/d3/d63/classcv_1_1Mat.html#af1d014cecd1510cdf580bf2ed7e5aafc
+*/
+static ERL_NIF_TERM
+erl_cv_new_mat(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_ref(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_new_mat;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Enables, resizes or disables the encode cache of a connection.
+*/
+static ERL_NIF_TERM
+erl_cv_encode_cache_config(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_encode_cache_config;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Returns hit and miss counts of the encode cache.
+*/
+static ERL_NIF_TERM
+erl_cv_encode_cache_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_encode_cache_stats;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Creates a JPEG encoder that adapts its quality to a byte budget per frame.
+*/
+static ERL_NIF_TERM
+erl_cv_jpeg_encoder_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_jpeg_encoder_new;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Encodes a Mat with a rate controlled JPEG encoder.
+*/
+static ERL_NIF_TERM
+erl_cv_jpeg_encoder_encode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_jpeg_encoder_encode;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Returns the sizes and qualities a rate controlled JPEG encoder achieved.
+*/
+static ERL_NIF_TERM
+erl_cv_jpeg_encoder_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_ref(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_jpeg_encoder_stats;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Returns a view on a region of a Mat that shares the parent's pixels.
+ * https://docs.opencv.org/3.4.5/d3/d63/classcv_1_1Mat.html#a92a3e9e5911a2eb0cf0950a0a9670c76
+*/
+static ERL_NIF_TERM
+erl_cv_mat_roi(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_mat_roi;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Returns the raw pixel data of a Mat, row by row.
+*/
+static ERL_NIF_TERM
+erl_cv_mat_to_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_ref(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_mat_to_binary;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Serializes a Mat into a binary that can be sent to another node.
+*/
+static ERL_NIF_TERM
+erl_cv_mat_serialize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_mat_serialize;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Turns a binary made by mat_serialize back into a Mat.
+*/
+static ERL_NIF_TERM
+erl_cv_mat_deserialize(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_binary(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_mat_deserialize;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Computes histograms, mean/stddev, min/max locations or sharpness of one or
+ * many Mats and returns them as small terms.
+*/
+static ERL_NIF_TERM
+erl_cv_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_stats;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Loads a network and starts its batching thread.
+ * https://docs.opencv.org/3.4.5/d6/d0f/group__dnn.html#ga3b34fe7a29494a6a4295c169a7d32422
+*/
+static ERL_NIF_TERM
+erl_cv_dnn_read_net(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_dnn_read_net;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
+}
+
+/**
+ * Queues a Mat for inference on a net. Requests are not run on a connection,
+ * they are batched with those of other callers on the net's own thread.
+*/
+static ERL_NIF_TERM
+erl_cv_dnn_infer(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_net_handle *handle;
+    erl_cv_net *enet;
+    erl_cv_mat *emat;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!enif_get_resource(env, argv[0], erl_cv_net_type, (void **) &handle))
+	    return enif_make_badarg(env);
+    enet = handle->enet;
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_get_resource(env, argv[3], erl_cv_mat_type, (void **) &emat))
+        return make_error_tuple(env, "invalid_arg");
+    if(!dnn_input_ok(*emat->mat))
+        return make_error_tuple(env, "invalid_mat");
+
+    cmd = command_create(enet->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
+
+    cmd->type = cmd_dnn_infer;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+
+    if(!queue_push(enet->requests, cmd)) {
+        command_release(cmd);
+        return make_error_tuple(env, "command_push_failed");
+    }
+
+    return atom_ok;
+}
+
+/**
+ * Loads a cascade classifier or the default HOG people detector into the
+ * connection's model registry.
+ * https://docs.opencv.org/3.4.5/d1/de5/classcv_1_1CascadeClassifier.html
+*/
+static ERL_NIF_TERM
+erl_cv_detector_load(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
+
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
+
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
 
-    return make_atom(env, "ok");
+    cmd->type = cmd_detector_load;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
 }
 
+/**
+ * Runs a detector on one or many Mats, optionally within a region and downscaled.
+*/
 static ERL_NIF_TERM
-make_answer(erl_cv_command *cmd, ERL_NIF_TERM answer)
+erl_cv_detect(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    return enif_make_tuple3(cmd->env, atom_erl_cv, cmd->ref, answer);
-}
-
-static void *
-erl_cv_connection_run(void *arg)
-{
-    erl_cv_connection *conn = (erl_cv_connection *) arg;
-    erl_cv_command *cmd;
-    int continue_running = 1;
-
-    while(continue_running) {
-	    cmd = (erl_cv_command*)queue_pop(conn->commands);
+    erl_cv_connection *conn;
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
 
-        if(cmd->type == cmd_stop) {
-	        continue_running = 0;
-        } else {
-	        enif_send(NULL, &cmd->pid, cmd->env, make_answer(cmd, evaluate_command(cmd, conn)));
-        }
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
 
-	    command_destroy(cmd);
-    }
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
 
-    return NULL;
+    cmd->type = cmd_detect;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
 }
 
-/*
- * Start the processing thread
- */
+/**
+ * Detects ORB keypoints and computes their descriptors for one or many Mats.
+ * https://docs.opencv.org/3.4.5/db/d95/classcv_1_1ORB.html
+*/
 static ERL_NIF_TERM
-erl_cv_start(ErlNifEnv* env, int, const ERL_NIF_TERM[])
+erl_cv_orb_extract(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
-    ERL_NIF_TERM conn_resource;
-
-    /* Initialize the resource */
-    conn = (erl_cv_connection *) enif_alloc_resource(erl_cv_type, sizeof(erl_cv_connection));
-    if(!conn)
-	    return make_error_tuple(env, "no_memory");
-
-    /* Create command queue */
-    conn->commands = queue_create();
-    if(!conn->commands) {
-	    enif_release_resource(conn);
-	    return make_error_tuple(env, "command_queue_create_failed");
-    }
+    erl_cv_command *cmd = NULL;
+    ErlNifPid pid;
 
-    /* Start command processing thread */
-    conn->opts = enif_thread_opts_create((char*) "erl_video_capture_thread_opts");
-    if(enif_thread_create((char*) "erl_cv_connection", &conn->tid, erl_cv_connection_run, conn, conn->opts) != 0) {
-	    enif_release_resource(conn);
-	    return make_error_tuple(env, (char*)"thread_create_failed");
-    }
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
+	    return enif_make_badarg(env);
+    if(!enif_is_ref(env, argv[1]))
+	    return make_error_tuple(env, "invalid_ref");
+    if(!enif_get_local_pid(env, argv[2], &pid))
+	    return make_error_tuple(env, "invalid_pid");
+    if(!enif_is_tuple(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
 
-    conn_resource = enif_make_resource(env, conn);
-    enif_release_resource(conn);
+    cmd = command_create(conn->pool);
+    if(!cmd)
+	    return make_error_tuple(env, "command_create_failed");
 
-    return make_ok_tuple(env, conn_resource);
+    cmd->type = cmd_orb_extract;
+    cmd->ref = enif_make_copy(cmd->env, argv[1]);
+    cmd->pid = pid;
+    cmd->arg = enif_make_copy(cmd->env, argv[3]);
+    return push_command(env, conn, cmd);
 }
 
+/**
+ * Returns the keypoint count and raw descriptors of a features resource.
+*/
 static ERL_NIF_TERM
-erl_video_capture_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+erl_cv_features_descriptors(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
     ErlNifPid pid;
 
     if(argc != 4)
-	    return enif_make_badarg(env);
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
     if(!enif_get_local_pid(env, argv[2], &pid))
 	    return make_error_tuple(env, "invalid_pid");
-    if(!enif_is_list(env, argv[3]))
-	    return make_error_tuple(env, "invalid_arg");
+    if(!enif_is_ref(env, argv[3]))
+        return make_error_tuple(env, "invalid_arg");
 
-    /* Note, no check is made for the type of the argument */
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_video_capture_open;
+    cmd->type = cmd_features_descriptors;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
-
     return push_command(env, conn, cmd);
 }
 
+/**
+ * Creates a brute-force Hamming or LSH matcher over a reference set of features.
+ * https://docs.opencv.org/3.4.5/db/d39/classcv_1_1DescriptorMatcher.html
+*/
 static ERL_NIF_TERM
-erl_video_capture_close(ErlNifEnv *env, int, const ERL_NIF_TERM argv[])
+erl_cv_matcher_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
     ErlNifPid pid;
 
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+    if(argc != 4)
+        return enif_make_badarg(env);
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
     if(!enif_get_local_pid(env, argv[2], &pid))
 	    return make_error_tuple(env, "invalid_pid");
-    if(!enif_is_ref(env, argv[3]))
+    if(!enif_is_tuple(env, argv[3]))
         return make_error_tuple(env, "invalid_arg");
 
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_video_capture_close;
+    cmd->type = cmd_matcher_new;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
@@ -532,12 +5545,10 @@ erl_video_capture_close(ErlNifEnv *env, int, const ERL_NIF_TERM argv[])
 }
 
 /**
- * Returns true if video capturing has been initialized already.
-    If the previous call to VideoCapture constructor or VideoCapture::open() succeeded, the method returns true. 
- * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#a9d2ca36789e7fcfe7a7be3b328038585
+ * Matches one or many feature sets against the reference set of a matcher.
 */
 static ERL_NIF_TERM
-erl_video_capture_is_opened(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+erl_cv_matcher_match(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
@@ -545,20 +5556,20 @@ erl_video_capture_is_opened(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
     if(argc != 4)
         return enif_make_badarg(env);
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
     if(!enif_get_local_pid(env, argv[2], &pid))
 	    return make_error_tuple(env, "invalid_pid");
-    if(!enif_is_ref(env, argv[3]))
+    if(!enif_is_tuple(env, argv[3]))
         return make_error_tuple(env, "invalid_arg");
 
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_video_capture_is_opened;
+    cmd->type = cmd_matcher_match;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
@@ -566,11 +5577,10 @@ erl_video_capture_is_opened(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 }
 
 /**
- * Grabs the next frame from video file or capturing device. 
- * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#ae38c2a053d39d6b20c9c649e08ff0146
+ * Computes a 64 bit perceptual hash (ahash, dhash or phash) of one or many Mats.
 */
 static ERL_NIF_TERM
-erl_video_capture_grab(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+erl_cv_phash(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
@@ -578,20 +5588,20 @@ erl_video_capture_grab(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
     if(argc != 4)
         return enif_make_badarg(env);
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
     if(!enif_get_local_pid(env, argv[2], &pid))
 	    return make_error_tuple(env, "invalid_pid");
-    if(!enif_is_ref(env, argv[3]))
+    if(!enif_is_tuple(env, argv[3]))
         return make_error_tuple(env, "invalid_arg");
 
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_video_capture_grab;
+    cmd->type = cmd_phash;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
@@ -599,11 +5609,10 @@ erl_video_capture_grab(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 }
 
 /**
- * grab and decode a frame
- * https://docs.opencv.org/3.2.0/d8/dfe/classcv_1_1VideoCapture.html#a9ac7f4b1cdfe624663478568486e6712
+ * Creates an empty perceptual hash index.
 */
 static ERL_NIF_TERM
-erl_video_capture_retrieve(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+erl_cv_phash_index_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
@@ -611,20 +5620,18 @@ erl_video_capture_retrieve(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
     if(argc != 4)
         return enif_make_badarg(env);
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
     if(!enif_get_local_pid(env, argv[2], &pid))
 	    return make_error_tuple(env, "invalid_pid");
-    if(!enif_is_tuple(env, argv[3]))
-        return make_error_tuple(env, "invalid_arg");
 
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_video_capture_retrieve;
+    cmd->type = cmd_phash_index_new;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
@@ -632,11 +5639,10 @@ erl_video_capture_retrieve(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 }
 
 /**
- * Grabs, decodes and returns the next video frame. 
- * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#a473055e77dd7faa4d26d686226b292c1
+ * Inserts a batch of {Hash, Id} entries into an index.
 */
 static ERL_NIF_TERM
-erl_video_capture_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+erl_cv_phash_index_insert(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
@@ -644,20 +5650,20 @@ erl_video_capture_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
     if(argc != 4)
         return enif_make_badarg(env);
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
     if(!enif_get_local_pid(env, argv[2], &pid))
 	    return make_error_tuple(env, "invalid_pid");
-   if(!enif_is_ref(env, argv[3]))
+    if(!enif_is_tuple(env, argv[3]))
         return make_error_tuple(env, "invalid_arg");
 
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_video_capture_read;
+    cmd->type = cmd_phash_index_insert;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
@@ -665,11 +5671,10 @@ erl_video_capture_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 }
 
 /**
- * Returns the specified VideoCapture property. 
- * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#aa6480e6972ef4c00d74814ec841a2939
+ * Finds all entries within a Hamming radius of each hash in a batch.
 */
 static ERL_NIF_TERM
-erl_video_capture_get(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+erl_cv_phash_index_query(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
@@ -677,7 +5682,7 @@ erl_video_capture_get(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
     if(argc != 4)
         return enif_make_badarg(env);
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
@@ -686,11 +5691,11 @@ erl_video_capture_get(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
     if(!enif_is_tuple(env, argv[3]))
         return make_error_tuple(env, "invalid_arg");
 
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_video_capture_get;
+    cmd->type = cmd_phash_index_query;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
@@ -698,11 +5703,10 @@ erl_video_capture_get(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 }
 
 /**
- * Sets a property in the VideoCapture. 
- * https://docs.opencv.org/3.4.5/d8/dfe/classcv_1_1VideoCapture.html#a8c6d8c2d37505b5ca61ffd4bb54e9a7c
+ * Writes an index to disk in the format phash_index_load maps.
 */
 static ERL_NIF_TERM
-erl_video_capture_set(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+erl_cv_phash_index_save(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
@@ -710,7 +5714,7 @@ erl_video_capture_set(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
     if(argc != 4)
         return enif_make_badarg(env);
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
@@ -719,11 +5723,11 @@ erl_video_capture_set(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
     if(!enif_is_tuple(env, argv[3]))
         return make_error_tuple(env, "invalid_arg");
 
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_video_capture_set;
+    cmd->type = cmd_phash_index_save;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
@@ -731,11 +5735,10 @@ erl_video_capture_set(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 }
 
 /**
- * Encode an image
- * https://docs.opencv.org/3.4/d4/da8/group__imgcodecs.html#ga26a67788faa58ade337f8d28ba0eb19e
+ * Memory maps an index previously written by phash_index_save.
 */
 static ERL_NIF_TERM
-erl_cv_imencode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+erl_cv_phash_index_load(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
@@ -743,20 +5746,20 @@ erl_cv_imencode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
     if(argc != 4)
         return enif_make_badarg(env);
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
     if(!enif_get_local_pid(env, argv[2], &pid))
 	    return make_error_tuple(env, "invalid_pid");
-    if(!enif_is_tuple(env, argv[3]))
+    if(!enif_is_list(env, argv[3]))
         return make_error_tuple(env, "invalid_arg");
 
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_imencode;
+    cmd->type = cmd_phash_index_load;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
@@ -764,11 +5767,11 @@ erl_cv_imencode(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 }
 
 /**
- * Constructs a new Mat
- * https://docs.opencv.org/3.4.5/d3/d63/classcv_1_1Mat.html#af1d014cecd1510cdf580bf2ed7e5aafc
+ * Queues a list of commands as one entry. They run back to back on the
+ * connection thread and are answered with a single message.
 */
 static ERL_NIF_TERM
-erl_cv_new_mat(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+erl_cv_submit_batch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
     erl_cv_connection *conn;
     erl_cv_command *cmd = NULL;
@@ -776,70 +5779,201 @@ erl_cv_new_mat(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 
     if(argc != 4)
         return enif_make_badarg(env);
-    if(!enif_get_resource(env, argv[0], erl_cv_type, (void **) &conn))
+    if(!get_connection(env, argv[0], &conn))
 	    return enif_make_badarg(env);
     if(!enif_is_ref(env, argv[1]))
 	    return make_error_tuple(env, "invalid_ref");
     if(!enif_get_local_pid(env, argv[2], &pid))
 	    return make_error_tuple(env, "invalid_pid");
-    if(!enif_is_ref(env, argv[3]))
+    if(!enif_is_list(env, argv[3]))
         return make_error_tuple(env, "invalid_arg");
 
-    cmd = command_create();
+    cmd = command_create(conn->pool);
     if(!cmd)
 	    return make_error_tuple(env, "command_create_failed");
 
-    cmd->type = cmd_new_mat;
+    cmd->type = cmd_submit_batch;
     cmd->ref = enif_make_copy(cmd->env, argv[1]);
     cmd->pid = pid;
     cmd->arg = enif_make_copy(cmd->env, argv[3]);
     return push_command(env, conn, cmd);
 }
 
+/**
+ * Turns span tracing on or off for all connections.
+*/
+static ERL_NIF_TERM
+erl_cv_trace(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+    if(argc != 1)
+        return enif_make_badarg(env);
 
-static void
-destruct_cv_connection(ErlNifEnv*, void *arg)
+    trace_enable(enif_is_identical(argv[0], atom_true));
+    return atom_ok;
+}
+
+/**
+ * Writes the recorded spans of every thread to a Chrome trace JSON file.
+ * Runs on a dirty I/O scheduler.
+*/
+static ERL_NIF_TERM
+erl_cv_dump_trace(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-    enif_fprintf(stderr, "destruct cv_conn\r\n");
-    erl_cv_connection *conn = (erl_cv_connection *) arg;
-    erl_cv_command *close_cmd = command_create();
+    char filename[MAX_PATHNAME];
+
+    if(argc != 1)
+        return enif_make_badarg(env);
 
+    if(enif_get_string(env, argv[0], filename, MAX_PATHNAME, ERL_NIF_LATIN1) <= 0)
+        return make_error_tuple(env, "invalid_filename");
 
-    /* Send the stop command
-    */
-    close_cmd->type = cmd_stop;
-    queue_push(conn->commands, close_cmd);
+    if(!trace_dump(filename))
+        return make_error_tuple(env, "write_failed");
 
-    /* Wait for the thread to finish
-     */
-    enif_thread_join(conn->tid, NULL);
+    return atom_ok;
+}
 
-    enif_thread_opts_destroy(conn->opts);
+static void
+destruct_cv_connection(ErlNifEnv*, void *arg)
+{
+    erl_cv_connection_handle *handle = (erl_cv_connection_handle *) arg;
 
-    while(queue_has_item(conn->commands)) {
-        command_destroy(queue_pop(conn->commands));
-    }
-    queue_destroy(conn->commands);
+    /* Only signals the threads, the reaper waits for them */
+    connection_close(handle->conn);
+    connection_release(handle->conn);
 }
 
 static void
 destruct_cv_mat(ErlNifEnv*, void *arg)
 {
-    enif_fprintf(stderr, "destruct cv_mat\r\n");
     erl_cv_mat *emat = (erl_cv_mat *)arg;
     if(emat->mat) {
         delete emat->mat;
     }
 }
 
+static void
+destruct_cv_net(ErlNifEnv*, void *arg)
+{
+    erl_cv_net *enet = ((erl_cv_net_handle *) arg)->enet;
+
+    /* Requests already queued still run before the thread stops */
+    push_stop(enet->requests);
+    if(!reaper_submit(reap_net, enet))
+        net_free(enet);
+}
+
+static void
+destruct_cv_detector(ErlNifEnv*, void *arg)
+{
+    erl_cv_detector *edet = (erl_cv_detector *)arg;
+    if(edet->cascade) {
+        delete edet->cascade;
+    }
+    if(edet->hog) {
+        delete edet->hog;
+    }
+    if(edet->lock) {
+        enif_mutex_destroy(edet->lock);
+    }
+}
+
+static void
+destruct_cv_features(ErlNifEnv*, void *arg)
+{
+    erl_cv_features *efeat = (erl_cv_features *)arg;
+    if(efeat->keypoints) {
+        delete efeat->keypoints;
+    }
+    if(efeat->descriptors) {
+        delete efeat->descriptors;
+    }
+}
+
+static void
+destruct_cv_matcher(ErlNifEnv*, void *arg)
+{
+    erl_cv_matcher *ematcher = (erl_cv_matcher *)arg;
+    if(ematcher->matcher) {
+        delete ematcher->matcher;
+    }
+}
+
+static void
+destruct_cv_jpeg_encoder(ErlNifEnv*, void *arg)
+{
+    erl_cv_jpeg_encoder *eenc = (erl_cv_jpeg_encoder *)arg;
+    if(eenc->encoder) {
+        rate_encoder_destroy(eenc->encoder);
+    }
+    if(eenc->lock) {
+        enif_mutex_destroy(eenc->lock);
+    }
+}
+
+static void
+destruct_cv_decode_window(ErlNifEnv*, void *arg)
+{
+    erl_cv_decode_window *window = (erl_cv_decode_window *)arg;
+    if(window->cond) {
+        enif_cond_destroy(window->cond);
+    }
+    if(window->lock) {
+        enif_mutex_destroy(window->lock);
+    }
+}
+
+static void
+down_cv_decode_window(ErlNifEnv*, void *arg, ErlNifPid*, ErlNifMonitor*)
+{
+    window_cancel((erl_cv_decode_window *)arg);
+}
+
+static void
+destruct_cv_encode_stream(ErlNifEnv*, void *arg)
+{
+    erl_cv_encode_stream *stream = (erl_cv_encode_stream *)arg;
+    if(stream->encoder) {
+        stream_encoder_destroy(stream->encoder);
+    }
+    if(stream->ref_env) {
+        enif_free_env(stream->ref_env);
+    }
+    if(stream->msg_env) {
+        enif_free_env(stream->msg_env);
+    }
+    if(stream->lock) {
+        enif_mutex_destroy(stream->lock);
+    }
+}
+
+static void
+destruct_cv_phash_index(ErlNifEnv*, void *arg)
+{
+    erl_cv_phash_index *eindex = (erl_cv_phash_index *)arg;
+    if(eindex->index) {
+        phash_index_destroy(eindex->index);
+    }
+}
+
 static void
 destruct_cv_video_capture(ErlNifEnv*, void *arg)
 {
-    enif_fprintf(stderr, "destruct cv_cap\r\n");
     erl_cv_video_capture *ecap = (erl_cv_video_capture *)arg;
-    if(ecap->cap) {
-        delete ecap->cap;
+    erl_cv_video_capture *copy;
+
+    if(!ecap->cap && !ecap->ring && !ecap->acc)
+        return;
+
+    /* Releasing a device can block, leave it to the reaper */
+    copy = (erl_cv_video_capture *) enif_alloc(sizeof(erl_cv_video_capture));
+    if(copy) {
+        *copy = *ecap;
+        if(reaper_submit(reap_capture, copy))
+            return;
+        enif_free(copy);
     }
+    capture_release(ecap);
 }
 
 /*
@@ -868,7 +6002,65 @@ on_load(ErlNifEnv* env, void**, ERL_NIF_TERM)
         return -1;
     erl_cv_mat_type = rt;
 
+    rt = enif_open_resource_type(env, "erl_cv_nif", "erl_cv_net_type",
+                destruct_cv_net, ERL_NIF_RT_CREATE, NULL);
+    if(!rt)
+        return -1;
+    erl_cv_net_type = rt;
+
+    rt = enif_open_resource_type(env, "erl_cv_nif", "erl_cv_detector_type",
+                destruct_cv_detector, ERL_NIF_RT_CREATE, NULL);
+    if(!rt)
+        return -1;
+    erl_cv_detector_type = rt;
+
+    rt = enif_open_resource_type(env, "erl_cv_nif", "erl_cv_features_type",
+                destruct_cv_features, ERL_NIF_RT_CREATE, NULL);
+    if(!rt)
+        return -1;
+    erl_cv_features_type = rt;
+
+    rt = enif_open_resource_type(env, "erl_cv_nif", "erl_cv_matcher_type",
+                destruct_cv_matcher, ERL_NIF_RT_CREATE, NULL);
+    if(!rt)
+        return -1;
+    erl_cv_matcher_type = rt;
+
+    rt = enif_open_resource_type(env, "erl_cv_nif", "erl_cv_phash_index_type",
+                destruct_cv_phash_index, ERL_NIF_RT_CREATE, NULL);
+    if(!rt)
+        return -1;
+    erl_cv_phash_index_type = rt;
+
+    rt = enif_open_resource_type(env, "erl_cv_nif", "erl_cv_jpeg_encoder_type",
+                destruct_cv_jpeg_encoder, ERL_NIF_RT_CREATE, NULL);
+    if(!rt)
+        return -1;
+    erl_cv_jpeg_encoder_type = rt;
+
+    ErlNifResourceTypeInit window_init = {destruct_cv_decode_window, NULL, down_cv_decode_window};
+    rt = enif_open_resource_type_x(env, "erl_cv_decode_window_type", &window_init, ERL_NIF_RT_CREATE, NULL);
+    if(!rt)
+        return -1;
+    erl_cv_decode_window_type = rt;
+
+    rt = enif_open_resource_type(env, "erl_cv_nif", "erl_cv_encode_stream_type",
+                destruct_cv_encode_stream, ERL_NIF_RT_CREATE, NULL);
+    if(!rt)
+        return -1;
+    erl_cv_encode_stream_type = rt;
+
+    make_atoms(env);
     atom_erl_cv = make_atom(env, "erl_cv_nif");
+    atom_frame = make_atom(env, "frame");
+    atom_ref = make_atom(env, "ref");
+    atom_chunk = make_atom(env, "chunk");
+    atom_pending = make_atom(env, "$pending");
+    for(size_t i = 0; i < sizeof(batch_commands) / sizeof(batch_commands[0]); i++)
+        batch_commands[i].atom = make_atom(env, batch_commands[i].name);
+
+    if(!reaper_start())
+        return -1;
     return 0;
 }
 
@@ -879,12 +6071,22 @@ static int on_reload(ErlNifEnv*, void**, ERL_NIF_TERM)
 
 static int on_upgrade(ErlNifEnv*, void**, void**, ERL_NIF_TERM)
 {
+    /* The old instance's on_unload must not stop the reaper under us */
+    if(!reaper_start())
+        return -1;
     return 0;
 }
 
+static void on_unload(ErlNifEnv*, void*)
+{
+    reaper_stop();
+}
+
 static ErlNifFunc nif_funcs[] = {
     // VideoCapture
     {"start", 0, erl_cv_start, 0},
+    {"start", 1, erl_cv_start, 0},
+    {"close", 1, erl_cv_close, 0},
     {"video_capture_open", 4, erl_video_capture_open, 0},
     {"video_capture_close", 4, erl_video_capture_close, 0},
     {"video_capture_is_opened", 4, erl_video_capture_is_opened, 0},
@@ -893,9 +6095,65 @@ static ErlNifFunc nif_funcs[] = {
     {"video_capture_read", 4, erl_video_capture_read, 0},
     {"video_capture_get", 4, erl_video_capture_get, 0},
     {"video_capture_set", 4, erl_video_capture_set, 0},
-    
+    {"video_capture_ring", 4, erl_video_capture_ring, 0},
+    {"video_capture_accumulate", 4, erl_video_capture_accumulate, 0},
+    {"video_capture_feed", 4, erl_video_capture_feed, 0},
+    {"video_capture_stacked", 4, erl_video_capture_stacked, 0},
+    {"video_capture_sample", 4, erl_video_capture_sample, 0},
+
+    // VideoFile
+    {"video_file_parallel_map", 4, erl_video_file_parallel_map, 0},
+    {"video_file_release", 2, erl_cv_video_file_release, 0},
+    {"video_file_cancel", 1, erl_cv_video_file_cancel, 0},
+
+    // Batches
+    {"submit_batch", 4, erl_cv_submit_batch, 0},
+
+    // Tracing
+    {"trace", 1, erl_cv_trace, 0},
+    {"dump_trace", 1, erl_cv_dump_trace, ERL_NIF_DIRTY_JOB_IO_BOUND},
+
     // Utility
     {"imencode", 4, erl_cv_imencode, 0},
-    {"new_mat", 4, erl_cv_new_mat, 0}
+    {"imencode_stream", 4, erl_cv_imencode_stream, 0},
+    {"imencode_stream_ack", 2, erl_cv_imencode_stream_ack, 0},
+    {"imwrite_async", 4, erl_cv_imwrite_async, 0},
+    {"new_mat", 4, erl_cv_new_mat, 0},
+    {"encode_cache_config", 4, erl_cv_encode_cache_config, 0},
+    {"encode_cache_stats", 4, erl_cv_encode_cache_stats, 0},
+    {"jpeg_encoder_new", 4, erl_cv_jpeg_encoder_new, 0},
+    {"jpeg_encoder_encode", 4, erl_cv_jpeg_encoder_encode, 0},
+    {"jpeg_encoder_stats", 4, erl_cv_jpeg_encoder_stats, 0},
+
+    // Mat
+    {"mat_roi", 4, erl_cv_mat_roi, 0},
+    {"mat_to_binary", 4, erl_cv_mat_to_binary, 0},
+    {"mat_serialize", 4, erl_cv_mat_serialize, 0},
+    {"mat_deserialize", 4, erl_cv_mat_deserialize, 0},
+
+    // Statistics
+    {"stats", 4, erl_cv_stats, 0},
+
+    // Object detection
+    {"detector_load", 4, erl_cv_detector_load, 0},
+    {"detect", 4, erl_cv_detect, 0},
+
+    // Deep learning
+    {"dnn_read_net", 4, erl_cv_dnn_read_net, 0},
+    {"dnn_infer", 4, erl_cv_dnn_infer, 0},
+
+    // Features
+    {"orb_extract", 4, erl_cv_orb_extract, 0},
+    {"features_descriptors", 4, erl_cv_features_descriptors, 0},
+    {"matcher_new", 4, erl_cv_matcher_new, 0},
+    {"matcher_match", 4, erl_cv_matcher_match, 0},
+
+    // Perceptual hashing
+    {"phash", 4, erl_cv_phash, 0},
+    {"phash_index_new", 4, erl_cv_phash_index_new, 0},
+    {"phash_index_insert", 4, erl_cv_phash_index_insert, 0},
+    {"phash_index_query", 4, erl_cv_phash_index_query, 0},
+    {"phash_index_save", 4, erl_cv_phash_index_save, 0},
+    {"phash_index_load", 4, erl_cv_phash_index_load, 0}
 };
-ERL_NIF_INIT(erl_cv_nif, nif_funcs, on_load, on_reload, on_upgrade, NULL);
+ERL_NIF_INIT(erl_cv_nif, nif_funcs, on_load, on_reload, on_upgrade, on_unload);
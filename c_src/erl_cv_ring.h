@@ -0,0 +1,98 @@
+#ifndef ERL_CV_RING_H
+#define ERL_CV_RING_H
+
+/*
+ * Layout of the shared memory frame ring written by a VideoCapture with a
+ * ring attached. This header is plain C so external readers can include it
+ * as is; see examples/ring_reader.c.
+ *
+ * The ring is a POSIX shared memory object made of a ring header followed by
+ * slot_count slots of slot_stride bytes. Each slot starts with a slot header
+ * and the frame data follows it, row after row without padding.
+ *
+ * Frame n (counting from 1) goes to slot (n - 1) % slot_count. Every slot
+ * is guarded by a seqlock: the writer makes `lock` odd, writes the slot and
+ * makes it even again. A reader copies the slot out and keeps the copy only
+ * if `lock` was even and unchanged across the copy.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define ERL_CV_RING_MAGIC 0x474e495256434c45ULL /* "ELCVRING" */
+#define ERL_CV_RING_VERSION 1
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint64_t slot_size;     /* bytes of frame data a slot can hold */
+    uint64_t slot_stride;   /* slot header plus data, 64 byte aligned */
+    uint64_t head;          /* sequence number of the last frame, 0 if none */
+    uint64_t dropped;       /* frames that did not fit in a slot */
+    uint8_t reserved[16];
+} erl_cv_ring_header;
+
+typedef struct {
+    uint64_t lock;
+    uint64_t seq;
+    uint64_t timestamp_ns;  /* CLOCK_MONOTONIC at the time of the read */
+    uint64_t size;
+    int32_t rows;
+    int32_t cols;
+    int32_t type;           /* OpenCV type, e.g. CV_8UC3 == 16 */
+    int32_t elem_size;
+    uint8_t reserved[16];
+} erl_cv_ring_slot;
+
+#define ERL_CV_RING_OK 0
+#define ERL_CV_RING_AGAIN 1     /* slot is being written, retry */
+#define ERL_CV_RING_OVERRUN 2   /* frame was overwritten by a newer one */
+#define ERL_CV_RING_TOO_SMALL 3 /* destination buffer too small */
+
+static inline erl_cv_ring_slot *
+erl_cv_ring_slot_at(erl_cv_ring_header *ring, uint64_t seq)
+{
+    return (erl_cv_ring_slot *) ((uint8_t *) ring + sizeof(erl_cv_ring_header) +
+                                 ((seq - 1) % ring->slot_count) * ring->slot_stride);
+}
+
+static inline uint64_t
+erl_cv_ring_head(erl_cv_ring_header *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Copies frame `seq` into `info` and `data`. Returns ERL_CV_RING_OK when the
+ * copy is consistent.
+ */
+static inline int
+erl_cv_ring_read(erl_cv_ring_header *ring, uint64_t seq, erl_cv_ring_slot *info,
+                 void *data, size_t capacity)
+{
+    erl_cv_ring_slot *slot = erl_cv_ring_slot_at(ring, seq);
+    uint64_t before, after;
+
+    before = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+    if(before & 1)
+        return ERL_CV_RING_AGAIN;
+
+    memcpy(info, slot, sizeof(*info));
+    if(info->seq == seq && info->size <= capacity)
+        memcpy(data, slot + 1, info->size);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&slot->lock, __ATOMIC_RELAXED);
+
+    if(before != after)
+        return ERL_CV_RING_AGAIN;
+    if(info->seq != seq)
+        return ERL_CV_RING_OVERRUN;
+    if(info->size > capacity)
+        return ERL_CV_RING_TOO_SMALL;
+    return ERL_CV_RING_OK;
+}
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "erl_nif.h"
+#include "erl_cv_trace.hpp"
+
+/* Spans kept per thread, older ones are overwritten */
+#define TRACE_RING_SIZE 8192
+#define MAX_TRACE_THREADS 256
+
+typedef struct {
+    const char *name;
+    const char *cat;
+    uint64_t start;
+    uint64_t duration;
+    int tid;
+} trace_event;
+
+typedef struct {
+    int in_use;
+    int tid;
+    const char *thread_name;
+    uint64_t head;
+    trace_event events[TRACE_RING_SIZE];
+} trace_ring;
+
+volatile int trace_on = 0;
+
+static trace_ring *rings[MAX_TRACE_THREADS];
+static int ring_count = 0;
+
+/* Gives the ring back for reuse when its thread exits */
+struct trace_thread {
+    trace_ring *ring;
+    trace_thread() : ring(NULL) {}
+    ~trace_thread() { if(ring) __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE); }
+};
+
+static thread_local trace_thread current;
+static thread_local const char *current_name = NULL;
+
+static trace_ring *
+thread_ring()
+{
+    trace_ring *ring;
+    int count, expected;
+
+    if(current.ring)
+        return current.ring;
+
+    /* Reuse the ring of a thread that has exited, or add one */
+    count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < count; i++) {
+        expected = 0;
+        if(rings[i] && __atomic_compare_exchange_n(&rings[i]->in_use, &expected, 1, false,
+                                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            ring = rings[i];
+            goto found;
+        }
+    }
+
+    ring = (trace_ring *) enif_alloc(sizeof(trace_ring));
+    if(!ring)
+        return NULL;
+    memset(ring, 0, sizeof(trace_ring));
+    ring->in_use = 1;
+
+    count = __atomic_fetch_add(&ring_count, 1, __ATOMIC_ACQ_REL);
+    if(count >= MAX_TRACE_THREADS) {
+        __atomic_fetch_sub(&ring_count, 1, __ATOMIC_ACQ_REL);
+        enif_free(ring);
+        return NULL;
+    }
+    __atomic_store_n(&rings[count], ring, __ATOMIC_RELEASE);
+
+found:
+    ring->tid = (int) syscall(SYS_gettid);
+    ring->thread_name = current_name;
+    current.ring = ring;
+    return ring;
+}
+
+void
+trace_enable(int on)
+{
+    __atomic_store_n(&trace_on, on, __ATOMIC_RELAXED);
+}
+
+uint64_t
+trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+trace_thread_name(const char *name)
+{
+    current_name = name;
+    if(current.ring)
+        current.ring->thread_name = name;
+}
+
+void
+trace_span(const char *name, const char *cat, uint64_t start, uint64_t end)
+{
+    trace_ring *ring = thread_ring();
+    trace_event *event;
+    uint64_t head;
+
+    if(!ring)
+        return;
+
+    /* Only this thread writes the ring, readers check head before and after */
+    head = ring->head;
+    event = &ring->events[head % TRACE_RING_SIZE];
+    event->name = name;
+    event->cat = cat;
+    event->start = start;
+    event->duration = end - start;
+    event->tid = ring->tid;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+int
+trace_dump(const char *path)
+{
+    FILE *out;
+    int pid = (int) getpid();
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    const char *sep = "";
+
+    out = fopen(path, "w");
+    if(!out)
+        return 0;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    for(int i = 0; i < count; i++) {
+        trace_ring *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        uint64_t head, first, valid;
+
+        if(!ring)
+            continue;
+
+        if(ring->thread_name) {
+            fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}", sep, pid, ring->tid, ring->thread_name);
+            sep = ",";
+        }
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+        for(uint64_t n = first; n < head; n++) {
+            trace_event event = ring->events[n % TRACE_RING_SIZE];
+
+            /* Skip events the owner overwrote, or may be overwriting, meanwhile */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            valid = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+            if(valid >= TRACE_RING_SIZE && n <= valid - TRACE_RING_SIZE)
+                continue;
+
+            fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}", sep, event.name, event.cat,
+                    event.start / 1000.0, event.duration / 1000.0, pid, event.tid);
+            sep = ",";
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+}
@@ -0,0 +1,42 @@
+#ifndef ERL_CV_TRACE_H
+#define ERL_CV_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Opt-in span tracing. Every thread records into its own ring of recent
+ * spans without locking; trace_dump writes all rings as Chrome trace JSON
+ * that chrome://tracing and Perfetto can open.
+ *
+ * Names and categories must be string literals, only the pointer is kept.
+ */
+
+extern volatile int trace_on;
+
+static inline int
+trace_enabled()
+{
+    return __atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+}
+
+void trace_enable(int on);
+uint64_t trace_now();
+void trace_thread_name(const char *name);
+void trace_span(const char *name, const char *cat, uint64_t start, uint64_t end);
+int trace_dump(const char *path);
+
+/*
+ * Records a span for the lifetime of the scope
+ */
+class trace_scope {
+public:
+    trace_scope(const char *name, const char *cat = "opencv")
+        : name_(name), cat_(cat), start_(trace_enabled() ? trace_now() : 0) {}
+    ~trace_scope() { if(start_) trace_span(name_, cat_, start_, trace_now()); }
+private:
+    const char *name_;
+    const char *cat_;
+    uint64_t start_;
+};
+
+#endif
@@ -1,6 +1,21 @@
 #include "erl_nif.h"
 #include "erl_cv_util.hpp"
 
+ERL_NIF_TERM atom_ok;
+ERL_NIF_TERM atom_error;
+ERL_NIF_TERM atom_true;
+ERL_NIF_TERM atom_false;
+ERL_NIF_TERM atom_nil;
+
+void make_atoms(ErlNifEnv *env)
+{
+    atom_ok = make_atom(env, "ok");
+    atom_error = make_atom(env, "error");
+    atom_true = make_atom(env, "true");
+    atom_false = make_atom(env, "false");
+    atom_nil = make_atom(env, "nil");
+}
+
 ERL_NIF_TERM make_atom(ErlNifEnv *env, const char *atom_name)
 {
     ERL_NIF_TERM atom;
@@ -13,12 +28,12 @@ ERL_NIF_TERM make_atom(ErlNifEnv *env, const char *atom_name)
 
 ERL_NIF_TERM make_ok_tuple(ErlNifEnv *env, ERL_NIF_TERM value)
 {
-    return enif_make_tuple2(env, make_atom(env, "ok"), value);
+    return enif_make_tuple2(env, atom_ok, value);
 }
 
 ERL_NIF_TERM make_error_tuple(ErlNifEnv *env, const char *reason)
 {
-    return enif_make_tuple2(env, make_atom(env, "error"), make_atom(env, reason));
+    return enif_make_tuple2(env, atom_error, make_atom(env, reason));
 }
 
 ERL_NIF_TERM make_binary(ErlNifEnv *env, const void *bytes, unsigned int size)
@@ -28,7 +43,7 @@ ERL_NIF_TERM make_binary(ErlNifEnv *env, const void *bytes, unsigned int size)
 
     if(!enif_alloc_binary(size, &blob)) {
 	    /* TODO: fix this */
-	    return make_atom(env, "error");
+	    return atom_error;
     }
 
     memcpy(blob.data, bytes, size);
@@ -5,6 +5,15 @@
 #include <stdio.h>
 #include <string.h>
 
+/* Atoms used on every reply, created once in make_atoms */
+extern ERL_NIF_TERM atom_ok;
+extern ERL_NIF_TERM atom_error;
+extern ERL_NIF_TERM atom_true;
+extern ERL_NIF_TERM atom_false;
+extern ERL_NIF_TERM atom_nil;
+
+void make_atoms(ErlNifEnv*);
+
 ERL_NIF_TERM make_atom(ErlNifEnv*, const char*);
 ERL_NIF_TERM make_ok_tuple(ErlNifEnv*, ERL_NIF_TERM);
 ERL_NIF_TERM make_error_tuple(ErlNifEnv*, const char*);
@@ -0,0 +1,144 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "erl_nif.h"
+#include "erl_cv_ring.h"
+#include "frame_ring.hpp"
+
+#define RING_NAME_MAX 256
+
+struct frame_ring_t {
+    char name[RING_NAME_MAX];
+    erl_cv_ring_header *header;
+    size_t length;
+};
+
+static uint64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+frame_ring *
+frame_ring_create(const char *name, unsigned int slot_count, size_t slot_size)
+{
+    frame_ring *ring;
+    size_t stride, length;
+    int fd;
+    void *addr;
+
+    if(slot_count == 0 || slot_count > FRAME_RING_MAX_SLOTS ||
+       slot_size == 0 || slot_size > FRAME_RING_MAX_SLOT_SIZE || strlen(name) >= RING_NAME_MAX)
+        return NULL;
+
+    /* Bounded above, but check anyway, a wrapped length would let
+     * publish write past the mapping
+     */
+    if(__builtin_add_overflow(sizeof(erl_cv_ring_slot) + 63, slot_size, &stride))
+        return NULL;
+    stride &= ~((size_t) 63);
+    if(__builtin_mul_overflow(stride, (size_t) slot_count, &length) ||
+       __builtin_add_overflow(length, sizeof(erl_cv_ring_header), &length) ||
+       length > FRAME_RING_MAX_LENGTH)
+        return NULL;
+
+    ring = (frame_ring *) enif_alloc(sizeof(frame_ring));
+    if(!ring)
+        return NULL;
+    strcpy(ring->name, name);
+    ring->length = length;
+
+    /* A reader may still map an old ring of that name. Truncating it would
+     * SIGBUS the reader, so unlink it and create a new object instead.
+     */
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) {
+        enif_free(ring);
+        return NULL;
+    }
+
+    if(ftruncate(fd, ring->length) != 0) {
+        close(fd);
+        shm_unlink(name);
+        enif_free(ring);
+        return NULL;
+    }
+
+    addr = mmap(NULL, ring->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        shm_unlink(name);
+        enif_free(ring);
+        return NULL;
+    }
+
+    /* ftruncate zero fills, so all slots start unlocked and empty */
+    ring->header = (erl_cv_ring_header *) addr;
+    ring->header->version = ERL_CV_RING_VERSION;
+    ring->header->slot_count = slot_count;
+    ring->header->slot_size = slot_size;
+    ring->header->slot_stride = stride;
+    __atomic_store_n(&ring->header->magic, ERL_CV_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return ring;
+}
+
+void
+frame_ring_destroy(frame_ring *ring)
+{
+    munmap(ring->header, ring->length);
+    shm_unlink(ring->name);
+    enif_free(ring);
+}
+
+int
+frame_ring_publish(frame_ring *ring, const cv::Mat &frame)
+{
+    erl_cv_ring_header *header = ring->header;
+    erl_cv_ring_slot *slot;
+    uint64_t seq, lock;
+    size_t row_bytes = frame.cols * frame.elemSize();
+    size_t size = row_bytes * frame.rows;
+    uint8_t *data;
+
+    if(frame.dims > 2 || size > header->slot_size) {
+        header->dropped++;
+        return 0;
+    }
+
+    /* Only the capture's owner writes, so head needs no read-modify-write */
+    seq = header->head + 1;
+    slot = erl_cv_ring_slot_at(header, seq);
+
+    lock = slot->lock;
+    __atomic_store_n(&slot->lock, lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->seq = seq;
+    slot->timestamp_ns = monotonic_ns();
+    slot->size = size;
+    slot->rows = frame.rows;
+    slot->cols = frame.cols;
+    slot->type = frame.type();
+    slot->elem_size = frame.elemSize();
+
+    data = (uint8_t *) (slot + 1);
+    if(frame.isContinuous()) {
+        memcpy(data, frame.data, size);
+    } else {
+        for(int row = 0; row < frame.rows; row++)
+            memcpy(data + row * row_bytes, frame.ptr(row), row_bytes);
+    }
+
+    __atomic_store_n(&slot->lock, lock + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->head, seq, __ATOMIC_RELEASE);
+
+    return 1;
+}
@@ -0,0 +1,24 @@
+#ifndef ERL_CV_FRAME_RING_H
+#define ERL_CV_FRAME_RING_H
+
+#include <stddef.h>
+
+#include "opencv2/opencv.hpp"
+
+/*
+ * Writer side of the shared memory frame ring described in erl_cv_ring.h.
+ */
+
+typedef struct frame_ring_t frame_ring;
+
+/* Limits on what a caller may ask for, the whole ring must also fit 4 GB */
+#define FRAME_RING_MAX_SLOTS 1024
+#define FRAME_RING_MAX_SLOT_SIZE ((size_t) 1 << 30)
+#define FRAME_RING_MAX_LENGTH ((size_t) 1 << 32)
+
+frame_ring *frame_ring_create(const char *name, unsigned int slot_count, size_t slot_size);
+void frame_ring_destroy(frame_ring *ring);
+
+int frame_ring_publish(frame_ring *ring, const cv::Mat &frame);
+
+#endif
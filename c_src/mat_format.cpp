@@ -0,0 +1,228 @@
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef ERL_CV_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "mat_format.hpp"
+
+#define MAT_FORMAT_VERSION 1
+
+/* LZ4 cannot expand a byte of input to more than this many bytes */
+#define LZ4_MAX_RATIO 255
+
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag access_flag;
+#else
+typedef int access_flag;
+#endif
+
+static void
+put_u32(uchar *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t
+get_u32(const uchar *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/*
+ * Lends the pixels of a binary to OpenCV. The binary is held in an env of
+ * its own, freed once the last Mat sharing the pixels is gone.
+ */
+class binary_allocator : public cv::MatAllocator
+{
+public:
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data, size_t *step,
+                           access_flag flags, cv::UMatUsageFlags usage) const
+    {
+        return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usage);
+    }
+
+    bool allocate(cv::UMatData *u, access_flag flags, cv::UMatUsageFlags usage) const
+    {
+        return cv::Mat::getStdAllocator()->allocate(u, flags, usage);
+    }
+
+    void deallocate(cv::UMatData *u) const
+    {
+        if(!u)
+            return;
+        enif_free_env((ErlNifEnv *) u->userdata);
+        delete u;
+    }
+};
+
+static binary_allocator binary_alloc;
+
+static const char *
+wrap_binary(ERL_NIF_TERM binary, int rows, int cols, int type, size_t step, cv::Mat &out)
+{
+    ErlNifEnv *owner;
+    ErlNifBinary bin;
+    cv::UMatData *u;
+    uchar *data;
+
+    owner = enif_alloc_env();
+    if(!owner)
+        return "no_memory";
+
+    /* Refc binaries are shared, not copied, into the owner env */
+    if(!enif_inspect_binary(owner, enif_make_copy(owner, binary), &bin)) {
+        enif_free_env(owner);
+        return "invalid_binary";
+    }
+    data = bin.data + MAT_FORMAT_HEADER_SIZE;
+
+    /* A sub binary can start anywhere, OpenCV wants element aligned rows */
+    if((uintptr_t) data % CV_ELEM_SIZE1(type) || step % CV_ELEM_SIZE1(type)) {
+        cv::Mat(rows, cols, type, data, step).copyTo(out);
+        enif_free_env(owner);
+        return NULL;
+    }
+
+    u = new cv::UMatData(&binary_alloc);
+    u->data = u->origdata = data;
+    u->size = (size_t) rows * step;
+    u->userdata = owner;
+
+    out = cv::Mat(rows, cols, type, data, step);
+    out.u = u;
+    out.addref();
+    return NULL;
+}
+
+const char *
+mat_serialize(const cv::Mat &mat, int flags, ErlNifBinary *out)
+{
+    size_t row_size = mat.cols * mat.elemSize();
+    size_t payload = row_size * mat.rows;
+    uchar *p;
+
+    if(mat.dims > 2)
+        return "unsupported_dims";
+    if(row_size > UINT32_MAX)
+        return "too_large";
+    if(payload == 0)
+        flags &= ~MAT_FORMAT_LZ4;
+
+    if(flags & MAT_FORMAT_LZ4) {
+#ifdef ERL_CV_HAVE_LZ4
+        cv::Mat packed = mat.isContinuous() ? mat : mat.clone();
+        int bound, n;
+
+        if(payload > LZ4_MAX_INPUT_SIZE)
+            return "too_large";
+
+        bound = LZ4_compressBound((int) payload);
+        if(!enif_alloc_binary(MAT_FORMAT_HEADER_SIZE + bound, out))
+            return "no_memory";
+
+        n = LZ4_compress_default((const char *) packed.data, (char *) out->data + MAT_FORMAT_HEADER_SIZE,
+                                 (int) payload, bound);
+        if(n <= 0) {
+            enif_release_binary(out);
+            return "compress_failed";
+        }
+        enif_realloc_binary(out, MAT_FORMAT_HEADER_SIZE + n);
+#else
+        return "lz4_unavailable";
+#endif
+    } else {
+        if(!enif_alloc_binary(MAT_FORMAT_HEADER_SIZE + payload, out))
+            return "no_memory";
+
+        p = out->data + MAT_FORMAT_HEADER_SIZE;
+        if(mat.isContinuous()) {
+            memcpy(p, mat.data, payload);
+        } else {
+            for(int i = 0; i < mat.rows; i++)
+                memcpy(p + i * row_size, mat.ptr(i), row_size);
+        }
+    }
+
+    p = out->data;
+    memcpy(p, "ECVM", 4);
+    p[4] = MAT_FORMAT_VERSION;
+    p[5] = (uchar) flags;
+    p[6] = p[7] = 0;
+    put_u32(p + 8, mat.rows);
+    put_u32(p + 12, mat.cols);
+    put_u32(p + 16, mat.type());
+    put_u32(p + 20, (uint32_t) row_size);
+    return NULL;
+}
+
+const char *
+mat_deserialize(ErlNifEnv *env, ERL_NIF_TERM binary, cv::Mat &out)
+{
+    ErlNifBinary bin;
+    uint32_t rows, cols, type, step;
+    size_t row_size, payload;
+    int flags;
+
+    if(!enif_inspect_binary(env, binary, &bin) || bin.size < MAT_FORMAT_HEADER_SIZE)
+        return "invalid_binary";
+
+    if(memcmp(bin.data, "ECVM", 4) != 0 || bin.data[4] != MAT_FORMAT_VERSION)
+        return "invalid_header";
+
+    flags = bin.data[5];
+    rows = get_u32(bin.data + 8);
+    cols = get_u32(bin.data + 12);
+    type = get_u32(bin.data + 16);
+    step = get_u32(bin.data + 20);
+
+    if(rows > INT_MAX || cols > INT_MAX || type > CV_MAT_TYPE_MASK)
+        return "invalid_header";
+
+    row_size = (size_t) cols * CV_ELEM_SIZE(type);
+    if(step < row_size)
+        return "invalid_header";
+    payload = (size_t) rows * step;
+
+    if(payload == 0) {
+        out = cv::Mat();
+        return NULL;
+    }
+
+    if(flags & MAT_FORMAT_LZ4) {
+#ifdef ERL_CV_HAVE_LZ4
+        size_t packed = bin.size - MAT_FORMAT_HEADER_SIZE;
+
+        /* The header comes from another node, don't allocate more than the
+         * compressed payload can possibly hold
+         */
+        if(step != row_size || payload > LZ4_MAX_INPUT_SIZE || packed > INT_MAX ||
+           payload > packed * LZ4_MAX_RATIO)
+            return "invalid_header";
+
+        try {
+            out.create(rows, cols, type);
+        } catch(const cv::Exception&) {
+            return "no_memory";
+        }
+        if(LZ4_decompress_safe((const char *) bin.data + MAT_FORMAT_HEADER_SIZE, (char *) out.data,
+                               (int) packed, (int) payload) != (int) payload) {
+            out.release();
+            return "corrupt_payload";
+        }
+        return NULL;
+#else
+        return "lz4_unavailable";
+#endif
+    }
+
+    if(bin.size - MAT_FORMAT_HEADER_SIZE != payload)
+        return "invalid_size";
+
+    return wrap_binary(binary, rows, cols, type, step, out);
+}
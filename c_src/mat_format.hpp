@@ -0,0 +1,38 @@
+#ifndef ERL_CV_MAT_FORMAT_H
+#define ERL_CV_MAT_FORMAT_H
+
+#include "erl_nif.h"
+#include "opencv2/opencv.hpp"
+
+/*
+ * Wire format for Mats sent between nodes. A 24 byte little endian header
+ *
+ *   0  magic "ECVM"
+ *   4  version (1)
+ *   5  flags, MAT_FORMAT_LZ4 when the payload is an LZ4 block
+ *   6  reserved (0)
+ *   8  rows
+ *  12  cols
+ *  16  type
+ *  20  step, bytes per payload row
+ *
+ * followed by rows * step bytes of pixels, or their LZ4 compression.
+ */
+
+#define MAT_FORMAT_HEADER_SIZE 24
+#define MAT_FORMAT_LZ4 1
+
+/*
+ * Writes mat into a newly allocated binary. Returns NULL on success, the
+ * reason otherwise.
+ */
+const char *mat_serialize(const cv::Mat &mat, int flags, ErlNifBinary *out);
+
+/*
+ * Reads a serialized Mat. Uncompressed pixels are not copied, the Mat points
+ * into the binary and keeps it alive. Returns NULL on success, the reason
+ * otherwise.
+ */
+const char *mat_deserialize(ErlNifEnv *env, ERL_NIF_TERM binary, cv::Mat &out);
+
+#endif
@@ -0,0 +1,429 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "erl_nif.h"
+#include "phash_index.hpp"
+
+#define CHUNKS 4
+#define CHUNK_BITS 16
+#define BUCKETS (1 << CHUNK_BITS)
+
+/* Beyond this many bit flips per chunk probing costs more than a scan */
+#define MAX_PROBE_FLIPS 2
+
+static const char magic[8] = {'E', 'C', 'V', 'P', 'H', 'X', '2', '\0'};
+
+typedef struct {
+    uint64_t hash;
+    uint64_t id;
+} phash_entry;
+
+/* Postings carry a copy of the hash so a bucket is scanned sequentially */
+#pragma pack(push, 4)
+typedef struct {
+    uint64_t hash;
+    uint32_t entry;
+} phash_posting;
+#pragma pack(pop)
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+} phash_file_header;
+
+struct phash_index_t
+{
+    ErlNifRWLock *lock;
+    int dirty;
+
+    /* Read views, either into the vectors below or into a mapped file */
+    size_t count;
+    const phash_entry *entries;
+    const uint32_t *offsets[CHUNKS];
+    const phash_posting *postings[CHUNKS];
+
+    std::vector<phash_entry> owned_entries;
+    std::vector<uint32_t> owned_offsets[CHUNKS];
+    std::vector<phash_posting> owned_postings[CHUNKS];
+
+    void *map;
+    size_t map_len;
+};
+
+static inline unsigned int
+chunk_of(uint64_t hash, int chunk)
+{
+    return (unsigned int) ((hash >> (chunk * CHUNK_BITS)) & (BUCKETS - 1));
+}
+
+static inline int
+popcount64(uint64_t v)
+{
+    return __builtin_popcountll(v);
+}
+
+static void
+point_views(phash_index *index)
+{
+    index->count = index->owned_entries.size();
+    index->entries = index->owned_entries.data();
+    for(int c = 0; c < CHUNKS; c++) {
+        index->offsets[c] = index->owned_offsets[c].data();
+        index->postings[c] = index->owned_postings[c].data();
+    }
+}
+
+/*
+ * Detach from a mapped file before the first modification.
+ */
+static void
+take_ownership(phash_index *index)
+{
+    if(index->map == NULL)
+        return;
+
+    index->owned_entries.assign(index->entries, index->entries + index->count);
+    munmap(index->map, index->map_len);
+    index->map = NULL;
+    index->map_len = 0;
+    point_views(index);
+}
+
+/*
+ * Counting sort of all entries into the bucket tables of every chunk.
+ */
+static void
+rebuild(phash_index *index)
+{
+    size_t n = index->owned_entries.size();
+    const phash_entry *entries = index->owned_entries.data();
+
+    for(int c = 0; c < CHUNKS; c++) {
+        std::vector<uint32_t> &offsets = index->owned_offsets[c];
+        std::vector<phash_posting> &postings = index->owned_postings[c];
+
+        offsets.assign(BUCKETS + 1, 0);
+        postings.resize(n);
+
+        for(size_t i = 0; i < n; i++)
+            offsets[chunk_of(entries[i].hash, c) + 1]++;
+        for(int b = 0; b < BUCKETS; b++)
+            offsets[b + 1] += offsets[b];
+
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for(size_t i = 0; i < n; i++) {
+            phash_posting &posting = postings[fill[chunk_of(entries[i].hash, c)]++];
+            posting.hash = entries[i].hash;
+            posting.entry = (uint32_t) i;
+        }
+    }
+
+    point_views(index);
+    index->dirty = 0;
+}
+
+phash_index *
+phash_index_create()
+{
+    phash_index *index = new phash_index();
+
+    index->lock = enif_rwlock_create((char*) "phash_index_lock");
+    if(index->lock == NULL) {
+        delete index;
+        return NULL;
+    }
+
+    index->dirty = 0;
+    index->map = NULL;
+    index->map_len = 0;
+    rebuild(index);
+    return index;
+}
+
+void
+phash_index_destroy(phash_index *index)
+{
+    if(index->map != NULL)
+        munmap(index->map, index->map_len);
+    enif_rwlock_destroy(index->lock);
+    delete index;
+}
+
+int
+phash_index_insert(phash_index *index, const uint64_t *hashes, const uint64_t *ids, size_t count)
+{
+    enif_rwlock_rwlock(index->lock);
+
+    if(index->owned_entries.size() + count > UINT32_MAX) {
+        enif_rwlock_rwunlock(index->lock);
+        return 0;
+    }
+
+    take_ownership(index);
+    index->owned_entries.reserve(index->owned_entries.size() + count);
+    for(size_t i = 0; i < count; i++) {
+        phash_entry entry = {hashes[i], ids[i]};
+        index->owned_entries.push_back(entry);
+    }
+
+    /* Tables are rebuilt lazily so a batch of inserts costs one rebuild */
+    index->dirty = 1;
+    enif_rwlock_rwunlock(index->lock);
+    return 1;
+}
+
+size_t
+phash_index_size(phash_index *index)
+{
+    size_t size;
+
+    enif_rwlock_rlock(index->lock);
+    size = index->dirty ? index->owned_entries.size() : index->count;
+    enif_rwlock_runlock(index->lock);
+    return size;
+}
+
+static void
+lock_clean(phash_index *index)
+{
+    enif_rwlock_rlock(index->lock);
+    while(index->dirty) {
+        enif_rwlock_runlock(index->lock);
+
+        enif_rwlock_rwlock(index->lock);
+        if(index->dirty)
+            rebuild(index);
+        enif_rwlock_rwunlock(index->lock);
+
+        enif_rwlock_rlock(index->lock);
+    }
+}
+
+static bool
+match_less(const phash_match &a, const phash_match &b)
+{
+    return a.distance < b.distance || (a.distance == b.distance && a.id < b.id);
+}
+
+/*
+ * Visit every bucket within `flips` bits of `key`, starting at bit `from`.
+ */
+static void
+probe(const phash_index *index, int chunk, unsigned int key, int from, int flips,
+      uint64_t hash, int radius, int chunk_radius, std::vector<phash_match> &matches)
+{
+    const uint32_t *offsets = index->offsets[chunk];
+    const phash_posting *postings = index->postings[chunk];
+
+    for(uint32_t p = offsets[key]; p < offsets[key + 1]; p++) {
+        uint64_t candidate = postings[p].hash;
+        int distance = popcount64(candidate ^ hash);
+        int seen = 0;
+
+        if(distance > radius)
+            continue;
+
+        /* Report each entry only from the first chunk that can find it */
+        for(int c = 0; c < chunk && !seen; c++)
+            seen = popcount64((uint64_t) (chunk_of(candidate, c) ^ chunk_of(hash, c))) <= chunk_radius;
+
+        if(!seen) {
+            phash_match match = {index->entries[postings[p].entry].id, distance};
+            matches.push_back(match);
+        }
+    }
+
+    if(flips == 0)
+        return;
+
+    for(int bit = from; bit < CHUNK_BITS; bit++)
+        probe(index, chunk, key ^ (1u << bit), bit + 1, flips - 1, hash, radius, chunk_radius, matches);
+}
+
+int
+phash_index_query(phash_index *index, uint64_t hash, int radius, std::vector<phash_match> &matches)
+{
+    int chunk_radius = radius / CHUNKS;
+
+    if(radius < 0)
+        return 0;
+
+    lock_clean(index);
+
+    if(chunk_radius > MAX_PROBE_FLIPS) {
+        for(size_t i = 0; i < index->count; i++) {
+            int distance = popcount64(index->entries[i].hash ^ hash);
+            if(distance <= radius) {
+                phash_match match = {index->entries[i].id, distance};
+                matches.push_back(match);
+            }
+        }
+    } else {
+        for(int c = 0; c < CHUNKS; c++)
+            probe(index, c, chunk_of(hash, c), 0, chunk_radius, hash, radius, chunk_radius, matches);
+    }
+
+    enif_rwlock_runlock(index->lock);
+
+    std::sort(matches.begin(), matches.end(), match_less);
+    return 1;
+}
+
+static int
+write_all(FILE *file, const void *data, size_t size)
+{
+    return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+int
+phash_index_save(phash_index *index, const char *path)
+{
+    phash_file_header header;
+    FILE *file;
+    int ok;
+    size_t tmp_len = strlen(path) + 5;
+    std::vector<char> tmp(tmp_len);
+
+    snprintf(tmp.data(), tmp_len, "%s.tmp", path);
+    file = fopen(tmp.data(), "wb");
+    if(file == NULL)
+        return 0;
+
+    lock_clean(index);
+
+    memcpy(header.magic, magic, sizeof(magic));
+    header.count = index->count;
+
+    ok = write_all(file, &header, sizeof(header)) &&
+         write_all(file, index->entries, index->count * sizeof(phash_entry));
+    for(int c = 0; ok && c < CHUNKS; c++) {
+        ok = write_all(file, index->offsets[c], (BUCKETS + 1) * sizeof(uint32_t)) &&
+             write_all(file, index->postings[c], index->count * sizeof(phash_posting));
+    }
+
+    enif_rwlock_runlock(index->lock);
+
+    if(fclose(file) != 0)
+        ok = 0;
+
+    /* Replace the old index only once the new one is complete */
+    if(ok && rename(tmp.data(), path) != 0)
+        ok = 0;
+    if(!ok)
+        unlink(tmp.data());
+
+    return ok;
+}
+
+/*
+ * Probes index straight into the tables, so a table that points outside
+ * them would crash the VM. Offsets must rise from 0 to count and every
+ * posting must name an entry.
+ */
+static int
+tables_valid(const phash_index *index)
+{
+    for(int c = 0; c < CHUNKS; c++) {
+        const uint32_t *offsets = index->offsets[c];
+        const phash_posting *postings = index->postings[c];
+
+        if(offsets[0] != 0 || offsets[BUCKETS] != index->count)
+            return 0;
+        for(int b = 0; b < BUCKETS; b++)
+            if(offsets[b + 1] < offsets[b])
+                return 0;
+        for(size_t p = 0; p < index->count; p++)
+            if(postings[p].entry >= index->count)
+                return 0;
+    }
+    return 1;
+}
+
+/*
+ * Maps an index file read-only. Queries run directly on the mapping, so a
+ * large index is usable without being read into memory first. The tables
+ * are checked once on load, which reads the file through.
+ */
+phash_index *
+phash_index_load(const char *path, const char **error)
+{
+    const size_t fixed = sizeof(phash_file_header) + CHUNKS * (BUCKETS + 1) * sizeof(uint32_t);
+    const size_t per_entry = sizeof(phash_entry) + CHUNKS * sizeof(phash_posting);
+    struct stat st;
+    const phash_file_header *header;
+    const char *cursor;
+    phash_index *index;
+    size_t size;
+    void *map;
+    int fd;
+
+    *error = "read_failed";
+    fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    size = (size_t) st.st_size;
+
+    /* Derive the count from the size rather than multiply the header's,
+     * a crafted count could wrap the product
+     */
+    if(size < fixed || (size - fixed) % per_entry != 0) {
+        close(fd);
+        *error = "corrupt";
+        return NULL;
+    }
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return NULL;
+
+    header = (const phash_file_header *) map;
+    if(memcmp(header->magic, magic, sizeof(magic)) != 0 ||
+       header->count != (size - fixed) / per_entry || header->count > UINT32_MAX) {
+        munmap(map, size);
+        *error = "corrupt";
+        return NULL;
+    }
+
+    index = phash_index_create();
+    if(index == NULL) {
+        munmap(map, size);
+        *error = "no_memory";
+        return NULL;
+    }
+
+    index->map = map;
+    index->map_len = size;
+    index->count = header->count;
+
+    cursor = (const char *) map + sizeof(phash_file_header);
+    index->entries = (const phash_entry *) cursor;
+    cursor += header->count * sizeof(phash_entry);
+    for(int c = 0; c < CHUNKS; c++) {
+        index->offsets[c] = (const uint32_t *) cursor;
+        cursor += (BUCKETS + 1) * sizeof(uint32_t);
+        index->postings[c] = (const phash_posting *) cursor;
+        cursor += header->count * sizeof(phash_posting);
+    }
+
+    if(!tables_valid(index)) {
+        phash_index_destroy(index);
+        *error = "corrupt";
+        return NULL;
+    }
+
+    madvise(map, size, MADV_RANDOM);
+    return index;
+}
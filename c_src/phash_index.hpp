@@ -0,0 +1,33 @@
+#ifndef ERL_CV_PHASH_INDEX_H
+#define ERL_CV_PHASH_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+ * Multi-index hashing over 64 bit perceptual hashes. The hash is split in
+ * four 16 bit chunks, each with its own bucket table. Two hashes within
+ * Hamming distance r must agree within r/4 bits on at least one chunk, so a
+ * query only probes a handful of buckets.
+ */
+
+typedef struct phash_index_t phash_index;
+
+typedef struct {
+    uint64_t id;
+    int distance;
+} phash_match;
+
+phash_index *phash_index_create();
+void phash_index_destroy(phash_index *index);
+
+int phash_index_insert(phash_index *index, const uint64_t *hashes, const uint64_t *ids, size_t count);
+size_t phash_index_size(phash_index *index);
+
+int phash_index_query(phash_index *index, uint64_t hash, int radius, std::vector<phash_match> &matches);
+
+int phash_index_save(phash_index *index, const char *path);
+phash_index *phash_index_load(const char *path, const char **error);
+
+#endif
@@ -4,7 +4,10 @@
 /* Adapted by: Maas-Maarten Zeeman <mmzeeman@xs4all.nl */
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "queue.hpp"
 
@@ -16,71 +19,92 @@ struct qitem_t
 
 typedef struct qitem_t qitem;
 
+/* Popped entries are kept for reuse, up to this many per queue */
+#define MAX_SPARE_ITEMS 64
+
+/* pthread primitives rather than ErlNif ones, only they can wait with a
+ * timeout. The condition waits on CLOCK_MONOTONIC.
+ */
 struct queue_t
 {
-    ErlNifMutex *lock;
-    ErlNifCond *cond;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
     qitem *head;
     qitem *tail;
     void *message;
     int length;
+    qitem *spare;
+    int spare_length;
+    /* Kept back for queue_push_last, so it needs no allocation */
+    qitem *reserved;
+    int reserved_used;
 };
 
 queue *
 queue_create()
 {
     queue *ret;
+    pthread_condattr_t attr;
 
     ret = (queue *) enif_alloc(sizeof(struct queue_t));
-    if(ret == NULL) goto error;
+    if(ret == NULL) return NULL;
 
-    ret->lock = NULL;
-    ret->cond = NULL;
     ret->head = NULL;
     ret->tail = NULL;
     ret->message = NULL;
     ret->length = 0;
+    ret->spare = NULL;
+    ret->spare_length = 0;
+    ret->reserved_used = 0;
 
-    ret->lock = enif_mutex_create((char*)"queue_lock");
-    if(ret->lock == NULL) goto error;
-    
-    ret->cond = enif_cond_create((char*)"queue_cond");
-    if(ret->cond == NULL) goto error;
+    ret->reserved = (qitem *) enif_alloc(sizeof(struct qitem_t));
+    if(ret->reserved == NULL) goto error;
+
+    if(pthread_mutex_init(&ret->lock, NULL) != 0) goto error;
+
+    if(pthread_condattr_init(&attr) != 0) goto error_lock;
+    if(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) != 0 ||
+       pthread_cond_init(&ret->cond, &attr) != 0) {
+        pthread_condattr_destroy(&attr);
+        goto error_lock;
+    }
+    pthread_condattr_destroy(&attr);
 
     return ret;
 
+error_lock:
+    pthread_mutex_destroy(&ret->lock);
 error:
-    if(ret->lock != NULL) 
-        enif_mutex_destroy(ret->lock);
-    if(ret->cond != NULL) 
-        enif_cond_destroy(ret->cond);
-    if(ret != NULL) 
-        enif_free(ret);
+    if(ret->reserved != NULL)
+        enif_free(ret->reserved);
+    enif_free(ret);
     return NULL;
 }
 
 void
 queue_destroy(queue *queue)
 {
-    ErlNifMutex *lock;
-    ErlNifCond *cond;
     int length;
 
-    enif_mutex_lock(queue->lock);
-    lock = queue->lock;
-    cond = queue->cond;
+    pthread_mutex_lock(&queue->lock);
+    while(queue->spare != NULL) {
+        qitem *entry = queue->spare;
+        queue->spare = entry->next;
+        enif_free(entry);
+    }
+
     length = queue->length;
 
-    queue->lock = NULL;
-    queue->cond = NULL;
     queue->head = NULL;
     queue->tail = NULL;
     queue->length = -1;
-    enif_mutex_unlock(lock);
+    pthread_mutex_unlock(&queue->lock);
 
     assert(length == 0 && "Attempting to destroy a non-empty queue.");
-    enif_cond_destroy(cond);
-    enif_mutex_destroy(lock);
+    (void) length;
+    enif_free(queue->reserved);
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
     enif_free(queue);
 }
 
@@ -89,25 +113,56 @@ queue_has_item(queue *queue)
 {
     int ret;
 
-    enif_mutex_lock(queue->lock);
+    pthread_mutex_lock(&queue->lock);
     ret = (queue->head != NULL);
-    enif_mutex_unlock(queue->lock);
+    pthread_mutex_unlock(&queue->lock);
     
     return ret;
 }
 
-int
-queue_push(queue *queue, void *item)
+/* Takes an entry from the spare list, the queue lock must be held.
+ */
+static qitem *
+queue_alloc_item(queue *queue)
 {
-    qitem * entry = (qitem *) enif_alloc(sizeof(struct qitem_t));
-    if(entry == NULL) 
-        return 0;
+    qitem *entry = queue->spare;
+
+    if(entry == NULL)
+        return (qitem *) enif_alloc(sizeof(struct qitem_t));
 
+    queue->spare = entry->next;
+    queue->spare_length -= 1;
+    return entry;
+}
+
+/* Returns an entry to the spare list, the queue lock must be held.
+ */
+static void
+queue_free_item(queue *queue, qitem *entry)
+{
+    if(entry == queue->reserved) {
+        queue->reserved_used = 0;
+        return;
+    }
+
+    if(queue->spare_length >= MAX_SPARE_ITEMS) {
+        enif_free(entry);
+        return;
+    }
+
+    entry->next = queue->spare;
+    queue->spare = entry;
+    queue->spare_length += 1;
+}
+
+/* Appends an entry and wakes a waiter, the queue lock must be held.
+ */
+static void
+queue_link(queue *queue, qitem *entry, void *item)
+{
     entry->data = item;
     entry->next = NULL;
 
-    enif_mutex_lock(queue->lock);
-
     assert(queue->length >= 0 && "Invalid queue size at push");
     
     if(queue->tail != NULL)
@@ -120,8 +175,51 @@ queue_push(queue *queue, void *item)
 
     queue->length += 1;
 
-    enif_cond_signal(queue->cond);
-    enif_mutex_unlock(queue->lock);
+    pthread_cond_signal(&queue->cond);
+}
+
+int
+queue_push(queue *queue, void *item)
+{
+    qitem *entry;
+
+    pthread_mutex_lock(&queue->lock);
+
+    entry = queue_alloc_item(queue);
+    if(entry == NULL) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+
+    queue_link(queue, entry, item);
+    pthread_mutex_unlock(&queue->lock);
+
+    return 1;
+}
+
+/* Like queue_push, but uses the queue's reserved entry when nothing else
+ * can be allocated. Meant for the item that tells the consumer to stop,
+ * which must get through. Fails only if the reserved entry is still queued.
+ */
+int
+queue_push_last(queue *queue, void *item)
+{
+    qitem *entry;
+
+    pthread_mutex_lock(&queue->lock);
+
+    entry = queue_alloc_item(queue);
+    if(entry == NULL && !queue->reserved_used) {
+        entry = queue->reserved;
+        queue->reserved_used = 1;
+    }
+    if(entry == NULL) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+
+    queue_link(queue, entry, item);
+    pthread_mutex_unlock(&queue->lock);
 
     return 1;
 }
@@ -132,12 +230,12 @@ queue_pop(queue *queue)
     qitem *entry;
     void* item;
 
-    enif_mutex_lock(queue->lock);
+    pthread_mutex_lock(&queue->lock);
     
     /* Wait for an item to become available.
      */
     while(queue->head == NULL)
-        enif_cond_wait(queue->cond, queue->lock);
+        pthread_cond_wait(&queue->cond, &queue->lock);
     
     assert(queue->length >= 0 && "Invalid queue size at pop.");
 
@@ -155,10 +253,78 @@ queue_pop(queue *queue)
 
     queue->length -= 1;
 
-    enif_mutex_unlock(queue->lock);
+    item = entry->data;
+    queue_free_item(queue, entry);
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+/* Removes the head entry, or returns NULL on an empty queue. The queue
+ * lock must be held.
+ */
+static void*
+queue_take(queue *queue)
+{
+    qitem *entry;
+    void* item;
+
+    entry = queue->head;
+    if(entry == NULL)
+        return NULL;
+
+    queue->head = entry->next;
+    entry->next = NULL;
+
+    if(queue->head == NULL)
+        queue->tail = NULL;
+
+    queue->length -= 1;
 
     item = entry->data;
-    enif_free(entry);
+    queue_free_item(queue, entry);
+    return item;
+}
+
+/* Like queue_pop, but returns NULL instead of waiting on an empty queue.
+ */
+void*
+queue_try_pop(queue *queue)
+{
+    void* item;
+
+    pthread_mutex_lock(&queue->lock);
+    item = queue_take(queue);
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+/* Like queue_pop, but gives up and returns NULL once timeout_us
+ * microseconds have passed without an item.
+ */
+void*
+queue_pop_timeout(queue *queue, long timeout_us)
+{
+    struct timespec deadline;
+    void* item;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_us / 1000000;
+    deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    while(queue->head == NULL) {
+        if(pthread_cond_timedwait(&queue->cond, &queue->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    item = queue_take(queue);
+    pthread_mutex_unlock(&queue->lock);
 
     return item;
 }
@@ -166,11 +332,11 @@ queue_pop(queue *queue)
 int
 queue_send(queue *queue, void *item)
 {
-    enif_mutex_lock(queue->lock);
+    pthread_mutex_lock(&queue->lock);
     assert(queue->message == NULL && "Attempting to send multiple messages.");
     queue->message = item;
-    enif_cond_signal(queue->cond);
-    enif_mutex_unlock(queue->lock);
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
     return 1;
 }
 
@@ -179,17 +345,17 @@ queue_receive(queue *queue)
 {
     void *item;
 
-    enif_mutex_lock(queue->lock);
+    pthread_mutex_lock(&queue->lock);
     
     /* Wait for an item to become available.
      */
     while(queue->message == NULL)
-        enif_cond_wait(queue->cond, queue->lock);
+        pthread_cond_wait(&queue->cond, &queue->lock);
 
     item = queue->message;
     queue->message = NULL;
     
-    enif_mutex_unlock(queue->lock);
+    pthread_mutex_unlock(&queue->lock);
     
     return item;
 }
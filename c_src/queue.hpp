@@ -16,7 +16,10 @@ void queue_destroy(queue *queue);
 int queue_has_item(queue *queue);
 
 int queue_push(queue *queue, void* item);
+int queue_push_last(queue *queue, void* item);
 void* queue_pop(queue *queue);
+void* queue_try_pop(queue *queue);
+void* queue_pop_timeout(queue *queue, long timeout_us);
 
 int queue_send(queue *queue, void* item);
 void* queue_receive(queue *);
@@ -0,0 +1,204 @@
+#include <math.h>
+
+#include <algorithm>
+
+#include "erl_nif.h"
+#include "erl_cv_trace.hpp"
+#include "rate_encoder.hpp"
+
+/* Quality may drop at once but only rises this much per frame */
+#define MAX_QUALITY_RISE 5
+
+/* Weight of the newest frame in the learned ratio and the average size */
+#define RATIO_WEIGHT 0.3
+#define AVG_WEIGHT 0.1
+
+struct rate_encoder_t {
+    double target;
+    double fps;
+    int min_quality;
+    int max_quality;
+    double min_scale;
+
+    double ratio;       /* learned, 0 until the first frame */
+    double debt;        /* bytes spent over budget, bounded */
+
+    uint64_t frames;
+    uint64_t bytes;
+    size_t last_bytes;
+    double avg_bytes;
+    int quality;
+    double scale;
+    double complexity;
+};
+
+/*
+ * libjpeg scales its quantization tables by this percentage
+ */
+static double
+quant_scale(double quality)
+{
+    quality = std::min(std::max(quality, 1.0), 100.0);
+    return quality < 50 ? 5000 / quality : std::max(200 - 2 * quality, 1.0);
+}
+
+/*
+ * Relative size of a frame at a quality, 1 at quality 50
+ */
+static double
+quality_factor(double quality)
+{
+    return pow(100 / quant_scale(quality), 0.75);
+}
+
+static double
+quality_for_factor(double factor)
+{
+    double scale = 100 / pow(factor, 1 / 0.75);
+    return scale > 100 ? 5000 / scale : (200 - scale) / 2;
+}
+
+/*
+ * Mean Laplacian of an 80x60 grey thumbnail. Flat frames still count 1.
+ */
+static double
+estimate_complexity(const cv::Mat &frame)
+{
+    cv::Mat small, gray, lap, mag;
+
+    cv::resize(frame, small, cv::Size(80, 60), 0, 0, cv::INTER_AREA);
+    if(small.channels() == 3)
+        cv::cvtColor(small, gray, cv::COLOR_BGR2GRAY);
+    else if(small.channels() == 4)
+        cv::cvtColor(small, gray, cv::COLOR_BGRA2GRAY);
+    else
+        gray = small;
+
+    cv::Laplacian(gray, lap, CV_16S);
+    cv::convertScaleAbs(lap, mag);
+    return 1 + cv::mean(mag)[0];
+}
+
+rate_encoder *
+rate_encoder_create(double target, double fps, int min_quality, int max_quality, double min_scale)
+{
+    rate_encoder *enc;
+
+    if(target <= 0 || fps < 0 || min_quality < 1 || max_quality > 100 || min_quality > max_quality ||
+       min_scale <= 0 || min_scale > 1)
+        return NULL;
+
+    enc = (rate_encoder *) enif_alloc(sizeof(rate_encoder));
+    if(!enc)
+        return NULL;
+
+    enc->target = target;
+    enc->fps = fps;
+    enc->min_quality = min_quality;
+    enc->max_quality = max_quality;
+    enc->min_scale = min_scale;
+    enc->ratio = 0;
+    enc->debt = 0;
+    enc->frames = 0;
+    enc->bytes = 0;
+    enc->last_bytes = 0;
+    enc->avg_bytes = 0;
+    enc->quality = (min_quality + max_quality) / 2;
+    enc->scale = 1;
+    enc->complexity = 0;
+    return enc;
+}
+
+void
+rate_encoder_destroy(rate_encoder *enc)
+{
+    enif_free(enc);
+}
+
+int
+rate_encoder_encode(rate_encoder *enc, const cv::Mat &frame, std::vector<uchar> &out)
+{
+    double budget, quality, scale = 1, observed;
+    int q;
+    cv::Mat scaled;
+    const cv::Mat *src = &frame;
+    std::vector<int> params;
+
+    /* The JPEG encoder takes grey, BGR and BGRA only */
+    if(frame.empty() || frame.depth() != CV_8U ||
+       (frame.channels() != 1 && frame.channels() != 3 && frame.channels() != 4))
+        return 0;
+
+    try {
+        enc->complexity = estimate_complexity(frame);
+    } catch(const cv::Exception&) {
+        return 0;
+    }
+
+    /* Bytes spent over budget earlier are paid back a quarter at a time,
+     * bytes saved may be spent the same way.
+     */
+    budget = enc->target - enc->debt / 4;
+
+    if(enc->ratio <= 0) {
+        quality = enc->quality;
+    } else {
+        double base = enc->ratio * frame.total() * enc->complexity;
+
+        quality = quality_for_factor(budget / base);
+        if(quality < enc->min_quality && enc->min_scale < 1) {
+            /* Over budget even at the lowest quality, shrink the frame */
+            scale = sqrt(budget / (base * quality_factor(enc->min_quality)));
+            scale = std::max(floor(scale * 20) / 20, enc->min_scale);
+        }
+
+        quality = std::min(std::max(quality, (double) enc->min_quality), (double) enc->max_quality);
+        if(enc->frames > 0)
+            quality = std::min(quality, (double) enc->quality + MAX_QUALITY_RISE);
+    }
+    q = (int) lround(quality);
+
+    params.push_back(cv::IMWRITE_JPEG_QUALITY);
+    params.push_back(q);
+    out.clear();
+    try {
+        if(scale < 1) {
+            cv::Size size(std::max((int) lround(frame.cols * scale), 1), std::max((int) lround(frame.rows * scale), 1));
+            cv::resize(frame, scaled, size, 0, 0, cv::INTER_AREA);
+            src = &scaled;
+        }
+
+        trace_scope span("cv::imencode");
+        if(!cv::imencode(".jpg", *src, out, params))
+            return 0;
+    } catch(const cv::Exception&) {
+        return 0;
+    }
+
+    /* Learn from the size the encoder actually produced */
+    observed = out.size() / (src->total() * enc->complexity * quality_factor(q));
+    enc->ratio = enc->ratio <= 0 ? observed : (1 - RATIO_WEIGHT) * enc->ratio + RATIO_WEIGHT * observed;
+    enc->debt = std::min(std::max(enc->debt + out.size() - enc->target, -2 * enc->target), 2 * enc->target);
+
+    enc->avg_bytes = enc->frames == 0 ? out.size() : (1 - AVG_WEIGHT) * enc->avg_bytes + AVG_WEIGHT * out.size();
+    enc->frames++;
+    enc->bytes += out.size();
+    enc->last_bytes = out.size();
+    enc->quality = q;
+    enc->scale = scale;
+    return 1;
+}
+
+void
+rate_encoder_get_stats(rate_encoder *enc, rate_encoder_stats *stats)
+{
+    stats->target = enc->target;
+    stats->fps = enc->fps;
+    stats->frames = enc->frames;
+    stats->bytes = enc->bytes;
+    stats->last_bytes = enc->last_bytes;
+    stats->avg_bytes = enc->avg_bytes;
+    stats->quality = enc->quality;
+    stats->scale = enc->scale;
+    stats->complexity = enc->complexity;
+}
@@ -0,0 +1,42 @@
+#ifndef ERL_CV_RATE_ENCODER_H
+#define ERL_CV_RATE_ENCODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+/*
+ * JPEG encoder that picks the quality of every frame so the output stays
+ * within a byte budget per frame. The size of a frame is modelled as
+ *
+ *   bytes = ratio * pixels * complexity * f(quality)
+ *
+ * where complexity comes from a thumbnail of the frame and f follows how
+ * libjpeg scales its quantization tables. ratio is learned from the sizes
+ * the encoder actually produced, so there is never a trial encode. When
+ * even the lowest quality is over budget the frame can be downscaled.
+ */
+
+typedef struct rate_encoder_t rate_encoder;
+
+typedef struct {
+    double target;
+    double fps;
+    uint64_t frames;
+    uint64_t bytes;
+    size_t last_bytes;
+    double avg_bytes;
+    int quality;
+    double scale;
+    double complexity;
+} rate_encoder_stats;
+
+rate_encoder *rate_encoder_create(double target, double fps, int min_quality, int max_quality, double min_scale);
+void rate_encoder_destroy(rate_encoder *enc);
+
+int rate_encoder_encode(rate_encoder *enc, const cv::Mat &frame, std::vector<uchar> &out);
+void rate_encoder_get_stats(rate_encoder *enc, rate_encoder_stats *stats);
+
+#endif
@@ -0,0 +1,411 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+
+/* Not every jpeglib.h declares its functions extern "C" */
+extern "C" {
+#include <jpeglib.h>
+}
+#include <png.h>
+
+#include "stream_encoder.hpp"
+
+/*
+ * libjpeg and libpng report errors by longjmp. Nothing with a destructor
+ * lives in the functions that setjmp, rows are converted into a buffer
+ * owned by the encoder.
+ */
+
+typedef enum {
+    stream_jpeg,
+    stream_png,
+} stream_format;
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} jpeg_error;
+
+struct stream_encoder_t {
+    stream_format format;
+    cv::Mat mat;
+    std::vector<uchar> line;
+    int next_row;
+    int finished;
+
+    size_t chunk_size;
+    ErlNifBinary chunk;
+    int has_chunk;
+    size_t used;
+    size_t bytes;
+    stream_chunk_fn fn;
+    void *ctx;
+
+    struct jpeg_compress_struct cinfo;
+    jpeg_error jerr;
+    struct jpeg_destination_mgr dest;
+    int jpeg_created;
+
+    png_structp png;
+    png_infop info;
+};
+
+static int
+chunk_begin(stream_encoder *enc)
+{
+    if(!enif_alloc_binary(enc->chunk_size, &enc->chunk))
+        return 0;
+    enc->has_chunk = 1;
+    enc->used = 0;
+    return 1;
+}
+
+/*
+ * Hands the first size bytes of the current chunk to the callback
+ */
+static void
+chunk_flush(stream_encoder *enc, size_t size)
+{
+    enc->has_chunk = 0;
+    if(size == 0) {
+        enif_release_binary(&enc->chunk);
+        return;
+    }
+    if(size < enc->chunk.size)
+        enif_realloc_binary(&enc->chunk, size);
+    enc->bytes += size;
+    enc->fn(enc->ctx, &enc->chunk);
+}
+
+/*
+ * JPEG destination writing into chunks
+ */
+static void
+on_jpeg_init_destination(j_compress_ptr cinfo)
+{
+    stream_encoder *enc = (stream_encoder *) cinfo->client_data;
+
+    if(!chunk_begin(enc))
+        longjmp(enc->jerr.jmp, 1);
+    enc->dest.next_output_byte = enc->chunk.data;
+    enc->dest.free_in_buffer = enc->chunk.size;
+}
+
+static boolean
+on_jpeg_empty_output_buffer(j_compress_ptr cinfo)
+{
+    stream_encoder *enc = (stream_encoder *) cinfo->client_data;
+
+    /* The whole buffer is due, whatever free_in_buffer says */
+    chunk_flush(enc, enc->chunk_size);
+    on_jpeg_init_destination(cinfo);
+    return TRUE;
+}
+
+static void
+on_jpeg_term_destination(j_compress_ptr cinfo)
+{
+    stream_encoder *enc = (stream_encoder *) cinfo->client_data;
+
+    chunk_flush(enc, enc->chunk_size - enc->dest.free_in_buffer);
+}
+
+static void
+on_jpeg_error(j_common_ptr cinfo)
+{
+    longjmp(((jpeg_error *) cinfo->err)->jmp, 1);
+}
+
+static void
+on_jpeg_message(j_common_ptr)
+{
+}
+
+/*
+ * PNG output writing into chunks
+ */
+static void
+on_png_write(png_structp png, png_bytep data, png_size_t length)
+{
+    stream_encoder *enc = (stream_encoder *) png_get_io_ptr(png);
+
+    while(length > 0) {
+        size_t n;
+
+        if(!enc->has_chunk && !chunk_begin(enc))
+            png_error(png, "no_memory");
+
+        n = std::min(length, enc->chunk_size - enc->used);
+        memcpy(enc->chunk.data + enc->used, data, n);
+        enc->used += n;
+        data += n;
+        length -= n;
+
+        if(enc->used == enc->chunk_size)
+            chunk_flush(enc, enc->used);
+    }
+}
+
+static void
+on_png_flush(png_structp)
+{
+}
+
+static void
+on_png_error(png_structp png, png_const_charp)
+{
+    longjmp(png_jmpbuf(png), 1);
+}
+
+static void
+on_png_warning(png_structp, png_const_charp)
+{
+}
+
+static int
+jpeg_start(stream_encoder *enc, int quality)
+{
+    struct jpeg_compress_struct *cinfo = &enc->cinfo;
+
+    cinfo->err = jpeg_std_error(&enc->jerr.pub);
+    enc->jerr.pub.error_exit = on_jpeg_error;
+    enc->jerr.pub.output_message = on_jpeg_message;
+    if(setjmp(enc->jerr.jmp))
+        return 0;
+
+    jpeg_create_compress(cinfo);
+    enc->jpeg_created = 1;
+    cinfo->client_data = enc;
+
+    enc->dest.init_destination = on_jpeg_init_destination;
+    enc->dest.empty_output_buffer = on_jpeg_empty_output_buffer;
+    enc->dest.term_destination = on_jpeg_term_destination;
+    cinfo->dest = &enc->dest;
+
+    cinfo->image_width = enc->mat.cols;
+    cinfo->image_height = enc->mat.rows;
+    cinfo->input_components = enc->mat.channels() == 1 ? 1 : 3;
+    cinfo->in_color_space = enc->mat.channels() == 1 ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE);
+    jpeg_start_compress(cinfo, TRUE);
+    return 1;
+}
+
+/*
+ * Scanline for libjpeg, BGR and BGRA become RGB
+ */
+static JSAMPROW
+jpeg_line(stream_encoder *enc, int row)
+{
+    const uchar *src = enc->mat.ptr(row);
+    int channels = enc->mat.channels();
+    uchar *dst = enc->line.data();
+
+    if(channels == 1)
+        return (JSAMPROW) src;
+
+    for(int x = 0; x < enc->mat.cols; x++, src += channels, dst += 3) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+    }
+    return enc->line.data();
+}
+
+static int
+jpeg_rows(stream_encoder *enc, int end)
+{
+    if(setjmp(enc->jerr.jmp))
+        return 0;
+
+    while(enc->next_row < end) {
+        JSAMPROW row = jpeg_line(enc, enc->next_row);
+        jpeg_write_scanlines(&enc->cinfo, &row, 1);
+        enc->next_row++;
+    }
+    return 1;
+}
+
+static int
+jpeg_finish(stream_encoder *enc)
+{
+    if(setjmp(enc->jerr.jmp))
+        return 0;
+
+    jpeg_finish_compress(&enc->cinfo);
+    return 1;
+}
+
+static int
+png_start(stream_encoder *enc, int level)
+{
+    int channels = enc->mat.channels();
+    int color;
+
+    enc->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, enc, on_png_error, on_png_warning);
+    if(!enc->png)
+        return 0;
+    enc->info = png_create_info_struct(enc->png);
+    if(!enc->info)
+        return 0;
+    if(setjmp(png_jmpbuf(enc->png)))
+        return 0;
+
+    png_set_write_fn(enc->png, enc, on_png_write, on_png_flush);
+    png_set_compression_level(enc->png, level);
+
+    color = channels == 1 ? PNG_COLOR_TYPE_GRAY :
+            channels == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA;
+    png_set_IHDR(enc->png, enc->info, enc->mat.cols, enc->mat.rows, enc->mat.depth() == CV_16U ? 16 : 8,
+                 color, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(enc->png, enc->info);
+
+    /* Rows are written as OpenCV stores them */
+    if(channels > 1)
+        png_set_bgr(enc->png);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if(enc->mat.depth() == CV_16U)
+        png_set_swap(enc->png);
+#endif
+    return 1;
+}
+
+static int
+png_rows(stream_encoder *enc, int end)
+{
+    if(setjmp(png_jmpbuf(enc->png)))
+        return 0;
+
+    while(enc->next_row < end) {
+        png_write_row(enc->png, (png_bytep) enc->mat.ptr(enc->next_row));
+        enc->next_row++;
+    }
+    return 1;
+}
+
+static int
+png_finish(stream_encoder *enc)
+{
+    if(setjmp(png_jmpbuf(enc->png)))
+        return 0;
+
+    png_write_end(enc->png, enc->info);
+    if(enc->has_chunk)
+        chunk_flush(enc, enc->used);
+    return 1;
+}
+
+static int
+get_param(const std::vector<int> &params, int key, int value)
+{
+    for(size_t i = 0; i + 1 < params.size(); i += 2)
+        if(params[i] == key)
+            value = params[i + 1];
+    return value;
+}
+
+stream_encoder *
+stream_encoder_create(const char *ext, const cv::Mat &mat, const std::vector<int> &params,
+                      size_t chunk_size, stream_chunk_fn fn, void *ctx, const char **error)
+{
+    stream_encoder *enc;
+    stream_format format;
+    int channels = mat.channels();
+    int started;
+
+    if(strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0) {
+        format = stream_jpeg;
+    } else if(strcasecmp(ext, ".png") == 0) {
+        format = stream_png;
+    } else {
+        *error = "unsupported_format";
+        return NULL;
+    }
+
+    if(mat.empty() || mat.dims != 2 || (channels != 1 && channels != 3 && channels != 4)) {
+        *error = "invalid_mat";
+        return NULL;
+    }
+    if(mat.depth() != CV_8U && !(format == stream_png && mat.depth() == CV_16U)) {
+        *error = "unsupported_depth";
+        return NULL;
+    }
+    if(chunk_size == 0) {
+        *error = "invalid_chunk_size";
+        return NULL;
+    }
+
+    enc = new stream_encoder_t();
+    enc->format = format;
+    enc->mat = mat;
+    enc->line.resize(format == stream_jpeg ? mat.cols * 3 : 0);
+    enc->next_row = 0;
+    enc->finished = 0;
+    enc->chunk_size = chunk_size;
+    enc->has_chunk = 0;
+    enc->used = 0;
+    enc->bytes = 0;
+    enc->fn = fn;
+    enc->ctx = ctx;
+    enc->jpeg_created = 0;
+    enc->png = NULL;
+    enc->info = NULL;
+
+    if(format == stream_jpeg)
+        started = jpeg_start(enc, get_param(params, cv::IMWRITE_JPEG_QUALITY, 95));
+    else
+        started = png_start(enc, get_param(params, cv::IMWRITE_PNG_COMPRESSION, 1));
+
+    if(!started) {
+        stream_encoder_destroy(enc);
+        *error = "encode_failed";
+        return NULL;
+    }
+    return enc;
+}
+
+void
+stream_encoder_destroy(stream_encoder *enc)
+{
+    if(enc->jpeg_created)
+        jpeg_destroy_compress(&enc->cinfo);
+    if(enc->png)
+        png_destroy_write_struct(&enc->png, enc->info ? &enc->info : NULL);
+    if(enc->has_chunk)
+        enif_release_binary(&enc->chunk);
+    delete enc;
+}
+
+int
+stream_encoder_step(stream_encoder *enc, int max_rows)
+{
+    int end, ok;
+
+    if(enc->finished)
+        return 0;
+
+    end = std::min(enc->next_row + max_rows, enc->mat.rows);
+    ok = enc->format == stream_jpeg ? jpeg_rows(enc, end) : png_rows(enc, end);
+    if(!ok)
+        return -1;
+
+    if(enc->next_row < enc->mat.rows)
+        return 1;
+
+    ok = enc->format == stream_jpeg ? jpeg_finish(enc) : png_finish(enc);
+    if(!ok)
+        return -1;
+
+    enc->finished = 1;
+    return 0;
+}
+
+size_t
+stream_encoder_bytes(stream_encoder *enc)
+{
+    return enc->bytes;
+}
@@ -0,0 +1,38 @@
+#ifndef ERL_CV_STREAM_ENCODER_H
+#define ERL_CV_STREAM_ENCODER_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "erl_nif.h"
+#include "opencv2/opencv.hpp"
+
+/*
+ * JPEG and PNG encoding a few rows at a time, straight into binaries of a
+ * fixed size. Every chunk that fills up is handed to the callback, which
+ * takes ownership of it, so memory stays at about one chunk however large
+ * the image is.
+ */
+
+typedef struct stream_encoder_t stream_encoder;
+
+typedef void (*stream_chunk_fn)(void *ctx, ErlNifBinary *chunk);
+
+/*
+ * Starts encoding mat as ext (".jpg", ".jpeg" or ".png"). params are
+ * imencode params, only the JPEG quality and PNG compression are used.
+ * Returns NULL and sets error when the format or the Mat is not supported.
+ */
+stream_encoder *stream_encoder_create(const char *ext, const cv::Mat &mat, const std::vector<int> &params,
+                                      size_t chunk_size, stream_chunk_fn fn, void *ctx, const char **error);
+void stream_encoder_destroy(stream_encoder *enc);
+
+/*
+ * Encodes up to max_rows more rows. Returns 1 while rows remain, 0 once the
+ * last chunk has been handed out, -1 when encoding failed.
+ */
+int stream_encoder_step(stream_encoder *enc, int max_rows);
+
+size_t stream_encoder_bytes(stream_encoder *enc);
+
+#endif
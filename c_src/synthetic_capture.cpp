@@ -0,0 +1,313 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "synthetic_capture.hpp"
+
+#define URL_PREFIX "synthetic://"
+
+/* Frames this far behind schedule restart pacing instead of bursting */
+#define MAX_LAG_NS 1000000000LL
+
+static int64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t
+frame_seed(uint64_t seed, int64_t index)
+{
+    uint64_t x = seed * 0x9e3779b97f4a7c15ULL + (uint64_t) index;
+    x ^= x >> 31;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    return (x ^ (x >> 29)) | 1;
+}
+
+SyntheticCapture::SyntheticCapture(const char *url)
+    : opened_(false), width_(0), height_(0), fps_(30), pattern_(moving_gradient),
+      noise_(0), motion_(4), seed_(0), frames_(0), realtime_(true),
+      next_(0), grabbed_(-1), epoch_ns_(0), epoch_index_(0)
+{
+    opened_ = parse(url);
+}
+
+bool
+SyntheticCapture::is_synthetic(const char *url)
+{
+    return strncmp(url, URL_PREFIX, strlen(URL_PREFIX)) == 0;
+}
+
+bool
+SyntheticCapture::parse(const char *url)
+{
+    const char *p;
+    char *end;
+    int used = 0;
+
+    if(!is_synthetic(url))
+        return false;
+    p = url + strlen(URL_PREFIX);
+
+    if(sscanf(p, "%dx%d%n", &width_, &height_, &used) != 2 || width_ <= 0 || height_ <= 0)
+        return false;
+    p += used;
+
+    if(*p == '@') {
+        fps_ = strtod(p + 1, &end);
+        if(end == p + 1 || fps_ < 0)
+            return false;
+        p = end;
+    }
+
+    if(*p == '\0')
+        return true;
+    if(*p != '?')
+        return false;
+
+    while(*p == '?' || *p == '&') {
+        const char *key = p + 1;
+        const char *eq = strchr(key, '=');
+        const char *value;
+        size_t key_len, value_len;
+
+        if(!eq)
+            return false;
+        key_len = eq - key;
+        value = eq + 1;
+        value_len = strcspn(value, "&");
+        p = value + value_len;
+
+        if(key_len == 7 && strncmp(key, "pattern", 7) == 0) {
+            if(value_len == 15 && strncmp(value, "moving_gradient", 15) == 0)
+                pattern_ = moving_gradient;
+            else if(value_len == 10 && strncmp(value, "color_bars", 10) == 0)
+                pattern_ = color_bars;
+            else if(value_len == 12 && strncmp(value, "checkerboard", 12) == 0)
+                pattern_ = checkerboard;
+            else if(value_len == 5 && strncmp(value, "noise", 5) == 0)
+                pattern_ = noise;
+            else
+                return false;
+        } else if(key_len == 5 && strncmp(key, "noise", 5) == 0) {
+            noise_ = strtod(value, NULL);
+        } else if(key_len == 6 && strncmp(key, "motion", 6) == 0) {
+            motion_ = atoi(value);
+        } else if(key_len == 4 && strncmp(key, "seed", 4) == 0) {
+            seed_ = strtoull(value, NULL, 10);
+        } else if(key_len == 6 && strncmp(key, "frames", 6) == 0) {
+            frames_ = strtoll(value, NULL, 10);
+        } else if(key_len == 8 && strncmp(key, "realtime", 8) == 0) {
+            realtime_ = atoi(value) != 0;
+        } else {
+            return false;
+        }
+    }
+
+    return *p == '\0' && noise_ >= 0 && frames_ >= 0;
+}
+
+bool
+SyntheticCapture::isOpened() const
+{
+    return opened_;
+}
+
+void
+SyntheticCapture::release()
+{
+    opened_ = false;
+}
+
+/*
+ * Sleeps until the next frame is due
+ */
+void
+SyntheticCapture::pace()
+{
+    int64_t now, due;
+    struct timespec ts;
+
+    if(!realtime_ || fps_ <= 0)
+        return;
+
+    now = monotonic_ns();
+    if(epoch_ns_ == 0) {
+        epoch_ns_ = now;
+        epoch_index_ = next_;
+        return;
+    }
+
+    due = epoch_ns_ + (int64_t) ((next_ - epoch_index_) * 1e9 / fps_);
+    if(now - due > MAX_LAG_NS) {
+        epoch_ns_ = now;
+        epoch_index_ = next_;
+        return;
+    }
+
+    if(due > now) {
+        ts.tv_sec = (due - now) / 1000000000LL;
+        ts.tv_nsec = (due - now) % 1000000000LL;
+        nanosleep(&ts, NULL);
+    }
+}
+
+bool
+SyntheticCapture::grab()
+{
+    if(!opened_)
+        return false;
+    if(frames_ > 0 && next_ >= frames_)
+        return false;
+
+    pace();
+    grabbed_ = next_++;
+    return true;
+}
+
+bool
+SyntheticCapture::retrieve(cv::OutputArray image, int)
+{
+    cv::Mat frame;
+
+    if(!opened_ || grabbed_ < 0)
+        return false;
+
+    image.create(height_, width_, CV_8UC3);
+    frame = image.getMat();
+    render(frame, grabbed_);
+    return true;
+}
+
+bool
+SyntheticCapture::read(cv::OutputArray image)
+{
+    return grab() && retrieve(image);
+}
+
+bool
+SyntheticCapture::set(int propId, double value)
+{
+    switch(propId) {
+      case cv::CAP_PROP_POS_FRAMES:
+        if(value < 0)
+            return false;
+        next_ = (int64_t) value;
+        grabbed_ = -1;
+        epoch_ns_ = 0;
+        return true;
+      case cv::CAP_PROP_FPS:
+        if(value < 0)
+            return false;
+        fps_ = value;
+        epoch_ns_ = 0;
+        return true;
+      case cv::CAP_PROP_FRAME_WIDTH:
+        if(value < 1)
+            return false;
+        width_ = (int) value;
+        return true;
+      case cv::CAP_PROP_FRAME_HEIGHT:
+        if(value < 1)
+            return false;
+        height_ = (int) value;
+        return true;
+    }
+    return false;
+}
+
+double
+SyntheticCapture::get(int propId) const
+{
+    switch(propId) {
+      case cv::CAP_PROP_FRAME_WIDTH:
+        return width_;
+      case cv::CAP_PROP_FRAME_HEIGHT:
+        return height_;
+      case cv::CAP_PROP_FPS:
+        return fps_;
+      case cv::CAP_PROP_POS_FRAMES:
+        return (double) next_;
+      case cv::CAP_PROP_POS_MSEC:
+        return fps_ > 0 ? next_ * 1000.0 / fps_ : 0;
+      case cv::CAP_PROP_FRAME_COUNT:
+        return frames_ > 0 ? (double) frames_ : -1;
+      case cv::CAP_PROP_FORMAT:
+        return CV_8UC3;
+    }
+    return 0;
+}
+
+void
+SyntheticCapture::render(cv::Mat &frame, int64_t index) const
+{
+    static const uchar bars[8][3] = {
+        {255, 255, 255}, {0, 255, 255}, {255, 255, 0}, {0, 255, 0},
+        {255, 0, 255}, {0, 0, 255}, {255, 0, 0}, {0, 0, 0}
+    };
+    int shift = (int) ((index * motion_) % (int64_t) width_);
+    int square = std::max(8, height_ / 12);
+
+    if(shift < 0)
+        shift += width_;
+
+    switch(pattern_) {
+      case moving_gradient:
+        for(int y = 0; y < frame.rows; y++) {
+            uchar *row = frame.ptr(y);
+            uchar g = (uchar) (((y + shift / 2) % height_) * 255 / height_);
+            for(int x = 0; x < frame.cols; x++) {
+                row[3 * x] = (uchar) (((x + shift) % width_) * 255 / width_);
+                row[3 * x + 1] = g;
+                row[3 * x + 2] = (uchar) ((x + y) / 4 + shift);
+            }
+        }
+        break;
+      case color_bars:
+        for(int y = 0; y < frame.rows; y++) {
+            uchar *row = frame.ptr(y);
+            for(int x = 0; x < frame.cols; x++)
+                memcpy(row + 3 * x, bars[((x + shift) % width_) * 8 / width_], 3);
+        }
+        break;
+      case checkerboard:
+        for(int y = 0; y < frame.rows; y++) {
+            uchar *row = frame.ptr(y);
+            for(int x = 0; x < frame.cols; x++)
+                memset(row + 3 * x, (((x + shift) / square + (y + shift) / square) & 1) ? 255 : 0, 3);
+        }
+        break;
+      case noise: {
+        cv::RNG rng(frame_seed(seed_, index));
+        rng.fill(frame, cv::RNG::UNIFORM, 0.0, 256.0);
+        break;
+      }
+    }
+
+    if(noise_ > 0) {
+        cv::RNG rng(frame_seed(seed_ + 1, index));
+        cv::Mat grain(frame.rows, frame.cols, CV_16SC3);
+        rng.fill(grain, cv::RNG::NORMAL, 0.0, noise_);
+        cv::add(frame, grain, frame, cv::noArray(), CV_8UC3);
+    }
+
+    draw_index(frame, index);
+}
+
+void
+SyntheticCapture::draw_index(cv::Mat &frame, int64_t index) const
+{
+    const int block = 8;
+
+    if(frame.cols < 32 * block || frame.rows < block)
+        return;
+
+    for(int bit = 0; bit < 32; bit++) {
+        int on = (index >> (31 - bit)) & 1;
+        frame(cv::Rect(bit * block, 0, block, block)).setTo(cv::Scalar::all(on ? 255 : 0));
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef ERL_CV_SYNTHETIC_CAPTURE_H
+#define ERL_CV_SYNTHETIC_CAPTURE_H
+
+#include <stdint.h>
+
+#include "opencv2/opencv.hpp"
+
+/*
+ * A VideoCapture that renders a test pattern instead of reading a device,
+ * opened with an url like
+ *
+ *     synthetic://1920x1080@60?pattern=moving_gradient&noise=8&motion=4
+ *
+ * Frame n only depends on the url and n, so runs are reproducible. The
+ * frame index is also drawn as 32 blocks in the top left corner (white is
+ * a one bit, most significant first) to spot dropped or reordered frames.
+ *
+ * Query parameters:
+ *   pattern   moving_gradient (default), color_bars, checkerboard or noise
+ *   noise     standard deviation of gaussian noise added to every frame
+ *   motion    pixels the pattern moves per frame (default 4)
+ *   seed      seed of the noise (default 0)
+ *   frames    number of frames before grab fails, 0 for no end (default)
+ *   realtime  1 to pace grab to the frame rate (default), 0 to run flat out
+ */
+class SyntheticCapture : public cv::VideoCapture {
+public:
+    explicit SyntheticCapture(const char *url);
+
+    static bool is_synthetic(const char *url);
+
+    virtual bool isOpened() const;
+    virtual void release();
+    virtual bool grab();
+    virtual bool retrieve(cv::OutputArray image, int flag = 0);
+    virtual bool read(cv::OutputArray image);
+    virtual bool set(int propId, double value);
+    virtual double get(int propId) const;
+
+private:
+    enum pattern_kind { moving_gradient, color_bars, checkerboard, noise };
+
+    bool parse(const char *url);
+    void render(cv::Mat &frame, int64_t index) const;
+    void draw_index(cv::Mat &frame, int64_t index) const;
+    void pace();
+
+    bool opened_;
+    int width_;
+    int height_;
+    double fps_;
+    pattern_kind pattern_;
+    double noise_;
+    int motion_;
+    uint64_t seed_;
+    int64_t frames_;
+    bool realtime_;
+
+    int64_t next_;      /* index of the next frame grab returns */
+    int64_t grabbed_;   /* index of the frame retrieve renders, -1 if none */
+    int64_t epoch_ns_;  /* when frame epoch_index_ was due, 0 to restart */
+    int64_t epoch_index_;
+};
+
+#endif
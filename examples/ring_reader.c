@@ -0,0 +1,94 @@
+/*
+ * Minimal reader for the shared memory frame ring of OpenCv.VideoCapture.
+ *
+ *     cc -O2 -I../c_src -o ring_reader ring_reader.c -lrt
+ *     ./ring_reader /erl_cv_cam0            # print a line per frame
+ *     ./ring_reader /erl_cv_cam0 --raw | \
+ *         ffmpeg -f rawvideo -pix_fmt bgr24 -s 640x480 -i - out.mp4
+ *
+ * The reader maps the ring read only and never blocks the writer. When it
+ * falls more than a ring's worth of frames behind it skips ahead to the
+ * newest frame.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "erl_cv_ring.h"
+
+int
+main(int argc, char **argv)
+{
+    erl_cv_ring_header *ring;
+    erl_cv_ring_slot info;
+    struct stat st;
+    uint64_t next;
+    void *frame;
+    int fd, raw;
+
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s NAME [--raw]\n", argv[0]);
+        return 1;
+    }
+    raw = argc > 2 && strcmp(argv[2], "--raw") == 0;
+
+    fd = shm_open(argv[1], O_RDONLY, 0);
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        perror("shm_open");
+        return 1;
+    }
+
+    ring = (erl_cv_ring_header *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(ring == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    if(__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != ERL_CV_RING_MAGIC ||
+       ring->version != ERL_CV_RING_VERSION) {
+        fprintf(stderr, "%s is not a frame ring\n", argv[1]);
+        return 1;
+    }
+
+    frame = malloc(ring->slot_size);
+    if(!frame)
+        return 1;
+
+    next = erl_cv_ring_head(ring) + 1;
+    for(;;) {
+        uint64_t head = erl_cv_ring_head(ring);
+
+        if(head < next) {
+            usleep(1000);
+            continue;
+        }
+        if(head - next >= ring->slot_count)
+            next = head;
+
+        switch(erl_cv_ring_read(ring, next, &info, frame, ring->slot_size)) {
+        case ERL_CV_RING_OK:
+            if(raw) {
+                if(fwrite(frame, 1, info.size, stdout) != info.size)
+                    return 0;
+            } else {
+                printf("frame %llu: %dx%d type %d, %llu bytes at %llu ns\n",
+                       (unsigned long long) info.seq, info.cols, info.rows, info.type,
+                       (unsigned long long) info.size,
+                       (unsigned long long) info.timestamp_ns);
+            }
+            next++;
+            break;
+        case ERL_CV_RING_AGAIN:
+            break;
+        default:
+            next = erl_cv_ring_head(ring);
+            break;
+        }
+    }
+}
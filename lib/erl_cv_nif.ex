@@ -13,6 +13,8 @@ defmodule :erl_cv_nif do
   end
 
   def start(), do: :erlang.nif_error("erl_video_capture not loaded")
+  def start(_opts), do: :erlang.nif_error("erl_video_capture not loaded")
+  def close(_conn), do: :erlang.nif_error("erl_video_capture not loaded")
 
   # Video Capture
   def video_capture_open(_conn, _ref, _pid, _filename),
@@ -39,6 +41,94 @@ defmodule :erl_cv_nif do
   def video_capture_set(_conn, _ref, _pid, _cap_propid_value),
     do: :erlang.nif_error("erl_video_capture not loaded")
 
+  def video_capture_ring(_conn, _ref, _pid, _cap_name_slots_size),
+    do: :erlang.nif_error("erl_video_capture not loaded")
+
+  def video_capture_accumulate(_conn, _ref, _pid, _cap_kind_param),
+    do: :erlang.nif_error("erl_video_capture not loaded")
+
+  def video_capture_feed(_conn, _ref, _pid, _cap_count),
+    do: :erlang.nif_error("erl_video_capture not loaded")
+
+  def video_capture_stacked(_conn, _ref, _pid, _cap),
+    do: :erlang.nif_error("erl_video_capture not loaded")
+
+  def video_capture_sample(_conn, _ref, _pid, _cap_every_fps_max_seek),
+    do: :erlang.nif_error("erl_video_capture not loaded")
+
+  # Video File
+  def video_file_parallel_map(_conn, _ref, _pid, _filename_segments_encode_window),
+    do: :erlang.nif_error("erl_video_capture not loaded")
+
+  def video_file_release(_window, _next), do: :erlang.nif_error("erl_video_capture not loaded")
+
+  def video_file_cancel(_window), do: :erlang.nif_error("erl_video_capture not loaded")
+
+  def submit_batch(_conn, _ref, _pid, _steps), do: :erlang.nif_error("nif not loaded")
+
+  def trace(_on), do: :erlang.nif_error("nif not loaded")
+  def dump_trace(_filename), do: :erlang.nif_error("nif not loaded")
+
   def imencode(_mat, _ref, _pid, _ext_params), do: :erlang.nif_error("nif not loaded")
+
+  def imencode_stream(_conn, _ref, _pid, _mat_ext_params_chunk_size_window),
+    do: :erlang.nif_error("nif not loaded")
+
+  def imencode_stream_ack(_conn, _stream), do: :erlang.nif_error("nif not loaded")
+
+  def imwrite_async(_conn, _ref, _pid, _mat_path_params_sync),
+    do: :erlang.nif_error("nif not loaded")
+
   def new_mat(_mat, _ref, _pid, _arg), do: :erlang.nif_error("nif not loaded")
+
+  def encode_cache_config(_conn, _ref, _pid, _size_tolerant),
+    do: :erlang.nif_error("nif not loaded")
+
+  def encode_cache_stats(_conn, _ref, _pid, _arg), do: :erlang.nif_error("nif not loaded")
+
+  def jpeg_encoder_new(_conn, _ref, _pid, _target_fps_min_max_scale),
+    do: :erlang.nif_error("nif not loaded")
+
+  def jpeg_encoder_encode(_conn, _ref, _pid, _encoder_mat), do: :erlang.nif_error("nif not loaded")
+  def jpeg_encoder_stats(_conn, _ref, _pid, _encoder), do: :erlang.nif_error("nif not loaded")
+
+  # Mat
+  def mat_roi(_conn, _ref, _pid, _mat_x_y_w_h), do: :erlang.nif_error("nif not loaded")
+  def mat_to_binary(_conn, _ref, _pid, _mat), do: :erlang.nif_error("nif not loaded")
+  def mat_serialize(_conn, _ref, _pid, _mat_lz4), do: :erlang.nif_error("nif not loaded")
+  def mat_deserialize(_conn, _ref, _pid, _binary), do: :erlang.nif_error("nif not loaded")
+
+  # Statistics
+  def stats(_conn, _ref, _pid, _mats_ops), do: :erlang.nif_error("nif not loaded")
+
+  # Object detection
+  def detector_load(_conn, _ref, _pid, _kind_filename), do: :erlang.nif_error("nif not loaded")
+  def detect(_conn, _ref, _pid, _detector_mats_roi_scale), do: :erlang.nif_error("nif not loaded")
+
+  # Deep learning
+  def dnn_read_net(_conn, _ref, _pid, _model_opts), do: :erlang.nif_error("nif not loaded")
+  def dnn_infer(_net, _ref, _pid, _mat), do: :erlang.nif_error("nif not loaded")
+
+  # Features
+  def orb_extract(_conn, _ref, _pid, _mats_nfeatures), do: :erlang.nif_error("nif not loaded")
+  def features_descriptors(_conn, _ref, _pid, _features), do: :erlang.nif_error("nif not loaded")
+  def matcher_new(_conn, _ref, _pid, _features_kind), do: :erlang.nif_error("nif not loaded")
+
+  def matcher_match(_conn, _ref, _pid, _matcher_features_opts),
+    do: :erlang.nif_error("nif not loaded")
+
+  # Perceptual hashing
+  def phash(_conn, _ref, _pid, _mats_algorithm), do: :erlang.nif_error("nif not loaded")
+  def phash_index_new(_conn, _ref, _pid, _arg), do: :erlang.nif_error("nif not loaded")
+
+  def phash_index_insert(_conn, _ref, _pid, _index_entries),
+    do: :erlang.nif_error("nif not loaded")
+
+  def phash_index_query(_conn, _ref, _pid, _index_hashes_radius),
+    do: :erlang.nif_error("nif not loaded")
+
+  def phash_index_save(_conn, _ref, _pid, _index_filename),
+    do: :erlang.nif_error("nif not loaded")
+
+  def phash_index_load(_conn, _ref, _pid, _filename), do: :erlang.nif_error("nif not loaded")
 end
@@ -3,8 +3,65 @@ defmodule OpenCv do
 
   @default_timeout 5000
 
-  def new do
-    :erl_cv_nif.start()
+  @doc """
+  Starts a connection, a native thread that runs the commands sent to it.
+
+  Options:
+
+    * `:cv_threads` - threads OpenCV may use for its parallel loops
+      (`cv::setNumThreads`). This is process wide, the connection started
+      last wins. `0` runs the loops on the connection thread itself.
+    * `:cpus` - logical CPUs the connection's threads are pinned to. OpenCV
+      starts its worker threads from the connection thread, so they inherit
+      the pinning if this is the first connection to run parallel code.
+    * `:avoid_schedulers` - pin to the CPUs the VM may run on that no online
+      scheduler is bound to. Schedulers have to be bound (e.g. `+sbt db`)
+      and `+S` has to leave CPUs free, e.g. `+sbt db +S 6` on 8 CPUs.
+      Otherwise `{:error, :schedulers_not_bound}` or
+      `{:error, :no_free_cpus}` is returned.
+  """
+  def new(opts \\ []) do
+    if opts == [] do
+      :erl_cv_nif.start()
+    else
+      cv_threads = Keyword.get(opts, :cv_threads, -1)
+
+      if Keyword.get(opts, :avoid_schedulers, false) do
+        case bound_cpus() do
+          nil -> {:error, :schedulers_not_bound}
+          bound -> :erl_cv_nif.start({cv_threads, {:exclude, bound}})
+        end
+      else
+        :erl_cv_nif.start({cv_threads, Keyword.get(opts, :cpus, [])})
+      end
+    end
+  end
+
+  @doc """
+  Closes a connection without waiting for its threads. Commands still
+  queued are answered with `{:error, :closed}` and new ones are refused;
+  writes already queued with `imwrite_async/6` are still completed. The
+  threads are joined in the background, so a command that is running when
+  the connection closes (e.g. a slow device read) does not block the caller.
+
+  Connections that are garbage collected are closed the same way.
+  """
+  def close(conn) do
+    :erl_cv_nif.close(conn)
+  end
+
+  # CPUs the online schedulers are bound to, nil when none is bound. The
+  # native side takes them out of the process affinity mask.
+  defp bound_cpus do
+    online = :erlang.system_info(:schedulers_online)
+
+    bound =
+      :erlang.system_info(:scheduler_bindings)
+      |> Tuple.to_list()
+      |> Enum.take(online)
+      |> Enum.filter(&is_integer/1)
+
+    if bound == [], do: nil, else: bound
   end
 
   def mat(conn, arg \\ nil, timeout \\ @default_timeout) do
@@ -13,15 +70,158 @@ defmodule OpenCv do
     receive_answer(ref, timeout)
   end
 
+  @doc """
+  Runs a list of `{command, arg}` steps on the connection thread and answers
+  once. `command` is the name of a NIF in `:erl_cv_nif` (e.g.
+  `:video_capture_grab`, `:imencode`) and `arg` is what that NIF takes
+  after the pid. Inside `arg`, `{:ref, n}` stands for the result of step
+  `n` (zero based), unwrapped if it is `{:ok, value}`:
+
+      OpenCv.submit_batch(conn, [
+        {:video_capture_read, cap},
+        {:imencode, {{:ref, 0}, '.jpg', [1, 90]}},
+        {:imencode, {{:ref, 0}, '.jpg', [1, 40]}}
+      ])
+      #=> {:ok, [{:ok, mat}, hi, lo]}
+
+  Returns `{:error, {n, reason}}` for the first step that fails.
+  """
+  def submit_batch(conn, steps, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.submit_batch(conn, ref, self(), steps)
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Turns native span tracing on or off. While on, every thread records queue
+  wait, command execution, the OpenCV calls and reply sends into a ring of
+  its most recent spans. Use `dump_trace/1` to write them out.
+  """
+  def trace(on) when is_boolean(on) do
+    :erl_cv_nif.trace(on)
+  end
+
+  @doc """
+  Writes the recorded spans to `filename` as Chrome trace JSON, which can be
+  opened in Perfetto or `chrome://tracing`.
+  """
+  def dump_trace(filename) do
+    :erl_cv_nif.dump_trace(filename)
+  end
+
   def imencode(conn, mat, ext, params, timeout \\ @default_timeout) do
     ref = make_ref()
     :ok = :erl_cv_nif.imencode(conn, ref, self(), {mat, ext, params})
     receive_answer(ref, timeout)
   end
 
-  def test do
+  @doc """
+  Encodes `mat` as JPEG or PNG (`ext` is `'.jpg'`, `'.jpeg'` or `'.png'`)
+  without ever holding the whole output. It is produced in binaries of
+  `:chunk_size` bytes, the last one shorter, and `fun.(chunk)` is called
+  for each as soon as it is ready, e.g. to write it to a socket or file.
+  The image is encoded about 1 MB of pixels at a time and other commands
+  queued on `conn` run in between. Returns `{:ok, total_bytes}`.
+
+      {:ok, file} = File.open("big.png", [:write, :raw])
+      {:ok, _bytes} = OpenCv.imencode_stream(conn, mat, '.png', [], &IO.binwrite(file, &1))
+
+  Only 8 bit images with 1, 3 or 4 channels are supported, and 16 bit
+  ones for PNG. Of `params` only the JPEG quality and PNG compression
+  are used.
+
+  Options:
+
+    * `:chunk_size` - bytes per chunk (default `65536`).
+    * `:window` - encoding pauses between slices while this many chunks
+      have not been passed to `fun` yet (default `8`), so a slow consumer
+      doesn't fill the mailbox. `0` never pauses.
+    * `:timeout` - maximum time to wait for the next chunk.
+  """
+  def imencode_stream(conn, mat, ext, params, fun, opts \\ []) do
+    chunk_size = Keyword.get(opts, :chunk_size, 65_536)
+    window = Keyword.get(opts, :window, 8)
+    timeout = Keyword.get(opts, :timeout, @default_timeout)
+
+    ref = make_ref()
+    :ok = :erl_cv_nif.imencode_stream(conn, ref, self(), {mat, ext, params, chunk_size, window})
+
+    if window == 0 do
+      {answer, _} = receive_stream(ref, timeout, nil, fn {:chunk, chunk}, _ -> fun.(chunk) end)
+      answer
+    else
+      receive_acked_stream(conn, ref, timeout, fun)
+    end
+  end
+
+  # The stream arrives before any chunk, each chunk is acked once `fun` is
+  # done with it.
+  defp receive_acked_stream(conn, ref, timeout, fun) do
+    receive do
+      {:erl_cv_nif, ^ref, {:stream, stream}} ->
+        reducer = fn {:chunk, chunk}, _ ->
+          fun.(chunk)
+          :erl_cv_nif.imencode_stream_ack(conn, stream)
+        end
+
+        {answer, _} = receive_stream(ref, timeout, nil, reducer)
+        answer
+
+      {:erl_cv_nif, ^ref, resp} ->
+        resp
+    after
+      timeout -> {:error, {:timeout, ref}}
+    end
+  end
+
+  @doc """
+  Encodes `mat` and writes it to `path` on the connection's I/O thread, so
+  encoding and file writes don't hold up other commands. The format is taken
+  from the extension of `path`. Returns `{:ok, bytes_written}`.
+
+  Options:
+
+    * `:sync` - `fdatasync` the file before replying (default `false`).
+      Syncs of writes queued together are issued as one group.
+  """
+  def imwrite_async(conn, mat, path, params, opts \\ [], timeout \\ @default_timeout) do
+    ref = make_ref()
+    sync = Keyword.get(opts, :sync, false)
+    :ok = :erl_cv_nif.imwrite_async(conn, ref, self(), {mat, path, params, sync})
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Enables the encode cache of `conn`. While enabled, `imencode/5` returns the
+  previously encoded binary for a Mat whose contents, extension and params
+  are unchanged.
+
+  Options:
+
+    * `:size` - number of encoded outputs to keep, `0` disables the cache.
+      Defaults to `4`.
+    * `:noise_tolerant` - key on a quantised thumbnail instead of every
+      pixel, so sensor noise on a static scene still hits. Float Mats are
+      taken to hold values in 0-1. Defaults to `false`.
+  """
+  def encode_cache(conn, opts \\ [], timeout \\ @default_timeout) do
+    size = Keyword.get(opts, :size, 4)
+    noise_tolerant = Keyword.get(opts, :noise_tolerant, false)
+
+    ref = make_ref()
+    :ok = :erl_cv_nif.encode_cache_config(conn, ref, self(), {size, noise_tolerant})
+    receive_answer(ref, timeout)
+  end
+
+  def encode_cache_stats(conn, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.encode_cache_stats(conn, ref, self(), nil)
+    receive_answer(ref, timeout)
+  end
+
+  def test(device \\ '/dev/video0') do
     {:ok, conn} = OpenCv.new()
-    {:ok, cap} = OpenCv.VideoCapture.open(conn, '/dev/video0')
+    {:ok, cap} = OpenCv.VideoCapture.open(conn, device)
     true = OpenCv.VideoCapture.is_opened(conn, cap)
     {:ok, frame} = OpenCv.VideoCapture.read(conn, cap)
     jpg = OpenCv.imencode(conn, frame, '.jpg', [])
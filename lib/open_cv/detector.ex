@@ -0,0 +1,46 @@
+defmodule OpenCv.Detector do
+  import OpenCv.Util
+
+  @default_timeout 5000
+
+  @doc """
+  Loads a cascade classifier from an XML model. Models are cached on the
+  connection, so loading the same file again returns the same detector.
+  """
+  def cascade(conn, filename, timeout \\ @default_timeout) do
+    load(conn, :cascade, filename, timeout)
+  end
+
+  @doc """
+  Returns the HOG detector with OpenCV's default people model.
+  """
+  def hog_people(conn, timeout \\ @default_timeout) do
+    load(conn, :hog_people, nil, timeout)
+  end
+
+  @doc """
+  Detects objects in a Mat, or in every Mat of a list. Returns `{x, y, w, h}`
+  rectangles in the coordinates of the full frame. The Mats of a list are
+  spread across cores for HOG. Empty Mats and Mats that are not 8 bit grey
+  or BGR (BGRA is fine for a cascade) give `{:error, :invalid_mat}`.
+
+  Options:
+
+    * `:roi` - `{x, y, w, h}` region to search in.
+    * `:scale` - downscale factor applied before detection, e.g. `0.5`.
+  """
+  def detect(conn, detector, mats, opts \\ [], timeout \\ @default_timeout) do
+    roi = Keyword.get(opts, :roi)
+    scale = Keyword.get(opts, :scale, 1.0) / 1
+
+    ref = make_ref()
+    :ok = :erl_cv_nif.detect(conn, ref, self(), {detector, mats, roi, scale})
+    receive_answer(ref, timeout)
+  end
+
+  defp load(conn, kind, filename, timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.detector_load(conn, ref, self(), {kind, filename})
+    receive_answer(ref, timeout)
+  end
+end
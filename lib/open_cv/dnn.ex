@@ -0,0 +1,56 @@
+defmodule OpenCv.Dnn do
+  import OpenCv.Util
+
+  @default_timeout 5000
+
+  @doc """
+  Loads a network with `cv::dnn::readNet`. Inference requests made with
+  `infer/3` from any number of processes are gathered into micro-batches and
+  run as a single forward pass.
+
+  Options:
+
+    * `:config` - separate network config file, if the format needs one.
+    * `:size` - `{width, height}` the input images are resized to.
+    * `:scale` - multiplier applied to pixel values. Defaults to `1.0`.
+    * `:mean` - `{b, g, r}` subtracted from each pixel. Defaults to zeros.
+    * `:swap_rb` - swap the red and blue channels. Defaults to `false`.
+    * `:max_batch` - largest batch run at once. Defaults to `16`.
+    * `:max_wait_us` - how long the first request of a batch waits for
+      others to join it. Defaults to `2000`.
+  """
+  def read_net(conn, model, opts \\ [], timeout \\ @default_timeout) do
+    {b, g, r} = Keyword.get(opts, :mean, {0, 0, 0})
+
+    arg = {
+      model,
+      Keyword.get(opts, :config),
+      Keyword.fetch!(opts, :size),
+      Keyword.get(opts, :scale, 1.0) / 1,
+      {b / 1, g / 1, r / 1},
+      Keyword.get(opts, :swap_rb, false),
+      Keyword.get(opts, :max_batch, 16),
+      Keyword.get(opts, :max_wait_us, 2000)
+    }
+
+    ref = make_ref()
+    :ok = :erl_cv_nif.dnn_read_net(conn, ref, self(), arg)
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Runs `mat` through `net` and returns its output as a flat list of floats.
+
+  `mat` has to be 8 bit or float with 1, 3 or 4 channels, otherwise
+  `{:error, :invalid_mat}` is returned without queueing the request. Grey
+  and colour Mats are batched separately.
+  """
+  def infer(net, mat, timeout \\ @default_timeout) do
+    ref = make_ref()
+
+    case :erl_cv_nif.dnn_infer(net, ref, self(), mat) do
+      :ok -> receive_answer(ref, timeout)
+      error -> error
+    end
+  end
+end
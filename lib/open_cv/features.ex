@@ -0,0 +1,60 @@
+defmodule OpenCv.Features do
+  import OpenCv.Util
+
+  @default_timeout 5000
+
+  @doc """
+  Extracts ORB keypoints and descriptors from a Mat, or from every Mat of a
+  list in parallel.
+
+  Only 8 bit Mats with 1, 3 or 4 channels can be used. Any other Mat gives
+  `{:error, :invalid_mat}`, in place of its features when extracting from
+  a list, and the rest of the list is still extracted.
+  """
+  def orb(conn, mats, nfeatures \\ 500, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.orb_extract(conn, ref, self(), {mats, nfeatures})
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Returns `{keypoint_count, descriptors}` where `descriptors` holds 32 bytes
+  per keypoint.
+  """
+  def descriptors(conn, features, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.features_descriptors(conn, ref, self(), features)
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Creates a matcher holding `references`, a list of features. `kind` is
+  `:bf` for brute-force Hamming or `:lsh` for an LSH index. A reference
+  without keypoints (a covered or black frame) gives
+  `{:error, :empty_reference}`.
+  """
+  def matcher(conn, references, kind \\ :bf, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.matcher_new(conn, ref, self(), {references, kind})
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Matches features, or a list of features, against the matcher's references.
+  Every match is `{query_idx, train_idx, reference_idx, distance}`. Features
+  without keypoints match nothing.
+
+  Options:
+
+    * `:ratio` - Lowe's ratio test threshold, `0` disables it. Defaults to `0.75`.
+    * `:max_distance` - drop matches further apart than this. Defaults to `64`.
+  """
+  def match(conn, matcher, features, opts \\ [], timeout \\ @default_timeout) do
+    ratio = Keyword.get(opts, :ratio, 0.75) / 1
+    max_distance = Keyword.get(opts, :max_distance, 64) / 1
+
+    ref = make_ref()
+    :ok = :erl_cv_nif.matcher_match(conn, ref, self(), {matcher, features, ratio, max_distance})
+    receive_answer(ref, timeout)
+  end
+end
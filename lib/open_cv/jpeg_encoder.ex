@@ -0,0 +1,56 @@
+defmodule OpenCv.JpegEncoder do
+  import OpenCv.Util
+
+  @default_timeout 5000
+
+  @doc """
+  Creates a JPEG encoder for one stream that keeps its output within a
+  budget. The quality of every frame is picked from the sizes of earlier
+  frames and a cheap estimate of how detailed the frame is, so busy scenes
+  get a lower quality and static ones a higher one, without trial encodes.
+
+  Options, one of `:bytes_per_frame` or `:bitrate` is required:
+
+    * `:bytes_per_frame` - target size of a frame.
+    * `:bitrate` - target bits per second, needs `:fps`.
+    * `:fps` - frame rate of the stream, also used to report the bitrate.
+    * `:min_quality` / `:max_quality` - quality range (default `30..90`).
+    * `:min_scale` - allow frames to be downscaled down to this factor when
+      even `:min_quality` is over budget (default `1.0`, never).
+  """
+  def new(conn, opts, timeout \\ @default_timeout) do
+    fps = Keyword.get(opts, :fps, 0)
+
+    target =
+      case Keyword.fetch(opts, :bytes_per_frame) do
+        {:ok, bytes} -> bytes
+        :error when fps > 0 -> Keyword.fetch!(opts, :bitrate) / 8 / fps
+      end
+
+    min_quality = Keyword.get(opts, :min_quality, 30)
+    max_quality = Keyword.get(opts, :max_quality, 90)
+    min_scale = Keyword.get(opts, :min_scale, 1.0)
+
+    ref = make_ref()
+    arg = {target / 1, fps / 1, min_quality, max_quality, min_scale / 1}
+    :ok = :erl_cv_nif.jpeg_encoder_new(conn, ref, self(), arg)
+    receive_answer(ref, timeout)
+  end
+
+  def encode(conn, encoder, mat, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.jpeg_encoder_encode(conn, ref, self(), {encoder, mat})
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Returns what the encoder achieved: `:frames`, `:bytes`, `:last_bytes`,
+  `:avg_bytes` (moving average), `:target_bytes`, `:bitrate` (`nil` without
+  `:fps`), and the `:quality`, `:scale` and `:complexity` of the last frame.
+  """
+  def stats(conn, encoder, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.jpeg_encoder_stats(conn, ref, self(), encoder)
+    receive_answer(ref, timeout)
+  end
+end
@@ -0,0 +1,50 @@
+defmodule OpenCv.Mat do
+  import OpenCv.Util
+
+  @default_timeout 5000
+
+  @doc """
+  Returns a view on the `w`x`h` region at `x`,`y`. The view shares the
+  parent's pixels, so no data is copied.
+  """
+  def roi(conn, mat, x, y, w, h, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.mat_roi(conn, ref, self(), {mat, x, y, w, h})
+    receive_answer(ref, timeout)
+  end
+
+  def to_binary(conn, mat, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.mat_to_binary(conn, ref, self(), mat)
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Packs `mat` into a self describing binary (rows, cols, type and step in a
+  24 byte header, then the pixels) that can be sent to another node and
+  turned back into a Mat with `deserialize/3`. Unlike PNG or JPEG nothing
+  is encoded, the pixels are copied once into the binary.
+
+  Options:
+
+    * `:compress` - `:lz4` to compress the pixels. Needs the NIF built with
+      `ERL_CV_LZ4=1`, otherwise returns `{:error, :lz4_unavailable}`.
+  """
+  def serialize(conn, mat, opts \\ [], timeout \\ @default_timeout) do
+    lz4 = Keyword.get(opts, :compress) == :lz4
+
+    ref = make_ref()
+    :ok = :erl_cv_nif.mat_serialize(conn, ref, self(), {mat, lz4})
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Turns a binary made by `serialize/4` back into a Mat. Uncompressed pixels
+  are not copied, the Mat uses the binary's memory and keeps it alive.
+  """
+  def deserialize(conn, binary, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.mat_deserialize(conn, ref, self(), binary)
+    receive_answer(ref, timeout)
+  end
+end
@@ -0,0 +1,57 @@
+defmodule OpenCv.PHash do
+  import OpenCv.Util
+
+  @default_timeout 5000
+
+  @doc """
+  Computes a 64 bit perceptual hash of a Mat, or of a list of Mats.
+  `algorithm` is one of `:ahash`, `:dhash` or `:phash`.
+  """
+  def hash(conn, mats, algorithm \\ :phash, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.phash(conn, ref, self(), {mats, algorithm})
+    receive_answer(ref, timeout)
+  end
+
+  def new_index(conn, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.phash_index_new(conn, ref, self(), nil)
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Inserts a batch of `{hash, id}` entries. Returns the new size of the index.
+  """
+  def insert(conn, index, entries, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.phash_index_insert(conn, ref, self(), {index, entries})
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Returns, for every hash, the `{id, distance}` entries within `radius` bits,
+  closest first.
+  """
+  def query(conn, index, hashes, radius, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.phash_index_query(conn, ref, self(), {index, hashes, radius})
+    receive_answer(ref, timeout)
+  end
+
+  def save(conn, index, filename, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.phash_index_save(conn, ref, self(), {index, filename})
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Memory maps an index written by `save/4`. Inserting into a loaded index
+  copies it into memory first. A file that isn't a complete index gives
+  `{:error, :corrupt}`, one that can't be read `{:error, :read_failed}`.
+  """
+  def load(conn, filename, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.phash_index_load(conn, ref, self(), filename)
+    receive_answer(ref, timeout)
+  end
+end
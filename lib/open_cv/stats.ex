@@ -0,0 +1,55 @@
+defmodule OpenCv.Stats do
+  import OpenCv.Util
+
+  @default_timeout 5000
+
+  @doc """
+  Runs the reductions in `ops` on a Mat, or on every Mat of a list in
+  parallel, and returns a keyword list per Mat.
+
+  Supported ops are `:mean_std_dev`, `:min_max_loc`, `:sharpness` (variance
+  of the Laplacian) and `:histogram`, `{:histogram, bins}` or
+  `{:histogram, bins, {lower, upper}}`. Values are per channel except for
+  sharpness.
+
+  Histograms of 8 and 16 bit Mats cover every value of the depth unless a
+  range is given, float ones the range between the Mat's smallest and
+  largest value. Histograms and sharpness need 8 bit, 16 bit or 32 bit float
+  Mats. A Mat that can't be used gives `{:error, :invalid_mat}`, in place of
+  its keyword list when computing a list.
+  """
+  def compute(conn, mats, ops, timeout \\ @default_timeout) do
+    ops =
+      Enum.map(ops, fn
+        {:histogram, bins, {lower, upper}} -> {:histogram, bins, {lower / 1, upper / 1}}
+        op -> op
+      end)
+
+    ref = make_ref()
+    :ok = :erl_cv_nif.stats(conn, ref, self(), {mats, ops})
+    receive_answer(ref, timeout)
+  end
+
+  def histogram(conn, mat, bins \\ 256, timeout \\ @default_timeout) do
+    single(conn, mat, {:histogram, bins}, :histogram, timeout)
+  end
+
+  def mean_std_dev(conn, mat, timeout \\ @default_timeout) do
+    single(conn, mat, :mean_std_dev, :mean_std_dev, timeout)
+  end
+
+  def min_max_loc(conn, mat, timeout \\ @default_timeout) do
+    single(conn, mat, :min_max_loc, :min_max_loc, timeout)
+  end
+
+  def sharpness(conn, mat, timeout \\ @default_timeout) do
+    single(conn, mat, :sharpness, :sharpness, timeout)
+  end
+
+  defp single(conn, mat, op, key, timeout) do
+    case compute(conn, mat, [op], timeout) do
+      {:ok, stats} -> {:ok, Keyword.fetch!(stats, key)}
+      error -> error
+    end
+  end
+end
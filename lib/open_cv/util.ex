@@ -23,4 +23,24 @@ defmodule OpenCv.Util do
       timeout -> {:error, {:timeout, ref}}
     end
   end
+
+  @doc """
+  Folds `fun` over the `{:frame, index, value}` and `{:chunk, binary}`
+  messages streamed for `ref` until the final answer arrives. `timeout`
+  applies to each message.
+  """
+  def receive_stream(ref, timeout, acc, fun) do
+    receive do
+      {:erl_cv_nif, ^ref, {:frame, _index, _value} = item} ->
+        receive_stream(ref, timeout, fun.(item, acc), fun)
+
+      {:erl_cv_nif, ^ref, {:chunk, _binary} = item} ->
+        receive_stream(ref, timeout, fun.(item, acc), fun)
+
+      {:erl_cv_nif, ^ref, resp} ->
+        {resp, acc}
+    after
+      timeout -> {{:error, {:timeout, ref}}, acc}
+    end
+  end
 end
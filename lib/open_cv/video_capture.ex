@@ -51,4 +51,110 @@ defmodule OpenCv.VideoCapture do
     :ok = :erl_cv_nif.video_capture_set(conn, ref, self(), {cap, propid, propval})
     receive_answer(ref, timeout)
   end
+
+  @doc """
+  Publishes every frame read from `cap` into a POSIX shared memory ring
+  named `name` (e.g. `'/erl_cv_cam0'`), so that local processes can map it
+  and read frames without copies through the VM. See `c_src/erl_cv_ring.h`
+  for the layout and `examples/ring_reader.c` for a reader.
+
+  Options:
+
+    * `:slots` - number of frames kept in the ring (default `8`), at most
+      `1024`.
+    * `:slot_size` - largest frame in bytes (default `1920 * 1080 * 3`), at
+      most 1 GB. The whole ring may not exceed 4 GB.
+      Bigger frames are counted as dropped.
+  """
+  def attach_ring(conn, cap, name, opts \\ [], timeout \\ @default_timeout) do
+    ref = make_ref()
+    slots = Keyword.get(opts, :slots, 8)
+    slot_size = Keyword.get(opts, :slot_size, 1920 * 1080 * 3)
+    :ok = :erl_cv_nif.video_capture_ring(conn, ref, self(), {cap, name, slots, slot_size})
+    receive_answer(ref, timeout)
+  end
+
+  def detach_ring(conn, cap, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.video_capture_ring(conn, ref, self(), {cap, nil})
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Stacks every frame `cap` hands out from now on, to denoise low light
+  footage without sending each frame out:
+
+    * `:average` with `param` the weight of a new frame (`0 < alpha <= 1`),
+      kept as a running weighted average
+    * `:median` with `param` the number of frames in the window (at most 64,
+      8 bit frames only)
+
+  Use `feed/4` to read frames into the stack and `stacked/3` to get it.
+  """
+  def accumulate(conn, cap, kind, param, timeout \\ @default_timeout)
+      when kind in [:average, :median] do
+    ref = make_ref()
+    param = if kind == :average, do: param / 1, else: param
+    :ok = :erl_cv_nif.video_capture_accumulate(conn, ref, self(), {cap, kind, param})
+    receive_answer(ref, timeout)
+  end
+
+  def stop_accumulating(conn, cap, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.video_capture_accumulate(conn, ref, self(), {cap, nil})
+    receive_answer(ref, timeout)
+  end
+
+  def feed(conn, cap, count, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.video_capture_feed(conn, ref, self(), {cap, count})
+    receive_answer(ref, timeout)
+  end
+
+  def stacked(conn, cap, timeout \\ @default_timeout) do
+    ref = make_ref()
+    :ok = :erl_cv_nif.video_capture_stacked(conn, ref, self(), cap)
+    receive_answer(ref, timeout)
+  end
+
+  @doc """
+  Reads frames from `cap` natively and calls `fun.(index, frame)` for the
+  ones it keeps: one every `rate` frames or, for `{:fps, fps}`, `fps` per
+  second of video. Frames in between are only grabbed, never converted
+  into Mats, and the whole run is a single command on the connection.
+
+      VideoCapture.sample(conn, cap, {:fps, 1}, fn index, frame ->
+        jpg = OpenCv.imencode(conn, frame, '.jpg', [])
+        File.write!("thumb_\#{index}.jpg", jpg)
+      end)
+
+  Options:
+
+    * `:max` - stop after this many frames, `0` (default) reads to the end.
+      Required for cameras and streams, which report no frame count and
+      never end, `{:error, :max_required}` otherwise.
+    * `:seek` - jump over skipped frames instead of grabbing them. Worth it
+      for files when the gap is longer than the keyframe interval.
+    * `:timeout` - maximum time to wait for the next frame.
+  """
+  def sample(conn, cap, rate, fun, opts \\ []) do
+    {every, fps} =
+      case rate do
+        {:fps, fps} -> {0, fps / 1}
+        every when is_integer(every) -> {every, 0.0}
+      end
+
+    max = Keyword.get(opts, :max, 0)
+    seek = Keyword.get(opts, :seek, false)
+    timeout = Keyword.get(opts, :timeout, @default_timeout)
+
+    ref = make_ref()
+    :ok = :erl_cv_nif.video_capture_sample(conn, ref, self(), {cap, every, fps, max, seek})
+    reducer = fn {:frame, index, frame}, acc -> [fun.(index, frame) | acc] end
+
+    case receive_stream(ref, timeout, [], reducer) do
+      {{:ok, _count}, results} -> {:ok, Enum.reverse(results)}
+      {error, _} -> error
+    end
+  end
 end
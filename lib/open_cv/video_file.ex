@@ -0,0 +1,105 @@
+defmodule OpenCv.VideoFile do
+  import OpenCv.Util
+
+  @default_timeout 5000
+
+  @doc """
+  Decodes `filename` in parallel, one decoder per segment, and applies `fun`
+  to every `{index, frame}` as it arrives.
+
+  Options:
+
+    * `:segments` - number of segments to decode concurrently. Defaults to the
+      number of CPUs.
+    * `:encode` - `{ext, params}` to encode each frame natively, so `fun`
+      receives a binary instead of a Mat.
+    * `:ordered` - when `true` (default) `fun` is applied in frame order,
+      otherwise in arrival order.
+    * `:window` - in order, at most this many frames are decoded past the
+      last one `fun` was applied to, so segments ahead of a slow one pause
+      instead of piling up frames. Defaults to `32`, `0` lifts the limit.
+    * `:timeout` - maximum time to wait for the next frame.
+
+  Segments start by seeking to their first frame. Whether that lands on the
+  exact frame depends on the backend and container, a segment whose position
+  does not read back as asked fails with `{:error, {:seek_failed, index}}`.
+  A segment that ends before its last frame fails with
+  `{:error, {:short_segment, index}}`, `index` being the first frame it
+  could not read. Either stops the other segments.
+  """
+  def parallel_map(conn, filename, fun, opts \\ []) do
+    segments = Keyword.get(opts, :segments, 0)
+    encode = Keyword.get(opts, :encode)
+    timeout = Keyword.get(opts, :timeout, @default_timeout)
+    ordered = Keyword.get(opts, :ordered, true)
+    window = if ordered, do: Keyword.get(opts, :window, 32), else: 0
+
+    ref = make_ref()
+
+    :ok =
+      :erl_cv_nif.video_file_parallel_map(conn, ref, self(), {filename, segments, encode, window})
+
+    cond do
+      not ordered -> collect(ref, timeout, fun)
+      window == 0 -> collect_ordered(ref, nil, timeout, fun)
+      true -> receive_window(ref, timeout, fun)
+    end
+  end
+
+  defp collect(ref, timeout, fun) do
+    reducer = fn {:frame, index, value}, acc -> [fun.(index, value) | acc] end
+
+    case receive_stream(ref, timeout, [], reducer) do
+      {{:ok, _count}, results} -> {:ok, Enum.reverse(results)}
+      {error, _} -> error
+    end
+  end
+
+  # The window arrives before any frame. Decoders wait on it, so it is
+  # cancelled however the collection ends.
+  defp receive_window(ref, timeout, fun) do
+    receive do
+      {:erl_cv_nif, ^ref, {:window, window}} ->
+        try do
+          collect_ordered(ref, window, timeout, fun)
+        after
+          :erl_cv_nif.video_file_cancel(window)
+        end
+
+      {:erl_cv_nif, ^ref, resp} ->
+        resp
+    after
+      timeout -> {:error, {:timeout, ref}}
+    end
+  end
+
+  # Segments finish out of order, so hold frames back until every earlier
+  # index has been seen.
+  defp collect_ordered(ref, window, timeout, fun) do
+    reducer = fn {:frame, index, value}, {next, pending, acc} ->
+      {flushed, pending, acc} = flush(next, Map.put(pending, index, value), acc, fun)
+      if window && flushed > next, do: :erl_cv_nif.video_file_release(window, flushed)
+      {flushed, pending, acc}
+    end
+
+    case receive_stream(ref, timeout, {0, %{}, []}, reducer) do
+      {{:ok, _count}, {_next, pending, acc}} ->
+        rest =
+          pending
+          |> Enum.sort_by(&elem(&1, 0))
+          |> Enum.map(fn {index, value} -> fun.(index, value) end)
+
+        {:ok, Enum.reverse(acc, rest)}
+
+      {error, _} ->
+        error
+    end
+  end
+
+  defp flush(next, pending, acc, fun) do
+    case Map.pop(pending, next) do
+      {nil, pending} -> {next, pending, acc}
+      {value, pending} -> flush(next + 1, pending, [fun.(next, value) | acc], fun)
+    end
+  end
+end
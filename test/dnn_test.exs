@@ -0,0 +1,101 @@
+defmodule OpenCv.DnnTest.Model do
+  # A network that answers the per channel mean of each input image, so
+  # every reply shows which request it belongs to.
+  @script """
+  import sys
+  import onnx
+  from onnx import helper, TensorProto
+
+  x = helper.make_tensor_value_info('x', TensorProto.FLOAT, ['n', 3, 8, 8])
+  y = helper.make_tensor_value_info('y', TensorProto.FLOAT, ['n', 3])
+  node = helper.make_node('ReduceMean', ['x'], ['y'], axes=[2, 3], keepdims=0)
+  graph = helper.make_graph([node], 'channel_mean', [x], [y])
+  onnx.save(helper.make_model(graph, opset_imports=[helper.make_opsetid('', 13)]), sys.argv[1])
+  """
+
+  def export(path) do
+    with python when python != nil <- System.find_executable("python3"),
+         {_, 0} <- System.cmd(python, ["-c", @script, path], stderr_to_stdout: true) do
+      File.exists?(path)
+    else
+      _ -> false
+    end
+  end
+end
+
+defmodule OpenCv.DnnTest do
+  use ExUnit.Case
+
+  alias OpenCv.{Dnn, Mat, VideoCapture}
+
+  @model Path.join(System.tmp_dir!(), "erl_cv_test_channel_mean.onnx")
+
+  unless OpenCv.DnnTest.Model.export(@model) do
+    @moduletag skip: "exporting the test model needs python3 with the onnx package"
+  end
+
+  setup do
+    {:ok, conn} = OpenCv.new()
+    on_exit(fn -> OpenCv.close(conn) end)
+    %{conn: conn}
+  end
+
+  # An 8x8 Mat filled with one BGR color, made by swapping the pixels of a
+  # serialized frame
+  defp solid(conn, {b, g, r}) do
+    {:ok, cap} = VideoCapture.open(conn, 'synthetic://8x8@30?realtime=0')
+    {:ok, frame} = VideoCapture.read(conn, cap)
+    {:ok, bin} = Mat.serialize(conn, frame)
+
+    header = binary_part(bin, 0, byte_size(bin) - 8 * 8 * 3)
+    {:ok, mat} = Mat.deserialize(conn, header <> :binary.copy(<<b, g, r>>, 8 * 8))
+    mat
+  end
+
+  defp infer_all(net, mats) do
+    mats
+    |> Enum.map(fn mat -> Task.async(fn -> Dnn.infer(net, mat) end) end)
+    |> Enum.map(&Task.await/1)
+  end
+
+  test "each request of a batch gets its own output", %{conn: conn} do
+    {:ok, net} = Dnn.read_net(conn, String.to_charlist(@model), size: {8, 8}, max_batch: 4, max_wait_us: 50_000)
+
+    colors = [{10, 20, 30}, {40, 50, 60}, {70, 80, 90}, {100, 110, 120}, {130, 140, 150}]
+    results = infer_all(net, Enum.map(colors, &solid(conn, &1)))
+
+    for {{b, g, r}, result} <- Enum.zip(colors, results) do
+      assert {:ok, [mb, mg, mr]} = result
+      assert_in_delta mb, b, 0.01
+      assert_in_delta mg, g, 0.01
+      assert_in_delta mr, r, 0.01
+    end
+  end
+
+  test "a bad Mat is refused without failing the rest of the batch", %{conn: conn} do
+    {:ok, net} = Dnn.read_net(conn, String.to_charlist(@model), size: {8, 8}, max_batch: 4, max_wait_us: 50_000)
+    {:ok, empty} = OpenCv.mat(conn)
+
+    assert {:error, :invalid_mat} = Dnn.infer(net, empty)
+
+    [good, bad] = infer_all(net, [solid(conn, {5, 6, 7}), empty])
+    assert {:ok, [b, g, r]} = good
+    assert_in_delta b, 5, 0.01
+    assert_in_delta g, 6, 0.01
+    assert_in_delta r, 7, 0.01
+    assert bad == {:error, :invalid_mat}
+  end
+
+  test "a full batch runs without waiting out max_wait_us", %{conn: conn} do
+    {:ok, net} = Dnn.read_net(conn, String.to_charlist(@model), size: {8, 8}, max_batch: 4, max_wait_us: 500_000)
+    mat = solid(conn, {1, 2, 3})
+
+    # Alone, a request waits for others to join it
+    {lone_us, {:ok, _}} = :timer.tc(fn -> Dnn.infer(net, mat) end)
+    assert lone_us >= 400_000
+
+    {full_us, results} = :timer.tc(fn -> infer_all(net, List.duplicate(mat, 4)) end)
+    assert Enum.all?(results, &match?({:ok, [_, _, _]}, &1))
+    assert full_us < 400_000
+  end
+end
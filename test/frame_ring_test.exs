@@ -0,0 +1,94 @@
+defmodule OpenCv.FrameRingTest do
+  use ExUnit.Case
+  import Bitwise
+
+  alias OpenCv.VideoCapture
+
+  @name '/erl_cv_test_ring'
+  @shm_path "/dev/shm/erl_cv_test_ring"
+  @width 320
+  @height 240
+  @frame_size @width * @height * 3
+
+  # erl_cv_ring.h, ring and slot headers are both 64 bytes
+  @header_size 64
+  @magic 0x474E495256434C45
+  @cv_8uc3 16
+
+  setup do
+    {:ok, conn} = OpenCv.new()
+    {:ok, cap} = VideoCapture.open(conn, 'synthetic://320x240@30?realtime=0')
+    on_exit(fn -> OpenCv.close(conn) end)
+    %{conn: conn, cap: cap}
+  end
+
+  test "frames read from the capture can be read back from the ring", %{conn: conn, cap: cap} do
+    assert :ok = VideoCapture.attach_ring(conn, cap, @name, slots: 4, slot_size: @frame_size)
+
+    pixels =
+      for _ <- 1..6 do
+        {:ok, frame} = VideoCapture.read(conn, cap)
+        {:ok, bin} = OpenCv.Mat.to_binary(conn, frame)
+        bin
+      end
+
+    ring = File.read!(@shm_path)
+
+    <<@magic::little-64, 1::little-32, slot_count::little-32, slot_size::little-64,
+      stride::little-64, head::little-64, dropped::little-64, _::binary-size(16),
+      _::binary>> = ring
+
+    assert slot_count == 4
+    assert slot_size == @frame_size
+    assert rem(stride, 64) == 0
+    assert head == 6
+    assert dropped == 0
+
+    # Frames 3 to 6 are still in the ring, 1 and 2 were overwritten
+    for seq <- 3..6 do
+      offset = @header_size + rem(seq - 1, slot_count) * stride
+
+      <<_::binary-size(offset), lock::little-64, ^seq::little-64, _timestamp::little-64,
+        size::little-64, rows::little-32-signed, cols::little-32-signed, type::little-32-signed,
+        elem_size::little-32-signed, _::binary-size(16), data::binary-size(size),
+        _::binary>> = ring
+
+      assert rem(lock, 2) == 0
+      assert {rows, cols, type, elem_size} == {@height, @width, @cv_8uc3, 3}
+      assert size == @frame_size
+      assert data == Enum.at(pixels, seq - 1)
+    end
+
+    assert :ok = VideoCapture.detach_ring(conn, cap)
+    refute File.exists?(@shm_path)
+  end
+
+  test "attaching again replaces the ring instead of truncating it", %{conn: conn, cap: cap} do
+    assert :ok = VideoCapture.attach_ring(conn, cap, @name, slots: 2, slot_size: @frame_size)
+    {:ok, _frame} = VideoCapture.read(conn, cap)
+    {:ok, old} = File.open(@shm_path, [:read, :binary])
+    {:ok, %File.Stat{inode: old_inode}} = File.stat(@shm_path)
+
+    assert :ok = VideoCapture.attach_ring(conn, cap, @name, slots: 2, slot_size: @frame_size)
+    {:ok, %File.Stat{inode: new_inode}} = File.stat(@shm_path)
+    assert old_inode != new_inode
+
+    # The old object keeps its contents for readers that still have it open
+    {:ok, <<@magic::little-64, _::binary>>} = :file.pread(old, 0, @header_size)
+    File.close(old)
+
+    assert :ok = VideoCapture.detach_ring(conn, cap)
+  end
+
+  test "sizes that would overflow the ring are refused", %{conn: conn, cap: cap} do
+    assert {:error, :invalid_slot_size} =
+             VideoCapture.attach_ring(conn, cap, @name, slot_size: 0xFFFFFFFFFFFFFFFF)
+
+    assert {:error, :invalid_slots} = VideoCapture.attach_ring(conn, cap, @name, slots: 1_000_000)
+
+    assert {:error, :ring_create_failed} =
+             VideoCapture.attach_ring(conn, cap, @name, slots: 1024, slot_size: 1 <<< 30)
+
+    refute File.exists?(@shm_path)
+  end
+end
@@ -0,0 +1,126 @@
+defmodule OpenCv.MatFormatTest do
+  use ExUnit.Case
+
+  alias OpenCv.Mat
+
+  # cv::CV_<depth>C<channels>
+  @types %{
+    u8c1: 0,
+    u8c3: 16,
+    u16c1: 2,
+    s16c2: 11,
+    f32c3: 21,
+    f64c1: 6
+  }
+  @elem_size %{u8c1: 1, u8c3: 3, u16c1: 2, s16c2: 4, f32c3: 12, f64c1: 8}
+
+  setup do
+    {:ok, conn} = OpenCv.new()
+    on_exit(fn -> OpenCv.close(conn) end)
+    %{conn: conn}
+  end
+
+  defp header(rows, cols, type, step, opts \\ []) do
+    magic = Keyword.get(opts, :magic, "ECVM")
+    version = Keyword.get(opts, :version, 1)
+    flags = Keyword.get(opts, :flags, 0)
+
+    <<magic::binary-size(4), version, flags, 0::16, rows::little-32, cols::little-32, type::little-32,
+      step::little-32>>
+  end
+
+  # Every byte differs from its neighbours, so a shifted row shows
+  defp pixels(size), do: for(i <- 0..(size - 1), into: <<>>, do: <<rem(i * 7 + div(i, 251), 256)>>)
+
+  defp make(conn, kind, rows, cols) do
+    row_size = cols * @elem_size[kind]
+    data = pixels(rows * row_size)
+    {:ok, mat} = Mat.deserialize(conn, header(rows, cols, @types[kind], row_size) <> data)
+    {mat, data}
+  end
+
+  test "every type survives a round trip", %{conn: conn} do
+    for kind <- Map.keys(@types) do
+      {mat, data} = make(conn, kind, 9, 11)
+      assert {:ok, ^data} = Mat.to_binary(conn, mat)
+
+      {:ok, bin} = Mat.serialize(conn, mat)
+      assert bin == header(9, 11, @types[kind], 11 * @elem_size[kind]) <> data
+    end
+  end
+
+  test "a ROI is packed without its parent's stride", %{conn: conn} do
+    {mat, data} = make(conn, :u16c1, 10, 12)
+    {:ok, roi} = Mat.roi(conn, mat, 3, 2, 5, 4)
+
+    expected = for row <- 2..5, into: <<>>, do: binary_part(data, row * 24 + 3 * 2, 5 * 2)
+    {:ok, bin} = Mat.serialize(conn, roi)
+    assert bin == header(4, 5, @types[:u16c1], 10) <> expected
+
+    {:ok, back} = Mat.deserialize(conn, bin)
+    assert {:ok, ^expected} = Mat.to_binary(conn, back)
+  end
+
+  test "padded rows are read at their step", %{conn: conn} do
+    rows = for row <- 0..4, into: <<>>, do: pixels(90) <> <<row, row, row, row>>
+    {:ok, mat} = Mat.deserialize(conn, header(5, 30, @types[:u8c3], 94) <> rows)
+
+    {:ok, bin} = Mat.serialize(conn, mat)
+    assert bin == header(5, 30, @types[:u8c3], 90) <> :binary.copy(pixels(90), 5)
+  end
+
+  test "an unaligned sub binary is copied", %{conn: conn} do
+    for kind <- [:u16c1, :f32c3, :f64c1] do
+      {mat, data} = make(conn, kind, 6, 7)
+      {:ok, bin} = Mat.serialize(conn, mat)
+
+      # Starts one byte into its parent, off the element alignment
+      unaligned = binary_part(<<0>> <> bin, 1, byte_size(bin))
+      {:ok, back} = Mat.deserialize(conn, unaligned)
+      assert {:ok, ^data} = Mat.to_binary(conn, back)
+    end
+  end
+
+  test "lz4 payloads round trip", %{conn: conn} do
+    {mat, data} = make(conn, :f32c3, 16, 16)
+    {:ok, roi} = Mat.roi(conn, mat, 4, 4, 8, 8)
+    {:ok, expected} = Mat.to_binary(conn, roi)
+
+    case Mat.serialize(conn, mat, compress: :lz4) do
+      {:error, :lz4_unavailable} ->
+        :ok
+
+      {:ok, bin} ->
+        {:ok, back} = Mat.deserialize(conn, bin)
+        assert {:ok, ^data} = Mat.to_binary(conn, back)
+
+        {:ok, bin} = Mat.serialize(conn, roi, compress: :lz4)
+        {:ok, back} = Mat.deserialize(conn, bin)
+        assert {:ok, ^expected} = Mat.to_binary(conn, back)
+    end
+  end
+
+  test "bad headers are refused", %{conn: conn} do
+    type = @types[:u8c3]
+    data = pixels(4 * 30)
+
+    assert {:error, :invalid_binary} = Mat.deserialize(conn, binary_part(header(4, 10, type, 30), 0, 23))
+    assert {:error, :invalid_header} = Mat.deserialize(conn, header(4, 10, type, 30, magic: "ECVX") <> data)
+    assert {:error, :invalid_header} = Mat.deserialize(conn, header(4, 10, type, 30, version: 2) <> data)
+    assert {:error, :invalid_header} = Mat.deserialize(conn, header(0x80000000, 10, type, 30) <> data)
+    assert {:error, :invalid_header} = Mat.deserialize(conn, header(4, 10, 0x1000, 30) <> data)
+    assert {:error, :invalid_header} = Mat.deserialize(conn, header(4, 10, type, 29) <> data)
+
+    # The payload must be exactly rows * step
+    assert {:error, :invalid_size} = Mat.deserialize(conn, header(4, 10, type, 30) <> binary_part(data, 0, 119))
+    assert {:error, :invalid_size} = Mat.deserialize(conn, header(4, 10, type, 30) <> data <> <<0>>)
+
+    # Dimensions far beyond the payload never allocate
+    assert {:error, :invalid_size} = Mat.deserialize(conn, header(0x7FFFFFFF, 0xFFFF, type, 0x2FFFD) <> data)
+
+    assert {:error, reason} =
+             Mat.deserialize(conn, header(0x7FFFFFFF, 0xFFFF, type, 0x2FFFD, flags: 1) <> data)
+
+    assert reason in [:invalid_header, :lz4_unavailable]
+  end
+end
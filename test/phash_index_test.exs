@@ -0,0 +1,95 @@
+defmodule OpenCv.PHashIndexTest do
+  use ExUnit.Case
+
+  import Bitwise
+
+  alias OpenCv.PHash
+
+  @path Path.join(System.tmp_dir!(), "erl_cv_test_phash.idx")
+
+  setup do
+    {:ok, conn} = OpenCv.new()
+
+    on_exit(fn ->
+      OpenCv.close(conn)
+      File.rm(@path)
+    end)
+
+    :rand.seed(:exsss, {1, 2, 3})
+    %{conn: conn, hashes: hashes(2000)}
+  end
+
+  defp random_hash, do: :rand.uniform(1 <<< 64) - 1
+
+  defp flip(hash, bits) do
+    Enum.reduce(1..bits, hash, fn _, h -> bxor(h, 1 <<< (:rand.uniform(64) - 1)) end)
+  end
+
+  # Clusters of near duplicates, so queries have matches at every radius
+  defp hashes(count) do
+    Enum.reduce(1..count, [], fn
+      _, [] -> [random_hash()]
+      i, acc when rem(i, 5) == 0 -> [random_hash() | acc]
+      _, [last | _] = acc -> [flip(last, :rand.uniform(6)) | acc]
+    end)
+    |> Enum.reverse()
+  end
+
+  defp distance(a, b), do: bxor(a, b) |> Integer.digits(2) |> Enum.sum()
+
+  defp scan(entries, hash, radius) do
+    for {h, id} <- entries, (d = distance(h, hash)) <= radius do
+      {id, d}
+    end
+    |> Enum.sort_by(fn {id, d} -> {d, id} end)
+  end
+
+  defp assert_matches_scan(conn, index, entries) do
+    queries = Enum.map(1..100, fn _ -> entries |> Enum.random() |> elem(0) |> flip(:rand.uniform(8)) end)
+
+    # Up to 11 bits probes buckets, beyond that the index scans
+    for radius <- [0, 3, 7, 11, 16, 24] do
+      {:ok, results} = PHash.query(conn, index, queries, radius)
+
+      for {hash, found} <- Enum.zip(queries, results) do
+        assert found == scan(entries, hash, radius)
+      end
+    end
+  end
+
+  test "queries agree with a linear scan, also after a save and load", %{conn: conn, hashes: hashes} do
+    entries = Enum.with_index(hashes)
+    {:ok, index} = PHash.new_index(conn)
+    assert {:ok, 2000} = PHash.insert(conn, index, entries)
+    assert_matches_scan(conn, index, entries)
+
+    assert :ok = PHash.save(conn, index, String.to_charlist(@path))
+    {:ok, loaded} = PHash.load(conn, String.to_charlist(@path))
+    assert_matches_scan(conn, loaded, entries)
+  end
+
+  test "corrupt index files are refused", %{conn: conn, hashes: hashes} do
+    {:ok, index} = PHash.new_index(conn)
+    {:ok, _} = PHash.insert(conn, index, Enum.with_index(hashes))
+    :ok = PHash.save(conn, index, String.to_charlist(@path))
+    <<magic::binary-size(8), count::little-64, rest::binary>> = File.read!(@path)
+    assert count == 2000
+
+    load = fn bin ->
+      File.write!(@path, bin)
+      PHash.load(conn, String.to_charlist(@path))
+    end
+
+    # A count whose table sizes would wrap
+    assert {:error, :corrupt} = load.(<<magic::binary, (1 <<< 58) + count::little-64, rest::binary>>)
+    assert {:error, :corrupt} = load.(<<magic::binary, count::little-64, binary_part(rest, 0, byte_size(rest) - 1)::binary>>)
+    assert {:error, :corrupt} = load.(<<"NOTANIDX", count::little-64, rest::binary>>)
+
+    # The first offsets table follows the entries, make it run past the postings
+    offset = count * 16 + 4 * 100
+    <<before::binary-size(offset), _::binary-size(4), tail::binary>> = rest
+    assert {:error, :corrupt} = load.(<<magic::binary, count::little-64, before::binary, 0xFFFFFF00::little-32, tail::binary>>)
+
+    assert {:error, :read_failed} = PHash.load(conn, '/nonexistent/erl_cv.idx')
+  end
+end
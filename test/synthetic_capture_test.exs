@@ -0,0 +1,86 @@
+defmodule OpenCv.SyntheticCaptureTest do
+  use ExUnit.Case
+
+  alias OpenCv.VideoCapture
+
+  @width 320
+  @url 'synthetic://320x240@30?pattern=noise&noise=8&seed=7&realtime=0'
+
+  # cv::CAP_PROP_*
+  @pos_frames 1
+  @frame_count 7
+
+  setup do
+    {:ok, conn} = OpenCv.new()
+    on_exit(fn -> OpenCv.close(conn) end)
+    %{conn: conn}
+  end
+
+  # The index is drawn as 32 blocks of 8x8 pixels along the top edge, most
+  # significant bit first, white for 1. Sample the middle of each block.
+  defp frame_index(conn, frame) do
+    {:ok, <<row::binary-size(@width * 3), _::binary>>} = OpenCv.Mat.to_binary(conn, frame)
+
+    Enum.reduce(0..31, 0, fn bit, acc ->
+      <<_::binary-size((bit * 8 + 4) * 3), blue, _::binary>> = row
+      acc * 2 + if blue == 255, do: 1, else: 0
+    end)
+  end
+
+  defp read_pixels(conn, cap, count) do
+    for _ <- 1..count do
+      {:ok, frame} = VideoCapture.read(conn, cap)
+      {:ok, bin} = OpenCv.Mat.to_binary(conn, frame)
+      bin
+    end
+  end
+
+  test "the same url renders the same frames", %{conn: conn} do
+    {:ok, a} = VideoCapture.open(conn, @url)
+    {:ok, b} = VideoCapture.open(conn, @url)
+
+    assert read_pixels(conn, a, 5) == read_pixels(conn, b, 5)
+  end
+
+  test "a different seed renders different frames", %{conn: conn} do
+    {:ok, a} = VideoCapture.open(conn, @url)
+    {:ok, b} = VideoCapture.open(conn, 'synthetic://320x240@30?pattern=noise&noise=8&seed=8&realtime=0')
+
+    assert read_pixels(conn, a, 1) != read_pixels(conn, b, 1)
+  end
+
+  test "every frame carries its index", %{conn: conn} do
+    {:ok, cap} = VideoCapture.open(conn, @url)
+
+    for index <- 0..9 do
+      {:ok, frame} = VideoCapture.read(conn, cap)
+      assert frame_index(conn, frame) == index
+    end
+  end
+
+  test "frames= ends the stream", %{conn: conn} do
+    {:ok, cap} = VideoCapture.open(conn, 'synthetic://320x240@30?frames=3&realtime=0')
+
+    assert VideoCapture.get(conn, cap, @frame_count) == 3.0
+    assert length(read_pixels(conn, cap, 3)) == 3
+    assert VideoCapture.read(conn, cap) == false
+    assert VideoCapture.grab(conn, cap) == false
+  end
+
+  test "POS_FRAMES seeks to the frame it reports", %{conn: conn} do
+    {:ok, cap} = VideoCapture.open(conn, @url)
+
+    assert VideoCapture.get(conn, cap, @pos_frames) == 0.0
+    assert VideoCapture.set(conn, cap, @pos_frames, 42.0) == true
+    assert VideoCapture.get(conn, cap, @pos_frames) == 42.0
+
+    {:ok, frame} = VideoCapture.read(conn, cap)
+    assert frame_index(conn, frame) == 42
+    assert VideoCapture.get(conn, cap, @pos_frames) == 43.0
+
+    # Seeking back renders the frame seen before
+    [first] = read_pixels(conn, cap, 1)
+    assert VideoCapture.set(conn, cap, @pos_frames, 43.0) == true
+    assert read_pixels(conn, cap, 1) == [first]
+  end
+end